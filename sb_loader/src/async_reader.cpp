@@ -0,0 +1,140 @@
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "fmt/format.h"
+#include "async_reader.h"
+
+int VerifyAsyncReads(ReaderPool & readers, const std::string & filename, int max_concurrency)
+{
+	struct Read
+	{
+		int t;
+		int c;
+		int z;
+		std::vector<UInt16> expected;
+		std::vector<UInt16> actual;
+	};
+	std::vector<Read> reads;
+	int captures;
+	{
+		ReaderPool::Lease reader = readers.Acquire(filename);
+		captures = reader->GetNumCaptures();
+		if (captures == 0)
+		{
+			fmt::print("async reads: no captures to read\n");
+			return 0;
+		}
+		std::size_t pixels = (std::size_t)reader->GetNumXColumns(0) * reader->GetNumYRows(0);
+		for (int t = 0; t < reader->GetNumTimepoints(0) && reads.size() < 64; t++)
+		{
+			for (int c = 0; c < reader->GetNumChannels(0) && reads.size() < 64; c++)
+			{
+				for (int z = 0; z < reader->GetNumZPlanes(0) && reads.size() < 64; z++)
+				{
+					reads.push_back(Read{ t, c, z, std::vector<UInt16>(pixels), std::vector<UInt16>(pixels) });
+					reader->ReadImagePlaneBuf(reads.back().expected.data(), 0, 0, t, z, c);
+				}
+			}
+		}
+	}
+
+	int failures = 0;
+	auto report = [&](const std::string & name, const std::string & problem)
+	{
+		fmt::print("  {:<28} {}\n", name, problem.empty() ? std::string("ok") : problem);
+		failures += !problem.empty();
+	};
+	AsyncPlaneReader async(readers, filename, max_concurrency);
+	fmt::print("async reads: {} planes of capture 0 at once, up to {} concurrently\n", reads.size(), async.MaxConcurrency());
+
+	// every read queued before any is waited for, alternately by callback
+	// and by future
+	std::mutex mutex;
+	std::condition_variable finished;
+	std::set<std::thread::id> threads;
+	std::size_t callbacks = 0;
+	std::size_t called = 0;
+	std::size_t errors = 0;
+	std::vector<std::future<void>> futures;
+	for (std::size_t i = 0; i < reads.size(); i++)
+	{
+		Read & read = reads[i];
+		if (i % 2)
+		{
+			futures.push_back(async.ReadPlaneAsync(0, 0, read.t, read.z, read.c, read.actual.data()));
+			continue;
+		}
+		callbacks++;
+		async.ReadPlaneAsync(0, 0, read.t, read.z, read.c, read.actual.data(), [&](std::exception_ptr error)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.insert(std::this_thread::get_id());
+			errors += error != nullptr;
+			called++;
+			finished.notify_all();
+		});
+	}
+	fmt::print("  {} of {} reads pending once queued\n", async.Pending(), reads.size());
+	for (auto & future : futures)
+	{
+		try
+		{
+			future.get();
+		}
+		catch (const std::exception &)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			errors++;
+		}
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&] { return called == callbacks; });
+	}
+	std::size_t wrong = 0;
+	for (auto & read : reads)
+	{
+		wrong += read.actual != read.expected;
+	}
+	report("reads completed", errors == 0 && wrong == 0 ? "" : fmt::format("{} failed, {} differ", errors, wrong));
+	report("all reads retired", async.Pending() == 0 ? "" : fmt::format("{} still pending", async.Pending()));
+	report("concurrency cap", (int)threads.size() <= async.MaxConcurrency() ? ""
+		: fmt::format("callbacks ran on {} threads", threads.size()));
+
+	// a capture past the last
+	std::vector<UInt16> scratch(reads.empty() ? 1 : reads.front().expected.size());
+	auto kind = [](std::exception_ptr error) -> std::string
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (const std::runtime_error &)
+		{
+			return "";
+		}
+		catch (...)
+		{
+			return "not a std::runtime_error";
+		}
+	};
+	std::exception_ptr futureError;
+	try
+	{
+		async.ReadPlaneAsync(captures, 0, 0, 0, 0, scratch.data()).get();
+	}
+	catch (...)
+	{
+		futureError = std::current_exception();
+	}
+	report("error through future", futureError ? kind(futureError) : "no error");
+	std::promise<std::exception_ptr> callbackError;
+	async.ReadPlaneAsync(captures, 0, 0, 0, 0, scratch.data(), [&](std::exception_ptr error)
+	{
+		callbackError.set_value(error);
+	});
+	std::exception_ptr error = callbackError.get_future().get();
+	report("error through callback", error ? kind(error) : "no error");
+	return failures;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+#include "reader_pool.h"
+#include "thread_pool.h"
+
+// Non-blocking plane reads for event driven callers. ReadPlaneAsync only
+// queues the read and returns; the read runs on one of max_concurrency
+// threads with a reader of its own from the pool, so at most that many
+// reads of the file are in flight (fewer if the pool's limit per file is
+// lower), and any number may be queued.
+//
+// Reader exceptions are delivered as std::runtime_error, through the
+// callback's exception_ptr or the future.
+class AsyncPlaneReader
+{
+public:
+	using Callback = std::function<void(std::exception_ptr error)>;
+
+	AsyncPlaneReader(ReaderPool & readers, const std::string & filename, int max_concurrency)
+		: readers(readers)
+		, filename(filename)
+		, limit(std::max(1, max_concurrency))
+		, threads(limit)
+	{
+	}
+
+	~AsyncPlaneReader()
+	{
+		// let the queued reads finish while their buffers are expected
+		threads.Wait();
+	}
+
+	AsyncPlaneReader(const AsyncPlaneReader &) = delete;
+	AsyncPlaneReader & operator=(const AsyncPlaneReader &) = delete;
+
+	// Reads the plane into buffer, which has to stay valid until done is
+	// called on a reader thread (with a null error on success).
+	void ReadPlaneAsync(int capture, int position, int t, int z, int c, UInt16 * buffer, Callback done)
+	{
+		pending++;
+		threads.Post([=, this, done = std::move(done)]
+		{
+			std::exception_ptr error;
+			try
+			{
+				ReaderPool::Lease reader = readers.Acquire(filename);
+				if (!reader->ReadImagePlaneBuf(buffer, capture, position, t, z, c))
+				{
+					throw std::runtime_error(fmt::format("unable to read capture {} position {} t {} z {} c {}", capture, position, t, z, c));
+				}
+			}
+			catch (const III::Exception * e)
+			{
+				error = std::make_exception_ptr(std::runtime_error(e->GetDescription()));
+				delete e;
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+			pending--;
+			done(error);
+		});
+	}
+
+	// As above, completing the returned future instead.
+	std::future<void> ReadPlaneAsync(int capture, int position, int t, int z, int c, UInt16 * buffer)
+	{
+		auto promise = std::make_shared<std::promise<void>>();
+		std::future<void> future = promise->get_future();
+		ReadPlaneAsync(capture, position, t, z, c, buffer, [promise](std::exception_ptr error)
+		{
+			if (error)
+			{
+				promise->set_exception(error);
+			}
+			else
+			{
+				promise->set_value();
+			}
+		});
+		return future;
+	}
+
+	// Reads queued or running.
+	int Pending() const
+	{
+		return pending;
+	}
+
+	int MaxConcurrency() const
+	{
+		return limit;
+	}
+
+private:
+	ReaderPool & readers;
+	std::string filename;
+	int limit;
+	std::atomic<int> pending{ 0 };
+	util::ThreadPool threads;
+};
+
+// Reads up to 64 planes of the first capture all at once, half through
+// callbacks and half through futures, and compares them with the same
+// planes read in turn; then reads a capture past the last, which has to fail
+// with a std::runtime_error either way. Prints each check; returns how many
+// failed.
+int VerifyAsyncReads(ReaderPool & readers, const std::string & filename, int max_concurrency);
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+#include "npy.h"
+
+namespace detail
+{
+	inline void WriteAuxFile(const std::string & path, const void * data, std::size_t bytes)
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write((const char *)data, (std::streamsize)bytes);
+		if (!out)
+		{
+			throw std::runtime_error(fmt::format("unable to write {}", path));
+		}
+	}
+
+	// A one dimensional .npy of count values of descr.
+	template <typename T>
+	void WriteAuxColumn(const std::string & path, const std::string & descr, const std::vector<T> & values)
+	{
+		std::string header = NpyHeader(descr, { (UInt64)values.size() });
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(header.data(), (std::streamsize)header.size());
+		out.write((const char *)values.data(), (std::streamsize)(values.size() * sizeof(T)));
+		if (!out)
+		{
+			throw std::runtime_error(fmt::format("unable to write {}", path));
+		}
+	}
+
+	// The text of attribute or element name in xml, whichever comes first,
+	// matched without regard to case, or empty.
+	inline std::string XmlValue(const std::string & xml, const std::string & name)
+	{
+		auto same = [](char a, char b) { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); };
+		for (auto at = xml.begin(); (at = std::search(at, xml.end(), name.begin(), name.end(), same)) != xml.end(); ++at)
+		{
+			if (at != xml.begin() && (std::isalnum((unsigned char)at[-1]) || at[-1] == '_'))
+			{
+				continue;
+			}
+			std::size_t i = (at - xml.begin()) + name.size();
+			while (i < xml.size() && std::isspace((unsigned char)xml[i]))
+			{
+				i++;
+			}
+			if (i < xml.size() && xml[i] == '=')
+			{
+				std::size_t open = xml.find_first_of("\"'", i);
+				std::size_t close = open == std::string::npos ? open : xml.find(xml[open], open + 1);
+				if (close != std::string::npos)
+				{
+					return xml.substr(open + 1, close - open - 1);
+				}
+			}
+			else if (i < xml.size() && xml[i] == '>')
+			{
+				std::size_t close = xml.find('<', i);
+				if (close != std::string::npos)
+				{
+					std::string text = xml.substr(i + 1, close - i - 1);
+					text.erase(0, text.find_first_not_of(" \t\r\n"));
+					text.erase(text.find_last_not_of(" \t\r\n") + 1);
+					return text;
+				}
+			}
+		}
+		return "";
+	}
+
+	// The value type a channel's descriptor names, as the type recorded in
+	// aux.json, or empty where it names none this can read. SBReadFile.h does
+	// not define the codes GetAuxDataNumElements reports, so a channel is only
+	// read through a typed getter on its descriptor's word.
+	inline std::string AuxType(const std::string & descriptor)
+	{
+		for (const char * name : { "ValueType", "DataType", "Type" })
+		{
+			std::string value = XmlValue(descriptor, name);
+			std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+			if (value.empty())
+			{
+				continue;
+			}
+			if (value.find("double") != std::string::npos)
+			{
+				return "float64";
+			}
+			if (value.find("float") != std::string::npos || value.find("single") != std::string::npos)
+			{
+				return "float32";
+			}
+			if (value.find("serial") != std::string::npos || value.find("string") != std::string::npos
+				|| value.find("text") != std::string::npos || value.find("blob") != std::string::npos)
+			{
+				return "serialized";
+			}
+			if (value.find("int") != std::string::npos || value.find("long") != std::string::npos)
+			{
+				return "int32";
+			}
+		}
+		return "";
+	}
+
+	// Reads the descriptor of a channel, empty when there is no such channel.
+	// The reader reports an index past the last channel as a failed lookup;
+	// anything worse is an error. SBReadFile.h gives no way to size the
+	// descriptor, so it is read into a buffer of kMaxDescriptorBytes and one
+	// that fills it is refused.
+	inline std::string AuxDescriptor(III::SBReadFile * reader, int capture, std::size_t channel)
+	{
+		const std::size_t kMaxDescriptorBytes = 1 << 20;
+		std::vector<char> buffer(kMaxDescriptorBytes, '\0');
+		try
+		{
+			if (!reader->GetAuxDataXMLDescriptor(capture, channel, buffer.data()))
+			{
+				reader->Clear();
+				return "";
+			}
+		}
+		catch (const III::Exception * e)
+		{
+			UInt32 state = e->RdState();
+			std::string description = e->GetDescription();
+			delete e;
+			if (state & (III::SBReadFile::eBadbit | III::SBReadFile::eUncategorized))
+			{
+				throw std::runtime_error(fmt::format("unable to read auxiliary channel {}: {}", channel, description));
+			}
+			reader->Clear();
+			return "";
+		}
+		std::size_t length = strnlen(buffer.data(), buffer.size());
+		if (length == buffer.size())
+		{
+			throw std::runtime_error(fmt::format("descriptor of auxiliary channel {} is {} bytes or longer", channel, buffer.size()));
+		}
+		return std::string(buffer.data(), length);
+	}
+
+	// Reads a numeric channel with one call and writes it as a column.
+	template <typename T, typename Read>
+	void ExportAuxColumn(const std::string & path, const std::string & descr, std::size_t elements, Read read)
+	{
+		std::vector<T> values(elements);
+		if (!read(values.data(), elements))
+		{
+			throw std::runtime_error(fmt::format("unable to read the auxiliary data for {}", path));
+		}
+		WriteAuxColumn(path, descr, values);
+	}
+}
+
+// Writes the auxiliary data channels of a capture (stage temperature, laser
+// power and the like) to directory, one set of files per channel:
+//
+//   channel<n>.xml                  the channel's XML descriptor
+//   channel<n>.npy                  float32, float64 or int32 values
+//   channel<n>_offsets.npy          serialized channels: element i is
+//   channel<n>.bin                  bytes offsets[i] to offsets[i + 1]
+//
+// and aux.json listing them. The reader has no channel count, so channels
+// are taken until one has no descriptor; empty channels are listed and
+// skipped. A channel whose
+// descriptor names no type keeps only its descriptor, as "unverified".
+// Numeric channels are read in a single call each; the reader hands out
+// serialized elements one at a time. Returns the number of channels.
+inline int ExportAuxData(III::SBReadFile * reader, int capture, const std::string & directory)
+{
+	std::filesystem::create_directories(directory);
+	std::string entries;
+	std::size_t channel = 0;
+	for (;; channel++)
+	{
+		std::string descriptor = detail::AuxDescriptor(reader, capture, channel);
+		if (descriptor.empty())
+		{
+			break;
+		}
+
+		int type_code = -1;
+		std::size_t elements;
+		try
+		{
+			elements = reader->GetAuxDataNumElements(capture, channel, &type_code);
+		}
+		catch (const III::Exception * e)
+		{
+			std::string description = e->GetDescription();
+			delete e;
+			throw std::runtime_error(fmt::format("unable to count auxiliary channel {}: {}", channel, description));
+		}
+
+		std::string name = fmt::format("channel{}", channel);
+		detail::WriteAuxFile(directory + "/" + name + ".xml", descriptor.data(), descriptor.size());
+
+		std::string type = detail::AuxType(descriptor);
+		std::string files;
+		const std::string column = directory + "/" + name + ".npy";
+		if (type.empty())
+		{
+			type = "unverified";
+			fmt::print("auxiliary channel {}: descriptor names no value type (code {}), keeping only the descriptor\n", channel, type_code);
+		}
+		else if (elements == 0)
+		{
+			// nothing to read
+		}
+		else if (type == "float32")
+		{
+			detail::ExportAuxColumn<float>(column, "<f4", elements, [&](float * values, std::size_t count)
+			{
+				return reader->GetAuxFloatData(capture, channel, values, count);
+			});
+		}
+		else if (type == "float64")
+		{
+			detail::ExportAuxColumn<double>(column, "<f8", elements, [&](double * values, std::size_t count)
+			{
+				return reader->GetAuxDoubleData(capture, channel, values, count);
+			});
+		}
+		else if (type == "int32")
+		{
+			detail::ExportAuxColumn<SInt32>(column, "<i4", elements, [&](SInt32 * values, std::size_t count)
+			{
+				return reader->GetAuxSInt32Data(capture, channel, values, count);
+			});
+		}
+		else
+		{
+			std::vector<UInt64> offsets(1, 0);
+			std::vector<char> blob;
+			for (std::size_t element = 0; element < elements; element++)
+			{
+				int bytes = std::max(0, reader->GetAuxSerializedData(capture, channel, element, nullptr, 0));
+				blob.resize(offsets.back() + bytes);
+				if (bytes > 0 && !reader->GetAuxSerializedData(capture, channel, element, blob.data() + offsets.back(), bytes))
+				{
+					throw std::runtime_error(fmt::format("unable to read element {} of auxiliary channel {}", element, channel));
+				}
+				offsets.push_back(offsets.back() + bytes);
+			}
+			detail::WriteAuxColumn(directory + "/" + name + "_offsets.npy", "<u8", offsets);
+			detail::WriteAuxFile(directory + "/" + name + ".bin", blob.data(), blob.size());
+			files = fmt::format(", \"offsets\": \"{}_offsets.npy\", \"data\": \"{}.bin\"", name, name);
+		}
+		if (files.empty() && elements > 0 && type != "unverified")
+		{
+			files = fmt::format(", \"data\": \"{}.npy\"", name);
+		}
+		entries += fmt::format("{}    {{ \"channel\": {}, \"type_code\": {}, \"type\": \"{}\", \"elements\": {}, \"descriptor\": \"{}.xml\"{} }}",
+			entries.empty() ? "" : ",\n", channel, type_code, type, elements, name, files);
+	}
+
+	std::string index = fmt::format("{{\n  \"capture\": {},\n  \"channels\": [\n{}{}  ]\n}}\n", capture, entries,
+		entries.empty() ? "" : "\n");
+	detail::WriteAuxFile(directory + "/aux.json", index.data(), index.size());
+	return (int)channel;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include "morphology.h"
+#include "plane_transform.h"
+
+// Background subtraction by white tophat: each UInt16 plane has its
+// morphological opening (erosion then dilation) with a square of side
+// 2 * radius + 1 subtracted. Structures narrower than the square are kept,
+// smooth background and features wider than it are removed.
+class BackgroundTransform : public PlaneTransform
+{
+public:
+	explicit BackgroundTransform(int radius)
+		: radius(radius)
+	{
+		if (radius < 1)
+		{
+			throw std::runtime_error(fmt::format("background radius must be at least 1, got {}", radius));
+		}
+	}
+
+	std::string Name() const override
+	{
+		return fmt::format("tophat background subtraction (radius {})", radius);
+	}
+
+	void Apply(UInt8 * plane, const PlaneShape & in, const PlaneCoord &) const override
+	{
+		// per thread scratch, reused from plane to plane
+		thread_local std::vector<UInt16> opening;
+		thread_local std::vector<UInt16> scratch;
+		const std::size_t pixels = (std::size_t)in.width * in.height;
+		opening.resize(pixels);
+		std::memcpy(opening.data(), plane, pixels * sizeof(UInt16));
+		util::Erode(opening.data(), in.width, in.height, radius, scratch);
+		util::Dilate(opening.data(), in.width, in.height, radius, scratch);
+		util::SubtractSaturate((UInt16 *)plane, opening.data(), pixels);
+	}
+
+	std::vector<std::pair<std::string, std::string>> Metadata() const override
+	{
+		return { { "background", fmt::format("{{\"method\": \"tophat\", \"radius\": {}}}", radius) } };
+	}
+
+private:
+	int radius;
+};
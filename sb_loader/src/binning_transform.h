@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include "plane_transform.h"
+#include "simd.h"
+
+// XY binning of UInt16 planes by 2, 3 or 4, keeping the mean or the
+// saturated sum of each bin. Edge pixels that do not fill a whole bin are
+// dropped.
+class BinningTransform : public PlaneTransform
+{
+public:
+	BinningTransform(int factor, bool mean)
+		: factor(factor)
+		, mean(mean)
+	{
+		if (factor < 2 || factor > 4)
+		{
+			throw std::runtime_error(fmt::format("bin factor must be 2, 3 or 4, got {}", factor));
+		}
+	}
+
+	std::string Name() const override
+	{
+		return fmt::format("{0}x{0} {1} binning", factor, mean ? "mean" : "sum");
+	}
+
+	PlaneShape OutputShape(const PlaneShape & in) const override
+	{
+		if (in.width < factor || in.height < factor)
+		{
+			throw std::runtime_error(fmt::format("{}x{} planes are too small for {}x{} binning", in.width, in.height, factor, factor));
+		}
+		return PlaneShape{ in.width / factor, in.height / factor, in.pixel_bytes };
+	}
+
+	void Apply(UInt8 * plane, const PlaneShape & in, const PlaneCoord &) const override
+	{
+		thread_local std::vector<UInt32> row;
+		UInt16 * pixels = (UInt16 *)plane;
+		switch (factor)
+		{
+		case 2:
+			util::BinPlane<2>(pixels, in.width, in.height, pixels, mean, row);
+			break;
+		case 3:
+			util::BinPlane<3>(pixels, in.width, in.height, pixels, mean, row);
+			break;
+		default:
+			util::BinPlane<4>(pixels, in.width, in.height, pixels, mean, row);
+			break;
+		}
+	}
+
+	std::vector<std::pair<std::string, std::string>> Metadata() const override
+	{
+		return { { "binning", fmt::format("{{\"factor\": {}, \"mode\": \"{}\"}}", factor, mean ? "mean" : "sum") } };
+	}
+
+	int Factor() const
+	{
+		return factor;
+	}
+
+private:
+	int factor;
+	bool mean;
+};
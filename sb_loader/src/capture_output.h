@@ -0,0 +1,63 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include "dimension_order.h"
+#include "npy.h"
+#include "options.h"
+#include "plane_transform.h"
+#include "sb_loader.h"
+#include "stack_output.h"
+
+inline std::string CaptureOutputBase(const ConvertOptions & options, CaptureDataFrame & cp)
+{
+	return fmt::format("{}/{}_{}_{}", options.output_dir, util::FileStem(options.filename),
+		cp.GetCaptureIndexString(), cp.GetPositionIndexString());
+}
+
+// Path of the array file for the capture and position selected in cp.
+inline std::string CaptureOutputPath(const ConvertOptions & options, CaptureDataFrame & cp)
+{
+	return CaptureOutputBase(options, cp) + "." + options.format;
+}
+
+// Opens the output for the capture and position selected in cp. Pixels are
+// laid out in the plan's dimension order in every format; npy adds the NumPy
+// header in front of them and a JSON sidecar with the capture metadata and
+// whatever the transform stages report.
+//
+// With keep set, an existing output is written into in place, keeping the
+// data of planes that are not written again.
+inline std::unique_ptr<StackOutput> OpenCaptureOutput(const ConvertOptions & options, CaptureDataFrame & cp,
+	const DimensionPlan & plan, const TransformChain & transforms, PlaneWriter & writer, PlanePool & pool, bool keep = false)
+{
+	std::string base = CaptureOutputBase(options, cp);
+
+	if (options.format == "raw")
+	{
+		return std::unique_ptr<StackOutput>(new StackOutput(base + ".raw", writer, pool, options.direct, keep));
+	}
+	if (options.format == "npy")
+	{
+		// an existing header keeps its padding so the data stays put
+		UInt64 kept_offset = keep ? NpyDataOffset(base + ".npy") : 0;
+		std::unique_ptr<StackOutput> output(new StackOutput(base + ".npy", writer, pool, options.direct, keep));
+		// a block sized header keeps direct plane writes aligned
+		std::string header = NpyHeader(plan.pixel_bytes == 1 ? "|u1" : "<u2", plan.Shape(),
+			kept_offset ? kept_offset : output->IsDirect() ? kDirectIoAlignment : 64);
+		output->data_offset = header.size();
+		output->WriteHeader(header.data(), header.size());
+
+		auto extra = transforms.Metadata();
+		extra.insert(extra.begin(), { "axes", util::JsonString(plan.order.String()) });
+		std::ofstream sidecar(base + ".json");
+		PlaneShape shape = transforms.OutputShape({ cp.xDim, cp.yDim, sizeof(UInt16) });
+		sidecar << cp.GetDetailJson(extra, shape.width, shape.height);
+		if (!sidecar)
+		{
+			throw std::runtime_error(fmt::format("unable to write {}.json", base));
+		}
+		return output;
+	}
+	throw std::runtime_error(fmt::format("unknown output format: {}", options.format));
+}
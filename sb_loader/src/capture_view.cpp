@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <string>
+#include "capture_view.h"
+
+namespace
+{
+	// Planes of odd sizes whose pixels follow from their position alone.
+	class PatternSource : public PlaneSource
+	{
+	public:
+		PatternSource()
+			: extent{ 37, 23, 2, 3, 2, 5 }
+		{
+		}
+
+		int Captures() const override
+		{
+			return 1;
+		}
+
+		const CaptureExtent & Extent(int) const override
+		{
+			return extent;
+		}
+
+		void Read(const PlaneKey & key, UInt16 * buffer) override
+		{
+			for (int y = 0; y < extent.height; y++)
+			{
+				for (int x = 0; x < extent.width; x++)
+				{
+					buffer[y * extent.width + x] = (UInt16)(key.position * 40503 + key.t * 7919 + key.c * 1031
+						+ key.z * 257 + y * 131 + x * 7);
+				}
+			}
+		}
+
+	private:
+		CaptureExtent extent;
+	};
+}
+
+int VerifyCaptureViews(PlaneSource & source, int capture, int position)
+{
+	using Index = CaptureView<UInt16>::Index;
+	const CaptureExtent & extent = source.Extent(capture);
+	const int width = extent.width;
+	const int height = extent.height;
+	// a few planes along each of T, C and Z
+	const Index start = { {} };
+	const Index count = { { std::min(2, extent.timepoints), std::min(3, extent.channels), std::min(4, extent.z), height, width } };
+	CaptureView<UInt16> region = CaptureView<UInt16>(source, capture, position).Subvolume(start, count);
+
+	// what the view should hold, read a plane at a time
+	std::vector<std::vector<UInt16>> planes;
+	for (int t = 0; t < count[AxisT]; t++)
+	{
+		for (int c = 0; c < count[AxisC]; c++)
+		{
+			for (int z = 0; z < count[AxisZ]; z++)
+			{
+				planes.emplace_back((std::size_t)width * height);
+				source.Read(PlaneKey{ capture, position, t, z, c }, planes.back().data());
+			}
+		}
+	}
+
+	int failures = 0;
+	auto check = [&](const std::string & name, const auto & view, auto actual)
+	{
+		const Index & at = view.Origin();
+		const Index & shape = view.Shape();
+		std::size_t wrong = 0;
+		for (int t = 0; t < shape[AxisT]; t++)
+		{
+			for (int c = 0; c < shape[AxisC]; c++)
+			{
+				for (int z = 0; z < shape[AxisZ]; z++)
+				{
+					const auto & plane = planes[((std::size_t)(at[AxisT] + t) * count[AxisC] + at[AxisC] + c) * count[AxisZ] + at[AxisZ] + z];
+					for (int y = 0; y < shape[AxisY]; y++)
+					{
+						for (int x = 0; x < shape[AxisX]; x++)
+						{
+							double expected = plane[(std::size_t)(at[AxisY] + y) * width + at[AxisX] + x];
+							wrong += (double)actual(t, c, z, y, x) != expected;
+						}
+					}
+				}
+			}
+		}
+		fmt::print("  {:<28} {}\n", name, wrong == 0 ? std::string("ok") : fmt::format("{} of {} elements differ", wrong, view.Size()));
+		failures += wrong > 0;
+	};
+	auto dense = [](const auto & view, const auto & data)
+	{
+		auto strides = view.DenseStrides();
+		return [&data, strides](int t, int c, int z, int y, int x)
+		{
+			return data[t * strides[AxisT] + c * strides[AxisC] + z * strides[AxisZ] + y * strides[AxisY] + x];
+		};
+	};
+
+	fmt::print("capture {} position {}: {} planes of {}x{}\n", capture, position, planes.size(), width, height);
+
+	std::vector<UInt16> whole = region.Materialize();
+	check("whole planes", region, dense(region, whole));
+
+	CaptureView<UInt16> crop = region.Subvolume({ { 0, 0, 0, height / 4, width / 3 } },
+		{ { count[AxisT], count[AxisC], count[AxisZ], std::max(1, height / 2), std::max(1, width / 3) } });
+	std::vector<UInt16> cropped = crop.Materialize();
+	check("Y/X crop", crop, dense(crop, cropped));
+
+	CaptureView<UInt16> slice = region.Slice(AxisZ, count[AxisZ] - 1).Slice(AxisC, count[AxisC] - 1);
+	std::vector<UInt16> sliced = slice.Materialize();
+	check("last C and Z slice", slice, dense(slice, sliced));
+
+	// rows padded apart, read in place through ReadStrided
+	CaptureView<UInt16>::Strides strides;
+	strides[AxisX] = 1;
+	strides[AxisY] = width + 7;
+	strides[AxisZ] = strides[AxisY] * height;
+	strides[AxisC] = strides[AxisZ] * count[AxisZ];
+	strides[AxisT] = strides[AxisC] * count[AxisC];
+	std::vector<UInt16> padded((std::size_t)strides[AxisT] * count[AxisT]);
+	region.Read(padded.data(), strides);
+	check("padded rows", region, [&](int t, int c, int z, int y, int x)
+	{
+		return padded[t * strides[AxisT] + c * strides[AxisC] + z * strides[AxisZ] + y * strides[AxisY] + x];
+	});
+
+	CaptureView<float> floats = CaptureView<float>(source, capture, position).Subvolume(start, count);
+	std::vector<float> converted = floats.Materialize();
+	check("float pixels", floats, dense(floats, converted));
+	return failures;
+}
+
+int VerifySyntheticCaptureViews()
+{
+	PatternSource source;
+	fmt::print("synthetic source, ");
+	return VerifyCaptureViews(source, 0, 1);
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "fmt/format.h"
+#include "dimension_order.h"
+#include "plane_source.h"
+
+// Lazy (T, C, Z, Y, X) array view of one capture and position, indexed by
+// Axis. Slicing and taking subvolumes only narrow the view; nothing is read
+// until Read() or Materialize(), which decode just the planes inside the
+// view, straight into the caller's memory when the layout allows.
+//
+//	SBPlaneSource source(ReaderPool::Shared(), filename);
+//	CaptureView<UInt16> view(source, capture);
+//	auto stack = view.Slice(AxisT, 3).Slice(AxisC, 1).Materialize();	// one Z stack
+//
+// PixelType other than UInt16 converts each pixel on the way out.
+template <typename PixelType>
+class CaptureView
+{
+public:
+	using Index = std::array<int, AxisCount>;
+	using Strides = std::array<std::ptrdiff_t, AxisCount>;
+
+	CaptureView(PlaneSource & source, int capture, int position = 0)
+		: source(&source)
+		, capture(capture)
+		, position(position)
+	{
+		const CaptureExtent & extent = source.Extent(capture);
+		if (position < 0 || position >= extent.positions)
+		{
+			throw std::out_of_range(fmt::format("capture {} has no position {}", capture, position));
+		}
+		full = { { extent.timepoints, extent.channels, extent.z, extent.height, extent.width } };
+		origin = { {} };
+		shape = full;
+	}
+
+	// Extent of each axis within the view.
+	const Index & Shape() const
+	{
+		return shape;
+	}
+
+	int Extent(Axis axis) const
+	{
+		return shape[axis];
+	}
+
+	// First index of each axis within the capture.
+	const Index & Origin() const
+	{
+		return origin;
+	}
+
+	std::size_t Size() const
+	{
+		std::size_t size = 1;
+		for (int extent : shape)
+		{
+			size *= (std::size_t)extent;
+		}
+		return size;
+	}
+
+	// Planes a Read() decodes.
+	std::size_t Planes() const
+	{
+		return (std::size_t)shape[AxisT] * shape[AxisC] * shape[AxisZ];
+	}
+
+	// Element strides of a dense array of the view with X fastest.
+	Strides DenseStrides() const
+	{
+		Strides strides;
+		std::ptrdiff_t stride = 1;
+		for (int axis = AxisCount - 1; axis >= 0; axis--)
+		{
+			strides[axis] = stride;
+			stride *= shape[axis];
+		}
+		return strides;
+	}
+
+	// The view at a single index of axis; the axis stays, with extent 1.
+	CaptureView Slice(Axis axis, int index) const
+	{
+		Index start = { {} };
+		Index count = shape;
+		start[axis] = index;
+		count[axis] = 1;
+		return Subvolume(start, count);
+	}
+
+	// count elements of each axis from start, relative to this view.
+	CaptureView Subvolume(const Index & start, const Index & count) const
+	{
+		CaptureView view = *this;
+		for (int axis = 0; axis < AxisCount; axis++)
+		{
+			if (start[axis] < 0 || count[axis] < 1 || start[axis] > shape[axis] - count[axis])
+			{
+				throw std::out_of_range(fmt::format("{} elements from {} outside the {} of axis {}",
+					count[axis], start[axis], shape[axis], "TCZYX"[axis]));
+			}
+			view.origin[axis] += start[axis];
+			view.shape[axis] = count[axis];
+		}
+		return view;
+	}
+
+	// Reads the view into out, placing element (t, c, z, y, x) at
+	// out[t * strides[AxisT] + ... + x * strides[AxisX]]. Whole UInt16 planes
+	// with rows contiguous in out are read there directly; anything else is
+	// read whole once and copied out.
+	void Read(PixelType * out, const Strides & strides) const
+	{
+		const bool whole = origin[AxisY] == 0 && origin[AxisX] == 0
+			&& shape[AxisY] == full[AxisY] && shape[AxisX] == full[AxisX];
+		const bool direct = std::is_same<PixelType, UInt16>::value && whole
+			&& strides[AxisX] == 1 && strides[AxisY] >= shape[AxisX];
+		std::vector<UInt16> plane(direct ? 0 : (std::size_t)full[AxisY] * full[AxisX]);
+		for (int t = 0; t < shape[AxisT]; t++)
+		{
+			for (int c = 0; c < shape[AxisC]; c++)
+			{
+				for (int z = 0; z < shape[AxisZ]; z++)
+				{
+					PlaneKey key = { capture, position, origin[AxisT] + t, origin[AxisZ] + z, origin[AxisC] + c };
+					PixelType * target = out + t * strides[AxisT] + c * strides[AxisC] + z * strides[AxisZ];
+					if (direct)
+					{
+						source->ReadStrided(key, (UInt16 *)target, (std::size_t)strides[AxisY] * sizeof(UInt16));
+						continue;
+					}
+					source->Read(key, plane.data());
+					for (int y = 0; y < shape[AxisY]; y++)
+					{
+						const UInt16 * row = plane.data() + (std::size_t)(origin[AxisY] + y) * full[AxisX] + origin[AxisX];
+						PixelType * line = target + y * strides[AxisY];
+						for (int x = 0; x < shape[AxisX]; x++)
+						{
+							line[x * strides[AxisX]] = (PixelType)row[x];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void Read(PixelType * out) const
+	{
+		Read(out, DenseStrides());
+	}
+
+	// The view as a dense array with X fastest.
+	std::vector<PixelType> Materialize() const
+	{
+		std::vector<PixelType> data(Size());
+		Read(data.data());
+		return data;
+	}
+
+private:
+	PlaneSource * source;
+	int capture;
+	int position;
+	Index full;
+	Index origin;
+	Index shape;
+};
+
+// Compares views of a few planes of capture and position, whole, cropped,
+// sliced, read into padded rows and converted to float, with the planes
+// read one at a time. Prints each check; returns how many failed.
+int VerifyCaptureViews(PlaneSource & source, int capture, int position = 0);
+
+// The same over a synthetic source.
+int VerifySyntheticCaptureViews();
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "fmt/format.h"
+#include "dimension_order.h"
+#include "hash.h"
+
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <unistd.h>
+#endif
+
+// Append only record of converted work, so an interrupted conversion can
+// resume where it stopped.
+//
+// A unit is a (capture, position, t, c) Z stack when planes are written to
+// the output whole, or the entire (capture, position) stack, recorded with t
+// and c as -1, when the layout spreads planes over blocks. Each unit is
+// recorded once its bytes are synced to disk, with the XXH64 digest of the
+// list of XXH64 digests of its output planes (of PlaneBytes() chunks of the
+// array data, in file order, for whole stacks).
+//
+// The journal starts with a key describing every option that changes the
+// output bytes and the source they come from; a journal written with
+// different options, or from a source that has changed since, is discarded.
+class CheckpointJournal
+{
+public:
+	CheckpointJournal(const std::string & path, const std::string & key)
+		: path(path)
+	{
+		std::ifstream in(path);
+		std::string line;
+		if (std::getline(in, line) && line == "# mloader journal 1" && std::getline(in, line) && line == "# " + key)
+		{
+			while (std::getline(in, line))
+			{
+				int capture, position, t, c;
+				unsigned long long digest;
+				if (sscanf(line.c_str(), "%d\t%d\t%d\t%d\t%llx", &capture, &position, &t, &c, &digest) == 5)
+				{
+					units[std::make_tuple(capture, position, t, c)] = digest;
+				}
+			}
+			fmt::print("resuming with {} completed units from {}\n", units.size(), path);
+			file = std::fopen(path.c_str(), "a");
+		}
+		else
+		{
+			if (in.is_open())
+			{
+				fmt::print("{} was written with other options or from another version of the source, starting over\n", path);
+			}
+			file = std::fopen(path.c_str(), "w");
+			if (file)
+			{
+				fmt::print(file, "# mloader journal 1\n# {}\n", key);
+			}
+		}
+		if (!file)
+		{
+			throw std::runtime_error(fmt::format("unable to open {}", path));
+		}
+	}
+
+	~CheckpointJournal()
+	{
+		std::fclose(file);
+	}
+
+	CheckpointJournal(const CheckpointJournal &) = delete;
+	CheckpointJournal & operator=(const CheckpointJournal &) = delete;
+
+	// The recorded digest of a unit, or nullptr when it is not done.
+	const UInt64 * Find(int capture, int position, int t, int c) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto unit = units.find(std::make_tuple(capture, position, t, c));
+		return unit == units.end() ? nullptr : &unit->second;
+	}
+
+	// Records a unit whose output is on disk; the line itself is synced
+	// before returning.
+	void Record(int capture, int position, int t, int c, UInt64 digest)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		units[std::make_tuple(capture, position, t, c)] = digest;
+		fmt::print(file, "{}\t{}\t{}\t{}\t{:016x}\n", capture, position, t, c, digest);
+		if (std::fflush(file) != 0)
+		{
+			throw std::runtime_error(fmt::format("unable to write {}", path));
+		}
+#ifdef _WIN32
+		_commit(_fileno(file));
+#else
+		fsync(fileno(file));
+#endif
+	}
+
+	static UInt64 Digest(const std::vector<UInt64> & plane_digests)
+	{
+		return util::Hash64(plane_digests.data(), plane_digests.size() * sizeof(UInt64));
+	}
+
+	// Checks the Z stack (t, c) of an output whose array data starts at
+	// data_offset against digest; the plan must write planes whole.
+	static bool VerifyUnit(const std::string & output, UInt64 data_offset, const DimensionPlan & plan,
+		int t, int c, UInt64 digest)
+	{
+		std::ifstream in(output, std::ios::binary);
+		std::vector<char> plane(plan.PlaneBytes());
+		std::vector<UInt64> digests;
+		for (int z = 0; z < plan.extents[AxisZ]; z++)
+		{
+			in.seekg((std::streamoff)(data_offset + plan.BlockOffset(PlaneCoord{ t, c, z })));
+			if (!in.read(plane.data(), plane.size()))
+			{
+				return false;
+			}
+			digests.push_back(util::Hash64(plane.data(), plane.size()));
+		}
+		return Digest(digests) == digest;
+	}
+
+	// Digest of a whole output's array data, as recorded for whole stacks.
+	static bool StackDigest(const std::string & output, UInt64 data_offset, const DimensionPlan & plan, UInt64 & digest)
+	{
+		std::ifstream in(output, std::ios::binary);
+		in.seekg((std::streamoff)data_offset);
+		std::vector<char> chunk(plan.PlaneBytes());
+		std::vector<UInt64> digests;
+		UInt64 planes = (UInt64)plan.extents[AxisT] * plan.extents[AxisC] * plan.extents[AxisZ];
+		for (; planes > 0; planes--)
+		{
+			if (!in.read(chunk.data(), chunk.size()))
+			{
+				return false;
+			}
+			digests.push_back(util::Hash64(chunk.data(), chunk.size()));
+		}
+		digest = Digest(digests);
+		return true;
+	}
+
+private:
+	std::string path;
+	std::FILE * file = nullptr;
+	std::map<std::tuple<int, int, int, int>, UInt64> units;
+	mutable std::mutex mutex;
+};
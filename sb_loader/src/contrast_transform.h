@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "plane_transform.h"
+
+// Converts UInt16 planes to UInt8 with a per channel contrast stretch.
+//
+// Prepare builds a 65536 bin histogram per channel from planes sampled
+// evenly over positions, time points and Z, takes the low and high
+// percentiles as black and white points, and precomputes a lookup table
+// that Apply maps each pixel through.
+class ContrastTransform : public PlaneTransform
+{
+public:
+	ContrastTransform(double low_percentile, double high_percentile, int samples_per_channel)
+		: low_percentile(low_percentile)
+		, high_percentile(high_percentile)
+		, samples_per_channel(std::max(1, samples_per_channel))
+	{
+	}
+
+	std::string Name() const override
+	{
+		return fmt::format("8 bit contrast stretch [{}%, {}%]", low_percentile, high_percentile);
+	}
+
+	PlaneShape OutputShape(const PlaneShape & in) const override
+	{
+		return PlaneShape{ in.width, in.height, sizeof(UInt8) };
+	}
+
+	void Prepare(const PlaneSampler & sample, const PlaneShape & in, int positions, const std::array<int, AxisCount> & extents) override
+	{
+		const int channels = extents[AxisC];
+		// the sampler fills a raw sized buffer; only the first in.width x
+		// in.height pixels hold what earlier stages left
+		const std::size_t pixels = (std::size_t)in.width * in.height;
+		std::vector<UInt16> plane((std::size_t)extents[AxisY] * extents[AxisX]);
+		std::vector<UInt64> histogram(65536);
+
+		// sample (position, t, z) evenly across the capture
+		const int stacks = positions * extents[AxisT] * extents[AxisZ];
+		const int count = std::min(samples_per_channel, stacks);
+
+		limits.assign(channels, std::make_pair(0, 65535));
+		luts.assign(channels, std::vector<UInt8>(65536));
+		for (int c = 0; c < channels; c++)
+		{
+			std::fill(histogram.begin(), histogram.end(), 0);
+			for (int s = 0; s < count; s++)
+			{
+				int index = (int)(((long long)s * stacks + stacks / 2) / count);
+				int z = index % extents[AxisZ];
+				int t = (index / extents[AxisZ]) % extents[AxisT];
+				int position = index / (extents[AxisZ] * extents[AxisT]);
+				sample(position, PlaneCoord{ t, c, z }, plane.data());
+				for (std::size_t i = 0; i < pixels; i++)
+				{
+					histogram[plane[i]]++;
+				}
+			}
+
+			UInt64 total = (UInt64)pixels * count;
+			int low = Percentile(histogram, total, low_percentile);
+			int high = std::max(low + 1, Percentile(histogram, total, high_percentile));
+			limits[c] = std::make_pair(low, high);
+
+			auto & lut = luts[c];
+			for (int v = 0; v < 65536; v++)
+			{
+				double scaled = (v - low) * 255.0 / (high - low);
+				lut[v] = (UInt8)std::lround(std::min(255.0, std::max(0.0, scaled)));
+			}
+		}
+	}
+
+	// The output byte for a pixel is written no later than its input is read,
+	// so the conversion can run front to back in place.
+	void Apply(UInt8 * plane, const PlaneShape & in, const PlaneCoord & p) const override
+	{
+		const UInt8 * lut = luts[p.c].data();
+		const UInt16 * src = (const UInt16 *)plane;
+		std::size_t pixels = (std::size_t)in.width * in.height;
+		for (std::size_t i = 0; i < pixels; i++)
+		{
+			plane[i] = lut[src[i]];
+		}
+	}
+
+	std::vector<std::pair<std::string, std::string>> Metadata() const override
+	{
+		std::string json = "[";
+		for (std::size_t c = 0; c < limits.size(); c++)
+		{
+			json += fmt::format("{}[{}, {}]", c ? ", " : "", limits[c].first, limits[c].second);
+		}
+		return { { "contrast_limits", json + "]" } };
+	}
+
+private:
+	static int Percentile(const std::vector<UInt64> & histogram, UInt64 total, double percentile)
+	{
+		UInt64 target = (UInt64)(total * percentile / 100.0);
+		UInt64 seen = 0;
+		for (int v = 0; v < 65536; v++)
+		{
+			seen += histogram[v];
+			if (seen > target)
+			{
+				return v;
+			}
+		}
+		return 65535;
+	}
+
+	double low_percentile;
+	double high_percentile;
+	int samples_per_channel;
+	std::vector<std::pair<int, int>> limits;
+	std::vector<std::vector<UInt8>> luts;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fmt/format.h"
+
+// Runs conversion jobs on up to concurrency threads while the memory the
+// running jobs declare stays within budget. Jobs start in submission order;
+// a job larger than the whole budget runs once nothing else is running.
+// With first_fit, a later job that fits starts ahead of one that does not,
+// which packs the budget well when jobs are submitted largest first.
+//
+// A job that throws is reported and counted in Failures(); the others carry
+// on.
+class ConversionScheduler
+{
+public:
+	ConversionScheduler(int concurrency, std::size_t memory_budget, bool first_fit = false)
+		: memory_budget(memory_budget)
+		, first_fit(first_fit)
+	{
+		for (int i = 0; i < std::max(1, concurrency); i++)
+		{
+			threads.emplace_back([this] { Run(); });
+		}
+	}
+
+	~ConversionScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (auto & thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	ConversionScheduler(const ConversionScheduler &) = delete;
+	ConversionScheduler & operator=(const ConversionScheduler &) = delete;
+
+	void Submit(const std::string & name, std::size_t memory, std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(Job{ name, memory, std::move(job) });
+		}
+		changed.notify_all();
+	}
+
+	// Blocks until every submitted job has finished.
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this] { return queue.empty() && running == 0; });
+	}
+
+	std::size_t Queued()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return queue.size();
+	}
+
+	int Failures()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return failures;
+	}
+
+private:
+	struct Job
+	{
+		std::string name;
+		std::size_t memory;
+		std::function<void()> run;
+	};
+
+	// The job to start next, or queue.end().
+	std::deque<Job>::iterator Next()
+	{
+		for (auto job = queue.begin(); job != queue.end(); ++job)
+		{
+			if (running == 0 || memory_in_use + job->memory <= memory_budget)
+			{
+				return job;
+			}
+			if (!first_fit)
+			{
+				break;
+			}
+		}
+		return queue.end();
+	}
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			changed.wait(lock, [this] { return stopping || Next() != queue.end(); });
+			auto next = Next();
+			if (next == queue.end())
+			{
+				return;
+			}
+			Job job = std::move(*next);
+			queue.erase(next);
+			running++;
+			memory_in_use += job.memory;
+			lock.unlock();
+
+			bool failed = false;
+			try
+			{
+				job.run();
+			}
+			catch (const std::exception & e)
+			{
+				fmt::print("{} failed: {}\n", job.name, e.what());
+				failed = true;
+			}
+			job.run = nullptr;
+
+			lock.lock();
+			running--;
+			memory_in_use -= job.memory;
+			failures += failed ? 1 : 0;
+			changed.notify_all();
+		}
+	}
+
+	std::size_t memory_budget;
+	bool first_fit;
+	std::vector<std::thread> threads;
+	std::deque<Job> queue;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::size_t memory_in_use = 0;
+	int running = 0;
+	int failures = 0;
+	bool stopping = false;
+};
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+#include "simd.h"
+
+enum Axis { AxisT, AxisC, AxisZ, AxisY, AxisX, AxisCount };
+
+// Order of the five axes in an output array, outermost first.
+struct DimensionOrder
+{
+	std::array<Axis, AxisCount> axes = { { AxisT, AxisC, AxisZ, AxisY, AxisX } };
+
+	// Accepts any permutation of "TCZYX" (case insensitive) or a preset name:
+	// zarr (TCZYX), imagej (TZCYX, the ImageJ hyperstack order).
+	static DimensionOrder Parse(std::string text)
+	{
+		std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+		if (text == "ZARR")
+		{
+			text = "TCZYX";
+		}
+		else if (text == "IMAGEJ")
+		{
+			text = "TZCYX";
+		}
+		DimensionOrder order;
+		const std::string names = "TCZYX";
+		std::string sorted = text;
+		std::sort(sorted.begin(), sorted.end());
+		if (text.size() != AxisCount || sorted != "CTXYZ")
+		{
+			throw std::runtime_error(fmt::format("dimension order must be a permutation of TCZYX, got {}", text));
+		}
+		for (int i = 0; i < AxisCount; i++)
+		{
+			order.axes[i] = (Axis)names.find(text[i]);
+		}
+		return order;
+	}
+
+	std::string String() const
+	{
+		std::string text;
+		for (auto axis : axes)
+		{
+			text += "TCZYX"[axis];
+		}
+		return text;
+	}
+
+	int Position(Axis axis) const
+	{
+		return (int)(std::find(axes.begin(), axes.end(), axis) - axes.begin());
+	}
+};
+
+struct PlaneCoord
+{
+	int t;
+	int c;
+	int z;
+
+	int operator[](Axis axis) const
+	{
+		return axis == AxisT ? t : (axis == AxisC ? c : z);
+	}
+};
+
+// Plans a conversion into an arbitrary DimensionOrder.
+//
+// The axes from the outermost spatial axis inward form a contiguous block in
+// the output. Non-spatial axes inside that block are "gathered": all of
+// their planes have to be read before the block can be written, so they are
+// read innermost. The remaining (outer) axes are read in whichever order
+// needs the fewest seeks through the .sld, where planes are stored T, then C,
+// then Z major; when sequential_writes is set the output order wins instead
+// so that direct writes stay in file order.
+//
+// Planes that land in the output unchanged are written from the read buffer.
+// Gathered blocks with X innermost are filled by strided reads, YXC blocks by
+// a SIMD channel interleave, and anything else (including transposed planes)
+// with cache blocked copies by Place().
+class DimensionPlan
+{
+public:
+	DimensionPlan(const DimensionOrder & order, const std::array<int, AxisCount> & extents, std::size_t pixel_bytes, bool sequential_writes)
+		: order(order)
+		, extents(extents)
+		, pixel_bytes(pixel_bytes)
+		, sequential(sequential_writes)
+	{
+		UInt64 stride = 1;
+		for (int i = AxisCount - 1; i >= 0; i--)
+		{
+			strides[order.axes[i]] = stride;
+			stride *= extents[order.axes[i]];
+		}
+
+		int outer_spatial = std::min(order.Position(AxisY), order.Position(AxisX));
+		block_elements = 1;
+		for (int i = outer_spatial; i < AxisCount; i++)
+		{
+			Axis axis = order.axes[i];
+			block_elements *= extents[axis];
+			if (axis != AxisY && axis != AxisX)
+			{
+				gathered.push_back(axis);
+			}
+		}
+		transposed = order.Position(AxisX) < order.Position(AxisY);
+
+		std::vector<Axis> outer;
+		for (int i = 0; i < outer_spatial; i++)
+		{
+			outer.push_back(order.axes[i]);
+		}
+		read_order = ChooseReadOrder(outer, sequential_writes);
+	}
+
+	// Reorders reads so that axis varies as fast as the layout allows: the
+	// planes of a block stay consecutive, and sequential writes keep the
+	// output order regardless.
+	void PreferFastest(Axis axis)
+	{
+		preferred = axis;
+		int outer_spatial = std::min(order.Position(AxisY), order.Position(AxisX));
+		std::vector<Axis> outer(order.axes.begin(), order.axes.begin() + outer_spatial);
+		read_order = ChooseReadOrder(outer, sequential);
+	}
+
+	// Output shape in output axis order.
+	std::vector<UInt64> Shape() const
+	{
+		std::vector<UInt64> shape;
+		for (auto axis : order.axes)
+		{
+			shape.push_back((UInt64)extents[axis]);
+		}
+		return shape;
+	}
+
+	std::size_t PlaneBytes() const
+	{
+		return (std::size_t)extents[AxisY] * extents[AxisX] * pixel_bytes;
+	}
+
+	std::size_t BlockBytes() const
+	{
+		return (std::size_t)block_elements * pixel_bytes;
+	}
+
+	// Planes that make up one written block.
+	std::size_t BlockPlanes() const
+	{
+		return BlockBytes() / PlaneBytes();
+	}
+
+	// True when read buffers can be written without rearranging pixels.
+	bool PlanesWrittenDirectly() const
+	{
+		return gathered.empty() && !transposed;
+	}
+
+	// Byte offset, relative to the start of the array, of the block that
+	// holds the plane.
+	UInt64 BlockOffset(const PlaneCoord & p) const
+	{
+		UInt64 element = 0;
+		for (auto axis : { AxisT, AxisC, AxisZ })
+		{
+			if (std::find(gathered.begin(), gathered.end(), axis) == gathered.end())
+			{
+				element += (UInt64)p[axis] * strides[axis];
+			}
+		}
+		return element * pixel_bytes;
+	}
+
+	// True when X is innermost in a gathered block, so each plane can be read
+	// straight into the block at PlaneOffsetInBlock() with RowStrideBytes()
+	// between rows (e.g. TYCX). The reader wants a stride wider than a row.
+	bool ReadsIntoBlock() const
+	{
+		return !gathered.empty() && strides[AxisX] == 1 && strides[AxisY] > (UInt64)extents[AxisX];
+	}
+
+	// True for orders ending in YXC: all channels of a plane are read as one
+	// unit and packed with InterleaveChannels().
+	bool InterleavesChannels() const
+	{
+		return order.axes[2] == AxisY && order.axes[3] == AxisX && order.axes[4] == AxisC;
+	}
+
+	UInt64 PlaneOffsetInBlock(const PlaneCoord & p) const
+	{
+		UInt64 base = 0;
+		for (auto axis : gathered)
+		{
+			base += (UInt64)p[axis] * strides[axis];
+		}
+		return base * pixel_bytes;
+	}
+
+	std::size_t RowStrideBytes() const
+	{
+		return (std::size_t)strides[AxisY] * pixel_bytes;
+	}
+
+	// Packs one plane per channel, in channel order, into a YXC block.
+	void Interleave(const void * const * planes, void * block) const
+	{
+		std::size_t pixels = (std::size_t)extents[AxisY] * extents[AxisX];
+		switch (pixel_bytes)
+		{
+		case 1: util::InterleaveChannels((const UInt8 * const *)planes, extents[AxisC], pixels, (UInt8 *)block); break;
+		case 2: util::InterleaveChannels((const UInt16 * const *)planes, extents[AxisC], pixels, (UInt16 *)block); break;
+		default: throw std::logic_error("unsupported pixel size");
+		}
+	}
+
+	// Copies a Y, X major plane to its place inside its block.
+	void Place(const void * plane, void * block, const PlaneCoord & p) const
+	{
+		UInt64 base = PlaneOffsetInBlock(p) / pixel_bytes;
+		switch (pixel_bytes)
+		{
+		case 1: Scatter((const UInt8 *)plane, (UInt8 *)block + base, strides[AxisY], strides[AxisX]); break;
+		case 2: Scatter((const UInt16 *)plane, (UInt16 *)block + base, strides[AxisY], strides[AxisX]); break;
+		case 4: Scatter((const UInt32 *)plane, (UInt32 *)block + base, strides[AxisY], strides[AxisX]); break;
+		default: throw std::logic_error("unsupported pixel size");
+		}
+	}
+
+	// Every plane, in the order it should be read. Planes of one block are
+	// consecutive.
+	std::vector<PlaneCoord> ReadSequence() const
+	{
+		std::vector<PlaneCoord> sequence;
+		sequence.reserve((std::size_t)extents[AxisT] * extents[AxisC] * extents[AxisZ]);
+		int index[AxisCount] = {};
+		for (index[read_order[0]] = 0; index[read_order[0]] < extents[read_order[0]]; index[read_order[0]]++)
+		{
+			for (index[read_order[1]] = 0; index[read_order[1]] < extents[read_order[1]]; index[read_order[1]]++)
+			{
+				for (index[read_order[2]] = 0; index[read_order[2]] < extents[read_order[2]]; index[read_order[2]]++)
+				{
+					sequence.push_back(PlaneCoord{ index[AxisT], index[AxisC], index[AxisZ] });
+				}
+			}
+		}
+		return sequence;
+	}
+
+	std::string Describe() const
+	{
+		std::string read;
+		for (auto axis : read_order)
+		{
+			read += "TCZYX"[axis];
+		}
+		std::string assembly;
+		if (ReadsIntoBlock())
+		{
+			assembly = ", strided reads";
+		}
+		else if (InterleavesChannels())
+		{
+			assembly = ", channel interleave";
+		}
+		else if (transposed)
+		{
+			assembly = ", transposed planes";
+		}
+		return fmt::format("order {}, reading {} major{}{}", order.String(), read, assembly,
+			gathered.empty() ? "" : fmt::format(", {} planes per block", BlockPlanes()));
+	}
+
+	DimensionOrder order;
+	std::array<int, AxisCount> extents;
+	std::size_t pixel_bytes;
+	std::array<UInt64, AxisCount> strides;
+	std::vector<Axis> gathered;
+	UInt64 block_elements;
+	bool transposed;
+	std::array<Axis, 3> read_order;
+
+private:
+	bool sequential;
+	int preferred = -1;
+
+	std::array<Axis, 3> ChooseReadOrder(const std::vector<Axis> & outer, bool sequential_writes) const
+	{
+		if (sequential_writes)
+		{
+			std::array<Axis, 3> chosen;
+			std::copy(outer.begin(), outer.end(), chosen.begin());
+			std::copy(gathered.begin(), gathered.end(), chosen.begin() + outer.size());
+			return chosen;
+		}
+
+		// try every order of the outer axes and of the gathered axes, keeping
+		// the gathered ones innermost
+		std::vector<Axis> outer_trial = outer;
+		std::vector<Axis> inner_trial = gathered;
+		std::sort(outer_trial.begin(), outer_trial.end());
+		std::sort(inner_trial.begin(), inner_trial.end());
+		std::array<Axis, 3> best = { { AxisT, AxisC, AxisZ } };
+		UInt64 best_seeks = ~0ull;
+		int best_depth = -1;
+		do
+		{
+			do
+			{
+				std::array<Axis, 3> trial;
+				std::copy(outer_trial.begin(), outer_trial.end(), trial.begin());
+				std::copy(inner_trial.begin(), inner_trial.end(), trial.begin() + outer_trial.size());
+				UInt64 seeks = CountSeeks(trial);
+				int depth = preferred < 0 ? 0 : (int)(std::find(trial.begin(), trial.end(), (Axis)preferred) - trial.begin());
+				if (depth > best_depth || (depth == best_depth && seeks < best_seeks))
+				{
+					best_depth = depth;
+					best_seeks = seeks;
+					best = trial;
+				}
+			} while (std::next_permutation(inner_trial.begin(), inner_trial.end()));
+		} while (std::next_permutation(outer_trial.begin(), outer_trial.end()));
+		return best;
+	}
+
+	// Number of reads that do not follow the previous plane in .sld order.
+	UInt64 CountSeeks(const std::array<Axis, 3> & trial) const
+	{
+		int index[AxisCount] = {};
+		UInt64 seeks = 0;
+		UInt64 last = ~0ull;
+		for (index[trial[0]] = 0; index[trial[0]] < extents[trial[0]]; index[trial[0]]++)
+		{
+			for (index[trial[1]] = 0; index[trial[1]] < extents[trial[1]]; index[trial[1]]++)
+			{
+				for (index[trial[2]] = 0; index[trial[2]] < extents[trial[2]]; index[trial[2]]++)
+				{
+					UInt64 stored = ((UInt64)index[AxisT] * extents[AxisC] + index[AxisC]) * extents[AxisZ] + index[AxisZ];
+					if (stored != last + 1)
+					{
+						seeks++;
+					}
+					last = stored;
+				}
+			}
+		}
+		return seeks;
+	}
+
+	// Cache blocked copy of a Y, X major plane into destination strides.
+	template <typename T>
+	void Scatter(const T * plane, T * block, UInt64 stride_y, UInt64 stride_x) const
+	{
+		const int rows = extents[AxisY];
+		const int columns = extents[AxisX];
+		if (stride_x == 1)
+		{
+			for (int y = 0; y < rows; y++)
+			{
+				memcpy(block + y * stride_y, plane + (std::size_t)y * columns, columns * sizeof(T));
+			}
+			return;
+		}
+		// tiles small enough that the source rows and destination lines of
+		// one tile stay in L1
+		const int Tile = 64;
+		for (int y0 = 0; y0 < rows; y0 += Tile)
+		{
+			int y1 = std::min(rows, y0 + Tile);
+			for (int x0 = 0; x0 < columns; x0 += Tile)
+			{
+				int x1 = std::min(columns, x0 + Tile);
+				for (int y = y0; y < y1; y++)
+				{
+					const T * src = plane + (std::size_t)y * columns;
+					T * dst = block + y * stride_y;
+					for (int x = x0; x < x1; x++)
+					{
+						dst[x * stride_x] = src[x];
+					}
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include "npy.h"
+#include "phoebe_util/util.h"
+#include "plane_transform.h"
+#include "simd.h"
+
+// Dark frame and flat field correction: (raw - dark) * gain, where
+// gain = mean(flat - dark) / (flat - dark) is precomputed per pixel as fixed
+// point with util::kGainFractionBits fractional bits.
+//
+// References are selected by channel name. Channels without a dark frame
+// subtract nothing, channels without a flat field keep unit gain, and
+// channels with neither pass through untouched.
+class FlatFieldTransform : public PlaneTransform
+{
+public:
+	FlatFieldTransform(const std::vector<std::string> & channel_names,
+		const std::map<std::string, std::string> & dark_files,
+		const std::map<std::string, std::string> & flat_files)
+		: channel_names(channel_names)
+		, dark_files(dark_files)
+		, flat_files(flat_files)
+	{
+		for (auto files : { &dark_files, &flat_files })
+		{
+			for (auto & entry : *files)
+			{
+				if (std::find(channel_names.begin(), channel_names.end(), entry.first) == channel_names.end())
+				{
+					std::string names;
+					for (auto & name : channel_names)
+					{
+						names += (names.empty() ? "" : ", ") + name;
+					}
+					throw std::runtime_error(fmt::format("no channel named {}, channels are: {}", entry.first, names));
+				}
+			}
+		}
+	}
+
+	std::string Name() const override
+	{
+		return "flat field correction";
+	}
+
+	void Prepare(const PlaneSampler &, const PlaneShape & in, int, const std::array<int, AxisCount> &) override
+	{
+		const int width = in.width;
+		const int height = in.height;
+		const std::size_t pixels = (std::size_t)width * height;
+		corrections.assign(channel_names.size(), Correction());
+
+		for (std::size_t c = 0; c < channel_names.size(); c++)
+		{
+			auto dark_file = dark_files.find(channel_names[c]);
+			auto flat_file = flat_files.find(channel_names[c]);
+			if (dark_file == dark_files.end() && flat_file == flat_files.end())
+			{
+				continue;
+			}
+
+			std::vector<float> dark = dark_file == dark_files.end()
+				? std::vector<float>(pixels, 0.0f)
+				: LoadReference(dark_file->second, width, height);
+
+			auto & correction = corrections[c];
+			correction.dark.resize(pixels);
+			correction.gain.assign(pixels, (UInt16)(1 << util::kGainFractionBits));
+			for (std::size_t i = 0; i < pixels; i++)
+			{
+				correction.dark[i] = (UInt16)std::lround(std::min(65535.0f, std::max(0.0f, dark[i])));
+			}
+
+			if (flat_file != flat_files.end())
+			{
+				std::vector<float> flat = LoadReference(flat_file->second, width, height);
+				double sum = 0;
+				std::size_t count = 0;
+				for (std::size_t i = 0; i < pixels; i++)
+				{
+					flat[i] -= dark[i];
+					if (flat[i] > 0)
+					{
+						sum += flat[i];
+						count++;
+					}
+				}
+				if (count == 0)
+				{
+					throw std::runtime_error(fmt::format("flat field {} is not brighter than its dark frame", flat_file->second));
+				}
+				double mean = sum / count;
+				const double scale = 1 << util::kGainFractionBits;
+				for (std::size_t i = 0; i < pixels; i++)
+				{
+					double gain = flat[i] > 0 ? mean / flat[i] : 1.0;
+					correction.gain[i] = (UInt16)std::lround(std::min(65535.0, gain * scale));
+				}
+			}
+			correction.enabled = true;
+		}
+	}
+
+	void Apply(UInt8 * plane, const PlaneShape & in, const PlaneCoord & p) const override
+	{
+		auto & correction = corrections[p.c];
+		if (correction.enabled)
+		{
+			util::CorrectFlatField((UInt16 *)plane, correction.dark.data(), correction.gain.data(), (std::size_t)in.width * in.height);
+		}
+	}
+
+	std::vector<std::pair<std::string, std::string>> Metadata() const override
+	{
+		std::string json = "{";
+		for (std::size_t c = 0; c < channel_names.size(); c++)
+		{
+			auto dark_file = dark_files.find(channel_names[c]);
+			auto flat_file = flat_files.find(channel_names[c]);
+			if (dark_file == dark_files.end() && flat_file == flat_files.end())
+			{
+				continue;
+			}
+			json += fmt::format("{}{}: {{\"dark\": {}, \"flat\": {}}}", json.size() > 1 ? ", " : "",
+				util::JsonString(channel_names[c]),
+				dark_file == dark_files.end() ? "null" : util::JsonString(dark_file->second),
+				flat_file == flat_files.end() ? "null" : util::JsonString(flat_file->second));
+		}
+		return { { "flat_field", json + "}" } };
+	}
+
+	// Loads a reference plane from a 2D (or singleton 3D) .npy of unsigned
+	// or floating point pixels, or from a raw little endian UInt16 plane.
+	static std::vector<float> LoadReference(const std::string & path, int width, int height)
+	{
+		const std::size_t pixels = (std::size_t)width * height;
+		std::vector<float> plane(pixels);
+		if (path.size() > 4 && path.compare(path.size() - 4, 4, ".npy") == 0)
+		{
+			NpyArray array = ReadNpy(path);
+			UInt64 elements = 1;
+			for (auto d : array.shape)
+			{
+				elements *= d;
+			}
+			if (array.shape.size() < 2 || array.shape[array.shape.size() - 1] != (UInt64)width
+				|| array.shape[array.shape.size() - 2] != (UInt64)height || elements != pixels)
+			{
+				throw std::runtime_error(fmt::format("{} is not a {}x{} plane", path, width, height));
+			}
+			for (std::size_t i = 0; i < pixels; i++)
+			{
+				if (array.descr == "<u2")
+				{
+					plane[i] = ((const UInt16 *)array.data.data())[i];
+				}
+				else if (array.descr == "|u1")
+				{
+					plane[i] = ((const UInt8 *)array.data.data())[i];
+				}
+				else if (array.descr == "<f4")
+				{
+					plane[i] = ((const float *)array.data.data())[i];
+				}
+				else if (array.descr == "<f8")
+				{
+					plane[i] = (float)((const double *)array.data.data())[i];
+				}
+				else
+				{
+					throw std::runtime_error(fmt::format("{} has unsupported dtype {}", path, array.descr));
+				}
+			}
+			return plane;
+		}
+
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		if (!in || (std::size_t)in.tellg() != pixels * sizeof(UInt16))
+		{
+			throw std::runtime_error(fmt::format("{} is not a raw {}x{} UInt16 plane", path, width, height));
+		}
+		std::vector<UInt16> raw(pixels);
+		in.seekg(0);
+		in.read((char *)raw.data(), pixels * sizeof(UInt16));
+		std::copy(raw.begin(), raw.end(), plane.begin());
+		return plane;
+	}
+
+private:
+	struct Correction
+	{
+		bool enabled = false;
+		std::vector<UInt16> dark;
+		std::vector<UInt16> gain;
+	};
+
+	std::vector<std::string> channel_names;
+	std::map<std::string, std::string> dark_files;
+	std::map<std::string, std::string> flat_files;
+	std::vector<Correction> corrections;
+};
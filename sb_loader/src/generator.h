@@ -0,0 +1,147 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+namespace util
+{
+	// Lazily produced sequence of T& from a coroutine that co_yields lvalues.
+	// The coroutine runs up to its next co_yield each time the iterator
+	// advances; destroying the generator destroys the coroutine's locals, so
+	// whatever it holds is released even if iteration stops early. Exceptions
+	// thrown in the coroutine surface from begin() or operator++.
+	template <typename T>
+	class Generator
+	{
+	public:
+		struct promise_type
+		{
+			T * current = nullptr;
+			std::exception_ptr error;
+
+			Generator get_return_object()
+			{
+				return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+
+			std::suspend_always initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			std::suspend_always final_suspend() noexcept
+			{
+				return {};
+			}
+
+			std::suspend_always yield_value(T & value) noexcept
+			{
+				current = std::addressof(value);
+				return {};
+			}
+
+			void return_void() {}
+
+			void unhandled_exception()
+			{
+				error = std::current_exception();
+			}
+
+			// only co_yield suspends
+			template <typename U>
+			std::suspend_never await_transform(U &&) = delete;
+		};
+
+		class iterator
+		{
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using difference_type = std::ptrdiff_t;
+			using value_type = T;
+			using reference = T &;
+			using pointer = T *;
+
+			iterator() {}
+			explicit iterator(std::coroutine_handle<promise_type> coroutine)
+				: coroutine(coroutine)
+			{
+			}
+
+			reference operator*() const
+			{
+				return *coroutine.promise().current;
+			}
+
+			pointer operator->() const
+			{
+				return coroutine.promise().current;
+			}
+
+			iterator & operator++()
+			{
+				Resume(coroutine);
+				return *this;
+			}
+
+			void operator++(int)
+			{
+				++*this;
+			}
+
+			bool operator==(std::default_sentinel_t) const
+			{
+				return !coroutine || coroutine.done();
+			}
+
+		private:
+			std::coroutine_handle<promise_type> coroutine;
+		};
+
+		Generator(Generator && other) noexcept
+			: coroutine(std::exchange(other.coroutine, nullptr))
+		{
+		}
+
+		~Generator()
+		{
+			if (coroutine)
+			{
+				coroutine.destroy();
+			}
+		}
+
+		Generator(const Generator &) = delete;
+		Generator & operator=(const Generator &) = delete;
+
+		iterator begin()
+		{
+			Resume(coroutine);
+			return iterator(coroutine);
+		}
+
+		std::default_sentinel_t end()
+		{
+			return std::default_sentinel;
+		}
+
+	private:
+		explicit Generator(std::coroutine_handle<promise_type> coroutine)
+			: coroutine(coroutine)
+		{
+		}
+
+		static void Resume(std::coroutine_handle<promise_type> coroutine)
+		{
+			coroutine.resume();
+			if (coroutine.done() && coroutine.promise().error)
+			{
+				std::rethrow_exception(std::exchange(coroutine.promise().error, nullptr));
+			}
+		}
+
+		std::coroutine_handle<promise_type> coroutine;
+	};
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// XXH64, bit for bit compatible with the reference implementation, so
+// digests can be checked with the stock xxhsum -H64 tool.
+namespace util
+{
+	namespace detail
+	{
+		const std::uint64_t kXxPrime1 = 11400714785074694791ULL;
+		const std::uint64_t kXxPrime2 = 14029467366897019727ULL;
+		const std::uint64_t kXxPrime3 = 1609587929392839161ULL;
+		const std::uint64_t kXxPrime4 = 9650029242287828579ULL;
+		const std::uint64_t kXxPrime5 = 2870177450012600261ULL;
+
+		inline std::uint64_t RotateLeft(std::uint64_t x, int r)
+		{
+			return (x << r) | (x >> (64 - r));
+		}
+
+		// unaligned little endian loads; x86 and ARM hosts are little endian
+		inline std::uint64_t Load64(const unsigned char * p)
+		{
+			std::uint64_t v;
+			std::memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		inline std::uint32_t Load32(const unsigned char * p)
+		{
+			std::uint32_t v;
+			std::memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		inline std::uint64_t XxRound(std::uint64_t acc, std::uint64_t input)
+		{
+			acc += input * kXxPrime2;
+			return RotateLeft(acc, 31) * kXxPrime1;
+		}
+
+		inline std::uint64_t XxMerge(std::uint64_t acc, std::uint64_t v)
+		{
+			acc ^= XxRound(0, v);
+			return acc * kXxPrime1 + kXxPrime4;
+		}
+	}
+
+	inline std::uint64_t Hash64(const void * data, std::size_t length, std::uint64_t seed = 0)
+	{
+		using namespace detail;
+		const unsigned char * p = (const unsigned char *)data;
+		const unsigned char * end = p + length;
+		std::uint64_t h;
+
+		if (length >= 32)
+		{
+			// four independent lanes keep the multipliers busy
+			std::uint64_t v1 = seed + kXxPrime1 + kXxPrime2;
+			std::uint64_t v2 = seed + kXxPrime2;
+			std::uint64_t v3 = seed;
+			std::uint64_t v4 = seed - kXxPrime1;
+			for (; p + 32 <= end; p += 32)
+			{
+				v1 = XxRound(v1, Load64(p));
+				v2 = XxRound(v2, Load64(p + 8));
+				v3 = XxRound(v3, Load64(p + 16));
+				v4 = XxRound(v4, Load64(p + 24));
+			}
+			h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+			h = XxMerge(h, v1);
+			h = XxMerge(h, v2);
+			h = XxMerge(h, v3);
+			h = XxMerge(h, v4);
+		}
+		else
+		{
+			h = seed + kXxPrime5;
+		}
+
+		h += length;
+		for (; p + 8 <= end; p += 8)
+		{
+			h ^= XxRound(0, Load64(p));
+			h = RotateLeft(h, 27) * kXxPrime1 + kXxPrime4;
+		}
+		if (p + 4 <= end)
+		{
+			h ^= Load32(p) * kXxPrime1;
+			h = RotateLeft(h, 23) * kXxPrime2 + kXxPrime3;
+			p += 4;
+		}
+		for (; p < end; p++)
+		{
+			h ^= *p * kXxPrime5;
+			h = RotateLeft(h, 11) * kXxPrime1;
+		}
+
+		h ^= h >> 33;
+		h *= kXxPrime2;
+		h ^= h >> 29;
+		h *= kXxPrime3;
+		h ^= h >> 32;
+		return h;
+	}
+}
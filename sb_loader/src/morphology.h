@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "simd.h"
+
+// Grey scale erosion and dilation of UInt16 planes with a square structuring
+// element, built from separable running min/max filters.
+//
+// Each 1D pass uses the van Herk/Gil-Werman scheme: the line is split into
+// blocks of the window width, prefix and suffix extrema are taken within each
+// block, and every output is the extremum of one suffix and one prefix, so a
+// pass costs three comparisons per pixel whatever the radius. Vertical passes
+// run over strips of kFilterStripWidth columns at a time, which keeps the
+// working set in cache and lets a whole row of the strip go through SSE2 at
+// once.
+namespace util
+{
+	const std::size_t kFilterStripWidth = 64;
+
+	struct MinOp
+	{
+		static constexpr UInt16 identity = 65535;
+
+		static UInt16 Apply(UInt16 a, UInt16 b)
+		{
+			return std::min(a, b);
+		}
+
+#ifdef SB_LOADER_SSE2
+		// SSE2 lacks unsigned 16 bit min/max; a - (a -sat b) is min(a, b)
+		static __m128i Apply(__m128i a, __m128i b)
+		{
+			return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+		}
+#endif
+	};
+
+	struct MaxOp
+	{
+		static constexpr UInt16 identity = 0;
+
+		static UInt16 Apply(UInt16 a, UInt16 b)
+		{
+			return std::max(a, b);
+		}
+
+#ifdef SB_LOADER_SSE2
+		static __m128i Apply(__m128i a, __m128i b)
+		{
+			return _mm_add_epi16(b, _mm_subs_epu16(a, b));
+		}
+#endif
+	};
+
+	namespace detail
+	{
+		// out = Op(a, b) over lanes contiguous pixels.
+		template <typename Op>
+		void CombineLanes(const UInt16 * a, const UInt16 * b, UInt16 * out, std::size_t lanes)
+		{
+			std::size_t l = 0;
+#ifdef SB_LOADER_SSE2
+			for (; l + 8 <= lanes; l += 8)
+			{
+				__m128i va = _mm_loadu_si128((const __m128i *)(a + l));
+				__m128i vb = _mm_loadu_si128((const __m128i *)(b + l));
+				_mm_storeu_si128((__m128i *)(out + l), Op::Apply(va, vb));
+			}
+#endif
+			for (; l < lanes; l++)
+			{
+				out[l] = Op::Apply(a[l], b[l]);
+			}
+		}
+	}
+
+	// Running extremum over a window of 2 * radius + 1 along count positions
+	// of lanes pixels each, position i of lane l being at line[i * step + l].
+	// Pixels outside the line are ignored. scratch is resized as needed and
+	// may be reused between calls; line is overwritten with the result.
+	template <typename Op>
+	void FilterLine(UInt16 * line, std::size_t count, std::size_t step, std::size_t lanes, int radius, std::vector<UInt16> & scratch)
+	{
+		if (radius <= 0 || count == 0)
+		{
+			return;
+		}
+		const std::size_t width = 2 * (std::size_t)radius + 1;
+		// the line padded by radius identity pixels each side, rounded up to
+		// whole blocks
+		const std::size_t padded = (count + 2 * radius + width - 1) / width * width;
+		scratch.resize(3 * padded * lanes);
+		UInt16 * prefix = scratch.data();
+		UInt16 * suffix = prefix + padded * lanes;
+		UInt16 * identity = suffix + padded * lanes;
+		std::fill(identity, identity + lanes, Op::identity);
+
+		auto input = [&](std::size_t j) -> const UInt16 *
+		{
+			return j >= (std::size_t)radius && j - radius < count ? line + (j - radius) * step : identity;
+		};
+
+		for (std::size_t j = 0; j < padded; j++)
+		{
+			if (j % width == 0)
+			{
+				std::copy(input(j), input(j) + lanes, prefix + j * lanes);
+			}
+			else
+			{
+				detail::CombineLanes<Op>(prefix + (j - 1) * lanes, input(j), prefix + j * lanes, lanes);
+			}
+		}
+		for (std::size_t j = padded; j-- > 0;)
+		{
+			if (j % width == width - 1)
+			{
+				std::copy(input(j), input(j) + lanes, suffix + j * lanes);
+			}
+			else
+			{
+				detail::CombineLanes<Op>(suffix + (j + 1) * lanes, input(j), suffix + j * lanes, lanes);
+			}
+		}
+		// padded window [i, i + 2r] is the input window [i - r, i + r]
+		for (std::size_t i = 0; i < count; i++)
+		{
+			detail::CombineLanes<Op>(suffix + i * lanes, prefix + (i + 2 * radius) * lanes, line + i * step, lanes);
+		}
+	}
+
+	// Separable square filter of side 2 * radius + 1, in place.
+	template <typename Op>
+	void FilterPlane(UInt16 * plane, int width, int height, int radius, std::vector<UInt16> & scratch)
+	{
+		for (int y = 0; y < height; y++)
+		{
+			FilterLine<Op>(plane + (std::size_t)y * width, width, 1, 1, radius, scratch);
+		}
+		for (std::size_t x = 0; x < (std::size_t)width; x += kFilterStripWidth)
+		{
+			std::size_t lanes = std::min(kFilterStripWidth, width - x);
+			FilterLine<Op>(plane + x, height, width, lanes, radius, scratch);
+		}
+	}
+
+	inline void Erode(UInt16 * plane, int width, int height, int radius, std::vector<UInt16> & scratch)
+	{
+		FilterPlane<MinOp>(plane, width, height, radius, scratch);
+	}
+
+	inline void Dilate(UInt16 * plane, int width, int height, int radius, std::vector<UInt16> & scratch)
+	{
+		FilterPlane<MaxOp>(plane, width, height, radius, scratch);
+	}
+
+	// plane -= subtrahend, saturating at zero.
+	inline void SubtractSaturate(UInt16 * plane, const UInt16 * subtrahend, std::size_t pixels)
+	{
+		std::size_t i = 0;
+#ifdef SB_LOADER_SSE2
+		for (; i + 8 <= pixels; i += 8)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)(plane + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(subtrahend + i));
+			_mm_storeu_si128((__m128i *)(plane + i), _mm_subs_epu16(a, b));
+		}
+#endif
+		for (; i < pixels; i++)
+		{
+			plane[i] = plane[i] > subtrahend[i] ? plane[i] - subtrahend[i] : 0;
+		}
+	}
+}
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include "fmt/format.h"
+#include "mosaic.h"
+
+namespace
+{
+	void WriteFile(const std::string & path, const void * data, std::size_t bytes)
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write((const char *)data, (std::streamsize)bytes);
+		if (!out)
+		{
+			throw std::runtime_error(fmt::format("unable to write {}", path));
+		}
+	}
+
+	// Pixels neighbouring tiles share along one axis: the tile size less the
+	// smallest step to a tile level with it on the other axis.
+	int Overlap(const std::vector<MosaicLayout::Tile> & tiles, int size, int across, bool along_x)
+	{
+		long step = 0;
+		for (auto & a : tiles)
+		{
+			for (auto & b : tiles)
+			{
+				long d = along_x ? b.x - a.x : b.y - a.y;
+				long level = along_x ? b.y - a.y : b.x - a.x;
+				if (d > 0 && d < size && std::abs(level) < across / 2 && (step == 0 || d < step))
+				{
+					step = d;
+				}
+			}
+		}
+		return step == 0 ? 0 : (int)(size - step);
+	}
+}
+
+MosaicLayout MosaicLayout::Of(III::SBReadFile * reader, int capture, int tile_width, int tile_height,
+	const float * pixel_size, bool has_pixel_size, const std::string & placement, double overlap)
+{
+	MosaicLayout layout;
+	layout.tile_width = tile_width;
+	layout.tile_height = tile_height;
+
+	int positions = reader->GetNumPositions(capture);
+	std::vector<double> xs;
+	std::vector<double> ys;
+	bool moved = false;
+	for (int position = 0; position < positions; position++)
+	{
+		xs.push_back(reader->GetXPosition(capture, position));
+		ys.push_back(reader->GetYPosition(capture, position));
+		moved = moved || xs.back() != xs.front() || ys.back() != ys.front();
+	}
+	bool stage = has_pixel_size && pixel_size[0] > 0 && pixel_size[1] > 0 && moved;
+	layout.placement = placement == "auto" ? (stage ? "stage" : "grid") : placement;
+	if (layout.placement == "stage" && !stage)
+	{
+		throw std::runtime_error("stage placement needs a pixel size and stage positions that differ");
+	}
+
+	long step_x = std::max(1L, std::lround(tile_width * (1 - overlap)));
+	long step_y = std::max(1L, std::lround(tile_height * (1 - overlap)));
+	for (int position = 0; position < positions; position++)
+	{
+		Tile tile = { position, 0, 0 };
+		if (layout.placement == "stage")
+		{
+			tile.x = std::lround(xs[position] / pixel_size[0]);
+			tile.y = std::lround(ys[position] / pixel_size[1]);
+		}
+		else
+		{
+			tile.x = (long)reader->GetMontageColumn(capture, position) * step_x;
+			tile.y = (long)reader->GetMontageRow(capture, position) * step_y;
+		}
+		layout.tiles.push_back(tile);
+	}
+	if (layout.placement == "grid")
+	{
+		// positions that are not a montage all sit in row 0, column 0
+		std::map<std::pair<long, long>, int> cells;
+		for (auto & tile : layout.tiles)
+		{
+			auto cell = cells.emplace(std::make_pair(tile.y, tile.x), tile.position);
+			if (!cell.second)
+			{
+				throw std::runtime_error(fmt::format("positions {} and {} share montage row {} column {}, so the capture is not a montage{}",
+					cell.first->second, tile.position, tile.y / step_y, tile.x / step_x,
+					stage ? "; place it by stage" : ", nor can it be placed by stage without a pixel size and differing stage positions"));
+			}
+		}
+	}
+
+	long min_x = layout.tiles.front().x;
+	long min_y = layout.tiles.front().y;
+	for (auto & tile : layout.tiles)
+	{
+		min_x = std::min(min_x, tile.x);
+		min_y = std::min(min_y, tile.y);
+	}
+	for (auto & tile : layout.tiles)
+	{
+		tile.x -= min_x;
+		tile.y -= min_y;
+		layout.width = std::max(layout.width, tile.x + tile_width);
+		layout.height = std::max(layout.height, tile.y + tile_height);
+	}
+	// in this order only a band of chunks is ever open
+	std::sort(layout.tiles.begin(), layout.tiles.end(), [](const Tile & a, const Tile & b)
+	{
+		return std::make_pair(a.y, a.x) < std::make_pair(b.y, b.x);
+	});
+	layout.overlap_x = Overlap(layout.tiles, tile_width, tile_height, true);
+	layout.overlap_y = Overlap(layout.tiles, tile_height, tile_width, false);
+	return layout;
+}
+
+std::string MosaicLayout::Describe() const
+{
+	return fmt::format("mosaic {}x{} of {} tiles of {}x{} placed by {}, overlapping {}x{} pixels", width, height,
+		tiles.size(), tile_width, tile_height, placement, overlap_x, overlap_y);
+}
+
+MosaicWriter::MosaicWriter(const std::string & path, const MosaicLayout & layout, const std::array<int, 3> & tcz,
+	std::size_t pixel_bytes, int chunk, bool blend, const std::string & attributes)
+	: path(path)
+	, layout(layout)
+	, pixel_bytes(pixel_bytes)
+	, chunk(std::max(16, chunk))
+	, blend(blend)
+{
+	chunks_x = (layout.width + this->chunk - 1) / this->chunk;
+	chunks_y = (layout.height + this->chunk - 1) / this->chunk;
+	tiles_per_chunk.assign((std::size_t)(chunks_x * chunks_y), 0);
+	for (auto & tile : layout.tiles)
+	{
+		for (long cy = tile.y / this->chunk; cy <= (tile.y + layout.tile_height - 1) / this->chunk; cy++)
+		{
+			for (long cx = tile.x / this->chunk; cx <= (tile.x + layout.tile_width - 1) / this->chunk; cx++)
+			{
+				tiles_per_chunk[cy * chunks_x + cx]++;
+			}
+		}
+	}
+
+	// weights rise linearly from the tile edge across the overlap
+	auto ramp = [](int size, int overlap)
+	{
+		std::vector<float> weights(size, 1.0f);
+		for (int i = 0; i < size && overlap > 0; i++)
+		{
+			weights[i] = std::min(1.0f, (std::min(i, size - 1 - i) + 1.0f) / (overlap + 1.0f));
+		}
+		return weights;
+	};
+	ramp_x = ramp(layout.tile_width, layout.overlap_x);
+	ramp_y = ramp(layout.tile_height, layout.overlap_y);
+
+	std::filesystem::create_directories(path);
+	std::string zarray = fmt::format(
+		"{{\n"
+		"  \"zarr_format\": 2,\n"
+		"  \"shape\": [{}, {}, {}, {}, {}],\n"
+		"  \"chunks\": [1, 1, 1, {}, {}],\n"
+		"  \"dtype\": \"{}\",\n"
+		"  \"compressor\": null,\n"
+		"  \"fill_value\": 0,\n"
+		"  \"order\": \"C\",\n"
+		"  \"filters\": null,\n"
+		"  \"dimension_separator\": \".\"\n"
+		"}}\n", tcz[0], tcz[1], tcz[2], layout.height, layout.width, this->chunk, this->chunk, pixel_bytes == 1 ? "|u1" : "<u2");
+	WriteFile(path + "/.zarray", zarray.data(), zarray.size());
+	WriteFile(path + "/.zattrs", attributes.data(), attributes.size());
+}
+
+void MosaicWriter::Add(const PlaneCoord & p, std::size_t tile_index, const void * pixels)
+{
+	auto key = std::make_tuple(p.t, p.c, p.z);
+	Plane & plane = planes[key];
+	if (plane.remaining.empty())
+	{
+		plane.remaining = tiles_per_chunk;
+	}
+	const MosaicLayout::Tile & tile = layout.tiles[tile_index];
+	const long tw = layout.tile_width;
+	const long th = layout.tile_height;
+	for (long cy = tile.y / chunk; cy <= (tile.y + th - 1) / chunk; cy++)
+	{
+		for (long cx = tile.x / chunk; cx <= (tile.x + tw - 1) / chunk; cx++)
+		{
+			std::size_t index = (std::size_t)(cy * chunks_x + cx);
+			auto open = plane.open.find(index);
+			if (open == plane.open.end())
+			{
+				Chunk fresh;
+				fresh.sum.assign((std::size_t)chunk * chunk, 0.0f);
+				fresh.weight.assign((std::size_t)chunk * chunk, 0.0f);
+				open = plane.open.emplace(index, std::move(fresh)).first;
+				open_bytes += (std::size_t)chunk * chunk * 2 * sizeof(float);
+				peak_bytes = std::max(peak_bytes, open_bytes);
+			}
+			Chunk & target = open->second;
+
+			long x0 = std::max(tile.x, cx * chunk);
+			long x1 = std::min(tile.x + tw, (cx + 1) * chunk);
+			long y0 = std::max(tile.y, cy * chunk);
+			long y1 = std::min(tile.y + th, (cy + 1) * chunk);
+			for (long y = y0; y < y1; y++)
+			{
+				long ty = y - tile.y;
+				std::size_t row = (std::size_t)(y - cy * chunk) * chunk;
+				for (long x = x0; x < x1; x++)
+				{
+					long tx = x - tile.x;
+					std::size_t source = (std::size_t)(ty * tw + tx);
+					float value = pixel_bytes == 1 ? ((const UInt8 *)pixels)[source] : ((const UInt16 *)pixels)[source];
+					std::size_t at = row + (std::size_t)(x - cx * chunk);
+					if (blend)
+					{
+						float w = ramp_y[ty] * ramp_x[tx];
+						target.sum[at] += w * value;
+						target.weight[at] += w;
+					}
+					else
+					{
+						target.sum[at] = value;
+						target.weight[at] = 1.0f;
+					}
+				}
+			}
+
+			if (--plane.remaining[index] == 0)
+			{
+				WriteChunk(p, index, target);
+				plane.open.erase(open);
+				open_bytes -= (std::size_t)chunk * chunk * 2 * sizeof(float);
+			}
+		}
+	}
+	if (++plane.tiles_added == layout.tiles.size())
+	{
+		planes.erase(key);
+	}
+}
+
+void MosaicWriter::WriteChunk(const PlaneCoord & p, std::size_t index, const Chunk & source)
+{
+	const std::size_t pixels = (std::size_t)chunk * chunk;
+	const float high = pixel_bytes == 1 ? 255.0f : 65535.0f;
+	std::vector<UInt8> bytes(pixels * pixel_bytes);
+	for (std::size_t i = 0; i < pixels; i++)
+	{
+		float value = source.weight[i] > 0 ? std::min(high, std::round(source.sum[i] / source.weight[i])) : 0.0f;
+		if (pixel_bytes == 1)
+		{
+			bytes[i] = (UInt8)value;
+		}
+		else
+		{
+			((UInt16 *)bytes.data())[i] = (UInt16)value;
+		}
+	}
+	WriteFile(fmt::format("{}/{}.{}.{}.{}.{}", path, p.t, p.c, p.z, index / chunks_x, index % chunks_x), bytes.data(), bytes.size());
+	chunks_written++;
+}
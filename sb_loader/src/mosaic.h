@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "SBReadFile.h"
+#include "dimension_order.h"
+
+// Where each position's plane of a montage capture lies in the mosaic, in
+// output pixels.
+struct MosaicLayout
+{
+	struct Tile
+	{
+		int position;
+		long x;
+		long y;
+	};
+
+	long width = 0;
+	long height = 0;
+	int tile_width = 0;
+	int tile_height = 0;
+	int overlap_x = 0;	// pixels neighbouring tiles share, for blending
+	int overlap_y = 0;
+	std::string placement;	// "stage" or "grid"
+	std::vector<Tile> tiles;	// top to bottom, left to right
+
+	// Places tiles of tile_width x tile_height output pixels by stage
+	// coordinates (the image centres, in microns, over pixel_size) or, with
+	// placement "grid", by montage row and column overlapping by the given
+	// fraction. "auto" takes the stage when the pixel size is known and the
+	// positions differ. Throws when grid placement would put two positions
+	// in one montage cell.
+	static MosaicLayout Of(III::SBReadFile * reader, int capture, int tile_width, int tile_height,
+		const float * pixel_size, bool has_pixel_size, const std::string & placement, double overlap);
+
+	std::string Describe() const;
+};
+
+// Writes a capture's mosaic as a Zarr v2 array of (T, C, Z, Y, X), in
+// chunk x chunk pixel chunks, as its tiles arrive. Only the chunks a tile
+// has reached but not every tile over them has are held, as float weighted
+// sums; a chunk is written, and dropped, once its last tile is in. Chunks
+// no tile covers are left out and read as 0.
+//
+// With blend set, overlapping tiles fade linearly across the overlap;
+// otherwise later tiles cover earlier ones.
+class MosaicWriter
+{
+public:
+	MosaicWriter(const std::string & path, const MosaicLayout & layout, const std::array<int, 3> & tcz,
+		std::size_t pixel_bytes, int chunk, bool blend, const std::string & attributes);
+
+	MosaicWriter(const MosaicWriter &) = delete;
+	MosaicWriter & operator=(const MosaicWriter &) = delete;
+
+	// Adds layout.tiles[tile] of plane p, pixel_bytes per pixel.
+	void Add(const PlaneCoord & p, std::size_t tile, const void * pixels);
+
+	const std::string & Path() const
+	{
+		return path;
+	}
+
+	UInt64 ChunksWritten() const
+	{
+		return chunks_written;
+	}
+
+	// Most bytes of chunks held at once.
+	std::size_t PeakBytes() const
+	{
+		return peak_bytes;
+	}
+
+private:
+	struct Chunk
+	{
+		std::vector<float> sum;
+		std::vector<float> weight;
+	};
+
+	struct Plane
+	{
+		std::vector<int> remaining;	// tiles yet to come, per chunk
+		std::map<std::size_t, Chunk> open;
+		std::size_t tiles_added = 0;
+	};
+
+	void WriteChunk(const PlaneCoord & p, std::size_t index, const Chunk & chunk);
+
+	std::string path;
+	const MosaicLayout & layout;
+	std::size_t pixel_bytes;
+	int chunk;
+	bool blend;
+	long chunks_x;
+	long chunks_y;
+	std::vector<int> tiles_per_chunk;
+	std::vector<float> ramp_x;
+	std::vector<float> ramp_y;
+	std::map<std::tuple<int, int, int>, Plane> planes;
+	std::size_t open_bytes = 0;
+	std::size_t peak_bytes = 0;
+	UInt64 chunks_written = 0;
+};
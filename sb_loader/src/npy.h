@@ -0,0 +1,132 @@
+#pragma once
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+
+// NumPy .npy version 1.0 header for a C ordered array of the given dtype
+// descr (e.g. "<u2"). The header is padded with spaces so the data starts on
+// a multiple of alignment, which must itself be a multiple of 64.
+inline std::string NpyHeader(const std::string & descr, const std::vector<UInt64> & shape, std::size_t alignment = 64)
+{
+	std::string dims;
+	for (auto d : shape)
+	{
+		dims += fmt::format("{}, ", d);
+	}
+	if (shape.size() > 1)
+	{
+		dims.resize(dims.size() - 2);
+	}
+	else if (!dims.empty())
+	{
+		dims.resize(dims.size() - 1);
+	}
+	std::string dict = fmt::format("{{'descr': '{}', 'fortran_order': False, 'shape': ({}), }}", descr, dims);
+
+	const std::size_t preamble = 10;	// magic, version, header length
+	std::size_t total = (preamble + dict.size() + 1 + alignment - 1) / alignment * alignment;
+	if (total - preamble > 0xFFFF)
+	{
+		throw std::runtime_error("npy header too long");
+	}
+	dict.append(total - preamble - dict.size() - 1, ' ');
+	dict += '\n';
+
+	std::string header("\x93NUMPY\x01\x00", 8);
+	header += (char)((total - preamble) & 0xFF);
+	header += (char)((total - preamble) >> 8);
+	return header + dict;
+}
+
+// Offset of the array data in an existing .npy file, or 0 when the file
+// is missing or is not a .npy file.
+inline UInt64 NpyDataOffset(const std::string & path)
+{
+	std::ifstream in(path, std::ios::binary);
+	unsigned char preamble[12];
+	if (!in.read((char *)preamble, sizeof(preamble)) || std::string((const char *)preamble, 6) != "\x93NUMPY")
+	{
+		return 0;
+	}
+	if (preamble[6] == 1)
+	{
+		return 10 + (preamble[8] | (preamble[9] << 8));
+	}
+	return 12 + (preamble[8] | (preamble[9] << 8) | (preamble[10] << 16) | ((UInt64)preamble[11] << 24));
+}
+
+struct NpyArray
+{
+	std::string descr;
+	std::vector<UInt64> shape;
+	std::vector<char> data;
+};
+
+// Reads a C ordered .npy file (format version 1 or 2).
+inline NpyArray ReadNpy(const std::string & path)
+{
+	std::ifstream in(path, std::ios::binary);
+	char preamble[8];
+	if (!in.read(preamble, 8) || std::string(preamble, 6) != "\x93NUMPY")
+	{
+		throw std::runtime_error(fmt::format("{} is not a .npy file", path));
+	}
+	std::size_t header_length = 0;
+	unsigned char length[4] = {};
+	in.read((char *)length, preamble[6] == 1 ? 2 : 4);
+	for (int i = 3; i >= 0; i--)
+	{
+		header_length = (header_length << 8) | length[i];
+	}
+	std::string header(header_length, ' ');
+	in.read(&header[0], header_length);
+
+	auto field = [&](const std::string & key) -> std::string
+	{
+		auto at = header.find("'" + key + "'");
+		if (at == std::string::npos)
+		{
+			throw std::runtime_error(fmt::format("{} has no {} in its header", path, key));
+		}
+		at = header.find(':', at) + 1;
+		while (header[at] == ' ')
+		{
+			at++;
+		}
+		char close = header[at] == '(' ? ')' : (header[at] == '\'' ? '\'' : ',');
+		auto end = header.find(close, at + 1);
+		return header.substr(at + (close == ',' ? 0 : 1), end - at - (close == ',' ? 0 : 1));
+	};
+
+	NpyArray array;
+	array.descr = field("descr");
+	if (field("fortran_order").find("True") != std::string::npos)
+	{
+		throw std::runtime_error(fmt::format("{} is Fortran ordered", path));
+	}
+	std::string dims = field("shape");
+	UInt64 elements = 1;
+	for (std::size_t at = 0; at < dims.size();)
+	{
+		auto next = dims.find(',', at);
+		std::string dim = dims.substr(at, next == std::string::npos ? std::string::npos : next - at);
+		if (dim.find_first_of("0123456789") != std::string::npos)
+		{
+			array.shape.push_back(std::stoull(dim));
+			elements *= array.shape.back();
+		}
+		at = next == std::string::npos ? dims.size() : next + 1;
+	}
+
+	std::size_t item_size = std::stoul(array.descr.substr(2));
+	array.data.resize(elements * item_size);
+	if (!in.read(array.data.data(), array.data.size()))
+	{
+		throw std::runtime_error(fmt::format("{} is truncated", path));
+	}
+	return array;
+}
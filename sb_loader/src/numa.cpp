@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "fmt/format.h"
+#include "numa.h"
+#include "plane_pool.h"
+
+#ifdef __linux__
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+	// from linux/mempolicy.h, which libc does not wrap
+	const int kMpolDefault = 0;
+	const int kMpolPreferred = 1;
+	const unsigned kMpolMfMove = 1 << 1;
+	const std::size_t kNodeMaskWords = 16;
+	const unsigned long kMaxNode = kNodeMaskWords * 64 + 1;
+
+	std::vector<unsigned long> NodeMask(int node)
+	{
+		std::vector<unsigned long> mask(kNodeMaskWords);
+		mask[node / 64] |= 1ul << (node % 64);
+		return mask;
+	}
+
+	// "0-3,8,10-11"
+	std::vector<int> ParseList(const std::string & list)
+	{
+		std::vector<int> values;
+		std::stringstream ranges(list);
+		std::string range;
+		while (std::getline(ranges, range, ','))
+		{
+			int first;
+			int last;
+			if (std::sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+			{
+				for (int v = first; v <= last; v++)
+				{
+					values.push_back(v);
+				}
+			}
+			else if (std::sscanf(range.c_str(), "%d", &first) == 1)
+			{
+				values.push_back(first);
+			}
+		}
+		return values;
+	}
+
+	std::string ReadLine(const std::string & path)
+	{
+		std::ifstream in(path);
+		std::string line;
+		std::getline(in, line);
+		return line;
+	}
+#endif
+
+	std::vector<std::vector<int>> FindNodes()
+	{
+		std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+		for (int node : ParseList(ReadLine("/sys/devices/system/node/online")))
+		{
+			if (node >= (int)kNodeMaskWords * 64)
+			{
+				continue;
+			}
+			nodes.resize(std::max<std::size_t>(nodes.size(), node + 1));
+			nodes[node] = ParseList(ReadLine(fmt::format("/sys/devices/system/node/node{}/cpulist", node)));
+		}
+#endif
+		if (std::none_of(nodes.begin(), nodes.end(), [](const std::vector<int> & cpus) { return !cpus.empty(); }))
+		{
+			nodes.assign(1, std::vector<int>());
+			for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+			{
+				nodes[0].push_back((int)cpu);
+			}
+		}
+		return nodes;
+	}
+
+	// Nodes with CPUs.
+	std::vector<int> WorkingNodes()
+	{
+		std::vector<int> working;
+		const auto & nodes = util::NumaNodes();
+		for (int node = 0; node < (int)nodes.size(); node++)
+		{
+			if (!nodes[node].empty())
+			{
+				working.push_back(node);
+			}
+		}
+		return working;
+	}
+}
+
+const std::vector<std::vector<int>> & util::NumaNodes()
+{
+	static const std::vector<std::vector<int>> nodes = FindNodes();
+	return nodes;
+}
+
+bool util::PlaceOnNode(void * data, std::size_t bytes, int node)
+{
+#ifdef __linux__
+	std::size_t page = (std::size_t)sysconf(_SC_PAGESIZE);
+	std::size_t start = util::AlignUp((std::size_t)data, page);
+	std::size_t end = ((std::size_t)data + bytes) / page * page;
+	if (end <= start)
+	{
+		return true;
+	}
+	std::vector<unsigned long> mask = NodeMask(node);
+	return syscall(SYS_mbind, start, end - start, kMpolPreferred, mask.data(), kMaxNode, kMpolMfMove) == 0;
+#else
+	(void)data;
+	(void)bytes;
+	(void)node;
+	return false;
+#endif
+}
+
+NumaBinding::NumaBinding(int node)
+	: node(node)
+{
+	const auto & nodes = util::NumaNodes();
+	if (node < 0 || node >= (int)nodes.size() || nodes[node].empty())
+	{
+		throw std::runtime_error(fmt::format("no CPUs on NUMA node {}", node));
+	}
+#ifdef __linux__
+	if (sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) != 0)
+	{
+		throw std::runtime_error(fmt::format("unable to read the CPU affinity: {}", std::strerror(errno)));
+	}
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	for (int cpu : nodes[node])
+	{
+		if (cpu < CPU_SETSIZE)
+		{
+			CPU_SET(cpu, &cpus);
+		}
+	}
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+	{
+		throw std::runtime_error(fmt::format("unable to run on NUMA node {}: {}", node, std::strerror(errno)));
+	}
+	// the memory policy is a preference; without it first touch still
+	// mostly lands on the node the threads run on
+	saved_nodes.assign(kNodeMaskWords, 0);
+	if (syscall(SYS_get_mempolicy, &saved_mode, saved_nodes.data(), kMaxNode, nullptr, 0) != 0)
+	{
+		saved_mode = kMpolDefault;
+		saved_nodes.clear();
+	}
+	std::vector<unsigned long> mask = NodeMask(node);
+	syscall(SYS_set_mempolicy, kMpolPreferred, mask.data(), kMaxNode);
+#endif
+}
+
+NumaBinding::~NumaBinding()
+{
+#ifdef __linux__
+	if (saved_mode == kMpolDefault || saved_nodes.empty())
+	{
+		syscall(SYS_set_mempolicy, kMpolDefault, nullptr, 0);
+	}
+	else
+	{
+		syscall(SYS_set_mempolicy, saved_mode, saved_nodes.data(), kMaxNode);
+	}
+	sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+#endif
+}
+
+int NumaBinding::NextNode()
+{
+	static std::atomic<unsigned> next{ 0 };
+	std::vector<int> working = WorkingNodes();
+	return working[next++ % working.size()];
+}
+
+namespace
+{
+	enum class Placement
+	{
+		FirstTouch,	// unpinned threads, buffers touched by the caller
+		Local,		// pinned threads, buffers on their node
+		Remote		// pinned threads, buffers on the next node
+	};
+
+	// A read, a transform and a write of each plane, on every CPU at once;
+	// returns the seconds taken.
+	double RunPlacement(Placement placement, int plane_count, std::size_t plane_bytes)
+	{
+		const auto & nodes = util::NumaNodes();
+		std::vector<int> working = WorkingNodes();
+		struct Worker
+		{
+			int node;
+			int memory_node;
+			UInt8 * plane;
+			UInt8 * output;
+		};
+		std::vector<Worker> workers;
+		for (std::size_t i = 0; i < working.size(); i++)
+		{
+			for (std::size_t cpu = 0; cpu < nodes[working[i]].size(); cpu++)
+			{
+				Worker worker = { working[i], -1, nullptr, nullptr };
+				if (placement == Placement::Local)
+				{
+					worker.memory_node = working[i];
+				}
+				else if (placement == Placement::Remote)
+				{
+					worker.memory_node = working[(i + 1) % working.size()];
+				}
+				worker.plane = (UInt8 *)util::AlignedAlloc(plane_bytes, 4096);
+				worker.output = (UInt8 *)util::AlignedAlloc(plane_bytes, 4096);
+				if (worker.memory_node >= 0)
+				{
+					util::PlaceOnNode(worker.plane, plane_bytes, worker.memory_node);
+					util::PlaceOnNode(worker.output, plane_bytes, worker.memory_node);
+				}
+				else
+				{
+					std::memset(worker.plane, 0, plane_bytes);
+					std::memset(worker.output, 0, plane_bytes);
+				}
+				workers.push_back(worker);
+			}
+		}
+
+		std::atomic<int> next{ 0 };
+		std::atomic<int> ready{ 0 };
+		std::atomic<bool> go{ false };
+		std::vector<std::thread> threads;
+		for (const Worker & worker : workers)
+		{
+			threads.emplace_back([&, worker]
+			{
+				std::unique_ptr<NumaBinding> binding;
+				if (placement != Placement::FirstTouch)
+				{
+					binding.reset(new NumaBinding(worker.node));
+					// fault the pages in before the clock starts
+					std::memset(worker.plane, 0, plane_bytes);
+					std::memset(worker.output, 0, plane_bytes);
+				}
+				ready++;
+				while (!go)
+				{
+					std::this_thread::yield();
+				}
+				UInt16 * pixels = (UInt16 *)worker.plane;
+				std::size_t count = plane_bytes / sizeof(UInt16);
+				for (int plane = next++; plane < plane_count; plane = next++)
+				{
+					for (std::size_t i = 0; i < count; i++)
+					{
+						pixels[i] = (UInt16)(i * 2654435761u + plane);
+					}
+					for (std::size_t i = 0; i < count; i++)
+					{
+						pixels[i] = (UInt16)std::min<UInt32>(65535, pixels[i] * 3u / 2);
+					}
+					std::memcpy(worker.output, worker.plane, plane_bytes);
+				}
+			});
+		}
+		while (ready < (int)workers.size())
+		{
+			std::this_thread::yield();
+		}
+		auto start = std::chrono::steady_clock::now();
+		go = true;
+		for (auto & thread : threads)
+		{
+			thread.join();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		for (const Worker & worker : workers)
+		{
+			util::AlignedFree(worker.plane);
+			util::AlignedFree(worker.output);
+		}
+		return seconds;
+	}
+}
+
+void BenchmarkNumaPlacement(int plane_count, int width, int height)
+{
+	std::size_t plane_bytes = (std::size_t)width * height * sizeof(UInt16);
+	std::vector<int> working = WorkingNodes();
+	std::size_t cpus = 0;
+	for (int node : working)
+	{
+		cpus += util::NumaNodes()[node].size();
+	}
+	fmt::print("{} planes of {}x{} on {} NUMA node{} with {} CPUs\n", plane_count, width, height,
+		working.size(), working.size() == 1 ? "" : "s", cpus);
+	if (working.size() == 1)
+	{
+		fmt::print("a single node: placement cannot differ much here\n");
+	}
+
+	std::vector<std::pair<const char *, Placement>> runs = {
+		{ "first touch", Placement::FirstTouch },
+		{ "node local", Placement::Local },
+	};
+	if (working.size() > 1)
+	{
+		runs.push_back({ "cross node", Placement::Remote });
+	}
+	for (auto & run : runs)
+	{
+		double seconds = RunPlacement(run.second, plane_count, plane_bytes);
+		fmt::print("{:>12}: {:8.1f} planes/s {:8.1f} MiB/s\n", run.first, plane_count / seconds,
+			plane_count * (double)plane_bytes / seconds / (1 << 20));
+	}
+}
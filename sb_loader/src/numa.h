@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+	#include <sched.h>
+#endif
+
+namespace util
+{
+	// CPUs of each NUMA node that has any, indexed by node. A single node
+	// with every CPU where the machine has no NUMA or is not Linux.
+	const std::vector<std::vector<int>> & NumaNodes();
+
+	// Prefers node for the pages of [data, data + bytes), moving those
+	// already placed elsewhere. Pages only partly inside the range are left
+	// as they are. Returns false where this is not supported.
+	bool PlaceOnNode(void * data, std::size_t bytes, int node);
+}
+
+// Runs the calling thread, and the threads it starts while bound, on the
+// CPUs of one node, allocating their memory there first. Destroying it
+// restores the calling thread's CPUs and memory policy; threads started
+// meanwhile stay on the node.
+class NumaBinding
+{
+public:
+	explicit NumaBinding(int node);
+	~NumaBinding();
+
+	NumaBinding(const NumaBinding &) = delete;
+	NumaBinding & operator=(const NumaBinding &) = delete;
+
+	int Node() const
+	{
+		return node;
+	}
+
+	// Spreads conversions, or captures, running at once over the nodes,
+	// round robin.
+	static int NextNode();
+
+private:
+	int node;
+#ifdef __linux__
+	cpu_set_t saved_cpus;
+	int saved_mode = 0;
+	std::vector<unsigned long> saved_nodes;
+#endif
+};
+
+// Times plane-sized fill, transform and copy passes on every node's CPUs,
+// with buffers left where the first touch puts them, on the node doing the
+// work and on another node.
+void BenchmarkNumaPlacement(int plane_count, int width, int height);
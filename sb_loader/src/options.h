@@ -0,0 +1,486 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fmt/format.h"
+#include "dimension_order.h"
+#include "plane_writer.h"
+
+struct ConvertOptions
+{
+	std::string command = "convert";
+	std::string filename;
+	std::string output_dir;		// empty: read planes without writing them
+	std::string format = "raw";	// raw or npy
+	std::string manifest;		// per plane digest list, empty for none
+	bool resume = false;		// keep a checkpoint journal and skip work it records
+	bool aux = false;		// export each capture's auxiliary data channels
+	std::string stream;		// shared memory plane ring to publish to, empty for none
+	int stream_slots = 16;
+	int stream_consumers = 1;	// consumers to wait for before the first plane
+	DimensionOrder order;		// output axis order, TCZYX by default
+
+	// stitch the positions of each capture into one mosaic
+	bool mosaic = false;
+	std::string mosaic_placement = "auto";	// stage, grid or auto
+	double mosaic_overlap = 0.1;	// grid: fraction of a tile neighbours share
+	bool mosaic_blend = true;	// linear blending, or later tiles on top
+	int mosaic_chunk = 1024;
+
+	// dark frame and flat field reference files by channel name
+	std::map<std::string, std::string> dark_frames;
+	std::map<std::string, std::string> flat_fields;
+
+	int bin = 1;			// XY bin factor, 1 for none
+	bool bin_mean = true;		// mean of each bin, or its saturated sum
+	int background_radius = 0;	// tophat background subtraction, 0 for none
+	int transform_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+	int capture_jobs = 1;		// captures converted at once
+	int read_ahead = 0;		// planes read ahead of the one being processed, 0 for none
+	int read_threads = 2;		// threads reading ahead
+	bool read_tune = false;		// tune how many of them read at once
+	int readers = 8;		// open readers kept per file
+	int reader_ttl = 60;		// seconds an idle reader stays open
+	std::string numa = "off";	// off, auto or a node: run the conversion on one NUMA node
+	std::string read_direction = "auto";	// z or t: the axis stepped between reads
+
+	// 8 bit conversion with a percentile contrast stretch
+	bool to_8bit = false;
+	double contrast_low = 0.1;
+	double contrast_high = 99.9;
+	int contrast_samples = 16;
+	WriterOptions writer;
+	bool direct = false;		// O_DIRECT output, bypassing the page cache
+	int pool_mb = 256;
+
+	// watch
+	std::vector<std::string> watch_dirs;
+	bool watch_existing = false;	// also convert files present at startup
+	int settle_seconds = 30;	// quiet time before a file counts as complete
+	int jobs = 2;			// concurrent conversions
+	int memory_mb = 4096;		// budget for concurrent conversions
+
+	// serve and bench-serve
+	std::string socket;		// Unix socket path, /tmp/mloader-<file>.sock by default
+	int clients = 4;
+	int requests = 2000;		// per client
+
+	// bench-cache (and serve)
+	int cache_mb = 1024;
+	int prefetch_depth = 1;		// planes either side in Z and T, 0 for none
+	int prefetch_threads = 2;
+	int sweeps = 4;
+
+	// bench-writer and bench-numa
+	int bench_planes = 512;
+	int bench_width = 2048;
+	int bench_height = 2048;
+};
+
+inline std::string Usage()
+{
+	return
+		"usage: mloader [options] <file.sld>\n"
+		"       mloader watch <directory>... --output <dir> [options]\n"
+		"       mloader consume <ring>\n"
+		"       mloader serve <file.sld> [--socket <path>] [options]\n"
+		"       mloader bench-serve <socket> [options]\n"
+		"       mloader bench-cache <file.sld> [options]\n"
+		"       mloader bench-writer <directory> [options]\n"
+		"       mloader bench-numa [options]\n"
+		"       mloader verify <file.sld> [--output <dir>] [options]\n"
+		"options:\n"
+		"  --output <dir>          write one stack per capture and position into dir\n"
+		"  --format <name>         raw, or npy with a JSON metadata sidecar (default raw)\n"
+		"  --resume                journal finished stacks in the output directory and skip\n"
+		"                          those a previous run verifiably completed\n"
+		"  --aux                   export each capture's auxiliary data channels (stage\n"
+		"                          temperature, laser power ...) to <file>_<capture>_aux\n"
+		"  --stream <ring>         publish planes to a shared memory ring (see consume)\n"
+		"  --stream-slots <n>      planes the ring holds (default 16)\n"
+		"  --stream-consumers <n>  consumers to wait for before streaming (default 1)\n"
+		"  --manifest <file>       list an XXH64 digest per plane and flag duplicate planes\n"
+		"  --mosaic                stitch the positions of a capture into one Zarr mosaic,\n"
+		"                          <file>_<capture>_mosaic.zarr, written chunk by chunk\n"
+		"  --mosaic-placement <p>  stage, grid (montage row and column) or auto (default)\n"
+		"  --mosaic-overlap <pct>  grid: percent of a tile neighbours share (default 10)\n"
+		"  --mosaic-blend <mode>   linear, or none for later tiles on top (default linear)\n"
+		"  --mosaic-chunk <px>     mosaic chunk width and height (default 1024)\n"
+		"  --order <axes>          output axis order: a permutation of TCZYX, zarr or imagej\n"
+		"  --dark <channel>=<file> dark frame for the named channel (.npy or raw UInt16)\n"
+		"  --flat <channel>=<file> flat field for the named channel (.npy or raw UInt16)\n"
+		"  --bin <n>               bin XY by 2, 3 or 4\n"
+		"  --bin-mode <mode>       mean or sum (saturating) of each bin (default mean)\n"
+		"  --background <radius>   subtract the background with a tophat of this radius\n"
+		"  --transform-threads <n> threads running plane stages (default: all cores)\n"
+		"  --capture-jobs <n>      captures converted at once, packed into --pool-mb by the\n"
+		"                          size of a time point, at most --readers - 1 (default 1)\n"
+		"  --read-ahead <n>        read n planes ahead on background threads (default 0)\n"
+		"  --read-threads <n|auto> threads reading ahead (default 2); auto reads ahead and\n"
+		"                          tunes the count to the throughput seen, up to --readers - 1\n"
+		"  --readers <n>           readers kept open per file, at least 2 (default 8)\n"
+		"  --reader-ttl <s>        close readers idle this long (default 60)\n"
+		"  --read-direction <dir>  z, t or auto: scan Z or T fastest where the output allows\n"
+		"                          (default auto, fewest seeks)\n"
+		"  --numa <node>           read, transform and write on one NUMA node, with the plane\n"
+		"                          buffers there; auto spreads conversions, and captures\n"
+		"                          converted at once (--capture-jobs), over the nodes\n"
+		"                          (default off)\n"
+		"  --8bit                  convert to 8 bit with a per channel contrast stretch\n"
+		"  --contrast <lo>,<hi>    percentiles mapped to 0 and 255 (default 0.1,99.9)\n"
+		"  --contrast-samples <n>  planes sampled per channel for the histogram (default 16)\n"
+		"  --writer <name>         sync, threads, uring or auto (default auto)\n"
+		"  --writer-threads <n>    threads for the threaded writer (default 4)\n"
+		"  --queue-depth <n>       io_uring submission queue depth (default 64)\n"
+		"  --direct                write with O_DIRECT, bypassing the page cache\n"
+		"  --pool-mb <n>           memory for planes in flight (default 256)\n"
+		"  --existing              watch: also convert files already present\n"
+		"  --settle <seconds>      watch: quiet time before a file is converted (default 30)\n"
+		"  --jobs <n>              watch: concurrent conversions (default 2)\n"
+		"  --memory-mb <n>         watch: memory budget, --pool-mb per conversion (default 4096)\n"
+		"  --socket <path>         serve: Unix socket to listen on (default /tmp/mloader-<file>.sock)\n"
+		"  --clients <n>           bench-serve: concurrent client connections (default 4)\n"
+		"  --requests <n>          bench-serve: requests per client and kind (default 2000)\n"
+		"  --cache-mb <n>          serve, bench-cache: plane cache size; serve keeps half of it\n"
+		"                          as the memfds whole planes were sent in (default 1024)\n"
+		"  --prefetch <n>          serve, bench-cache: planes prefetched either side in Z and T (default 1)\n"
+		"  --prefetch-threads <n>  serve, bench-cache: prefetch threads, 0 for none (default 2)\n"
+		"  --sweeps <n>            bench-cache: Z sweeps per time point (default 4)\n"
+		"  --planes <n>            bench-writer, bench-numa plane count (default 512)\n"
+		"  --width <n>             bench-writer, bench-numa plane width (default 2048)\n"
+		"  --height <n>            bench-writer, bench-numa plane height (default 2048)\n";
+}
+
+inline ConvertOptions ParseOptions(int argc, char ** argv)
+{
+	ConvertOptions options;
+	std::vector<std::string> positional;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto value = [&]() -> std::string
+		{
+			if (i + 1 >= argc)
+			{
+				throw std::runtime_error(fmt::format("{} requires a value", arg));
+			}
+			return argv[++i];
+		};
+		auto int_value = [&]() -> int
+		{
+			std::string v = value();
+			try
+			{
+				return std::stoi(v);
+			}
+			catch (const std::exception &)
+			{
+				throw std::runtime_error(fmt::format("{} expects an integer, got {}", arg, v));
+			}
+		};
+		// sizes, counts and depths, where zero or less means nothing sensible
+		auto positive_value = [&]() -> int
+		{
+			int v = int_value();
+			if (v <= 0)
+			{
+				throw std::runtime_error(fmt::format("{} expects a positive integer, got {}", arg, v));
+			}
+			return v;
+		};
+
+		if (arg == "--output")
+		{
+			options.output_dir = value();
+		}
+		else if (arg == "--format")
+		{
+			options.format = value();
+		}
+		else if (arg == "--stream")
+		{
+			options.stream = value();
+		}
+		else if (arg == "--stream-slots")
+		{
+			options.stream_slots = std::max(1, int_value());
+		}
+		else if (arg == "--stream-consumers")
+		{
+			options.stream_consumers = std::max(0, int_value());
+		}
+		else if (arg == "--aux")
+		{
+			options.aux = true;
+		}
+		else if (arg == "--resume")
+		{
+			options.resume = true;
+		}
+		else if (arg == "--mosaic")
+		{
+			options.mosaic = true;
+		}
+		else if (arg == "--mosaic-placement")
+		{
+			std::string v = value();
+			if (v != "stage" && v != "grid" && v != "auto")
+			{
+				throw std::runtime_error(fmt::format("--mosaic-placement expects stage, grid or auto, got {}", v));
+			}
+			options.mosaic_placement = v;
+		}
+		else if (arg == "--mosaic-overlap")
+		{
+			options.mosaic_overlap = std::min(90, std::max(0, int_value())) / 100.0;
+		}
+		else if (arg == "--mosaic-blend")
+		{
+			std::string v = value();
+			if (v != "linear" && v != "none")
+			{
+				throw std::runtime_error(fmt::format("--mosaic-blend expects linear or none, got {}", v));
+			}
+			options.mosaic_blend = v == "linear";
+		}
+		else if (arg == "--mosaic-chunk")
+		{
+			options.mosaic_chunk = std::max(16, int_value());
+		}
+		else if (arg == "--manifest")
+		{
+			options.manifest = value();
+		}
+		else if (arg == "--order")
+		{
+			options.order = DimensionOrder::Parse(value());
+		}
+		else if (arg == "--dark" || arg == "--flat")
+		{
+			std::string v = value();
+			auto equals = v.find('=');
+			if (equals == std::string::npos || equals == 0)
+			{
+				throw std::runtime_error(fmt::format("{} expects <channel>=<file>, got {}", arg, v));
+			}
+			(arg == "--dark" ? options.dark_frames : options.flat_fields)[v.substr(0, equals)] = v.substr(equals + 1);
+		}
+		else if (arg == "--bin")
+		{
+			options.bin = int_value();
+		}
+		else if (arg == "--bin-mode")
+		{
+			std::string v = value();
+			if (v != "mean" && v != "sum")
+			{
+				throw std::runtime_error(fmt::format("--bin-mode expects mean or sum, got {}", v));
+			}
+			options.bin_mean = v == "mean";
+		}
+		else if (arg == "--background")
+		{
+			options.background_radius = int_value();
+		}
+		else if (arg == "--transform-threads")
+		{
+			options.transform_threads = std::max(1, int_value());
+		}
+		else if (arg == "--capture-jobs")
+		{
+			options.capture_jobs = std::max(1, int_value());
+		}
+		else if (arg == "--read-ahead")
+		{
+			options.read_ahead = std::max(0, int_value());
+		}
+		else if (arg == "--read-threads")
+		{
+			if (i + 1 < argc && std::string(argv[i + 1]) == "auto")
+			{
+				options.read_tune = value() == "auto";
+			}
+			else
+			{
+				options.read_threads = std::max(1, int_value());
+				options.read_tune = false;
+			}
+		}
+		else if (arg == "--readers")
+		{
+			// the conversion holds one while the read-ahead threads lease others
+			options.readers = std::max(2, int_value());
+		}
+		else if (arg == "--reader-ttl")
+		{
+			options.reader_ttl = std::max(0, int_value());
+		}
+		else if (arg == "--numa")
+		{
+			std::string v = value();
+			if (v != "off" && v != "auto" && v.find_first_not_of("0123456789") != std::string::npos)
+			{
+				throw std::runtime_error(fmt::format("--numa expects off, auto or a node number, got {}", v));
+			}
+			options.numa = v;
+		}
+		else if (arg == "--read-direction")
+		{
+			std::string v = value();
+			std::transform(v.begin(), v.end(), v.begin(), ::tolower);
+			if (v != "z" && v != "t" && v != "auto")
+			{
+				throw std::runtime_error(fmt::format("--read-direction expects z, t or auto, got {}", v));
+			}
+			options.read_direction = v;
+		}
+		else if (arg == "--8bit")
+		{
+			options.to_8bit = true;
+		}
+		else if (arg == "--contrast")
+		{
+			std::string v = value();
+			if (sscanf(v.c_str(), "%lf,%lf", &options.contrast_low, &options.contrast_high) != 2
+				|| options.contrast_low < 0 || options.contrast_high > 100 || options.contrast_low >= options.contrast_high)
+			{
+				throw std::runtime_error(fmt::format("--contrast expects <low>,<high> percentiles, got {}", v));
+			}
+		}
+		else if (arg == "--contrast-samples")
+		{
+			options.contrast_samples = int_value();
+		}
+		else if (arg == "--writer")
+		{
+			options.writer.backend = value();
+		}
+		else if (arg == "--writer-threads")
+		{
+			options.writer.threads = positive_value();
+		}
+		else if (arg == "--queue-depth")
+		{
+			options.writer.queue_depth = positive_value();
+		}
+		else if (arg == "--direct")
+		{
+			options.direct = true;
+		}
+		else if (arg == "--pool-mb")
+		{
+			options.pool_mb = positive_value();
+		}
+		else if (arg == "--existing")
+		{
+			options.watch_existing = true;
+		}
+		else if (arg == "--settle")
+		{
+			options.settle_seconds = int_value();
+		}
+		else if (arg == "--jobs")
+		{
+			options.jobs = positive_value();
+		}
+		else if (arg == "--memory-mb")
+		{
+			options.memory_mb = positive_value();
+		}
+		else if (arg == "--cache-mb")
+		{
+			options.cache_mb = positive_value();
+		}
+		else if (arg == "--prefetch")
+		{
+			options.prefetch_depth = int_value();
+		}
+		else if (arg == "--prefetch-threads")
+		{
+			options.prefetch_threads = int_value();
+		}
+		else if (arg == "--socket")
+		{
+			options.socket = value();
+		}
+		else if (arg == "--clients")
+		{
+			options.clients = std::max(1, int_value());
+		}
+		else if (arg == "--requests")
+		{
+			options.requests = std::max(1, int_value());
+		}
+		else if (arg == "--sweeps")
+		{
+			options.sweeps = int_value();
+		}
+		else if (arg == "--planes")
+		{
+			options.bench_planes = int_value();
+		}
+		else if (arg == "--width")
+		{
+			options.bench_width = int_value();
+		}
+		else if (arg == "--height")
+		{
+			options.bench_height = int_value();
+		}
+		else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+		{
+			throw std::runtime_error(fmt::format("unknown option {}", arg));
+		}
+		else
+		{
+			positional.push_back(arg);
+		}
+	}
+
+	if (!positional.empty() && (positional[0] == "bench-writer" || positional[0] == "bench-cache" || positional[0] == "watch"
+		|| positional[0] == "serve" || positional[0] == "bench-serve" || positional[0] == "consume" || positional[0] == "bench-numa"
+		|| positional[0] == "verify"))
+	{
+		options.command = positional[0];
+		positional.erase(positional.begin());
+	}
+	if (options.command == "watch")
+	{
+		if (positional.empty() || options.output_dir.empty())
+		{
+			throw std::runtime_error("watch requires directories and --output");
+		}
+		options.watch_dirs = positional;
+		return options;
+	}
+	if (options.command == "bench-numa")
+	{
+		return options;
+	}
+	if (positional.size() != 1)
+	{
+		throw std::runtime_error(options.command == "bench-writer" ? "directory required"
+			: (options.command == "bench-serve" ? "socket required"
+			: (options.command == "consume" ? "ring name required" : "filename requried")));
+	}
+	options.filename = positional[0];
+	if (options.resume && options.output_dir.empty())
+	{
+		throw std::runtime_error("--resume requires --output");
+	}
+	if (options.aux && options.output_dir.empty())
+	{
+		throw std::runtime_error("--aux requires --output");
+	}
+	if (options.mosaic && (options.output_dir.empty() || options.resume || !options.stream.empty() || !options.manifest.empty()))
+	{
+		throw std::runtime_error("--mosaic requires --output and works without --resume, --stream and --manifest");
+	}
+	return options;
+}
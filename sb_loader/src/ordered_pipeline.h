@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "thread_pool.h"
+
+namespace util
+{
+	// Runs work items on a thread pool and their finish steps one at a time in
+	// submission order, so the submitter never waits on the work while the
+	// finish steps still see items in order. With no threads both steps run
+	// inline in Submit.
+	//
+	// The first exception thrown by either step is rethrown by the next Submit
+	// or Wait; finish steps of later items are skipped from then on.
+	class OrderedPipeline
+	{
+	public:
+		explicit OrderedPipeline(int thread_count)
+		{
+			if (thread_count > 0)
+			{
+				pool.reset(new ThreadPool(thread_count));
+			}
+		}
+
+		~OrderedPipeline()
+		{
+			if (pool)
+			{
+				pool->Wait();
+			}
+		}
+
+		int Threads() const
+		{
+			return pool ? pool->Size() : 0;
+		}
+
+		void Submit(std::function<void()> work, std::function<void()> finish)
+		{
+			ThrowIfFailed();
+			if (!pool)
+			{
+				work();
+				finish();
+				return;
+			}
+			std::uint64_t sequence = submitted++;
+			auto item = std::make_shared<std::pair<std::function<void()>, std::function<void()>>>(std::move(work), std::move(finish));
+			pool->Post([this, sequence, item]
+			{
+				Run(item->first);
+				item->first = nullptr;
+
+				std::unique_lock<std::mutex> lock(mutex);
+				ready[sequence] = std::move(item->second);
+				if (draining)
+				{
+					return;
+				}
+				// this thread finishes every item that is next in line,
+				// including ones other threads complete meanwhile
+				draining = true;
+				while (!ready.empty() && ready.begin()->first == next)
+				{
+					auto finish = std::move(ready.begin()->second);
+					ready.erase(ready.begin());
+					next++;
+					bool skip = (bool)error;
+					lock.unlock();
+					if (!skip)
+					{
+						Run(finish);
+					}
+					finish = nullptr;
+					lock.lock();
+				}
+				draining = false;
+			});
+		}
+
+		// Blocks until every submitted item has finished.
+		void Wait()
+		{
+			if (pool)
+			{
+				pool->Wait();
+			}
+			ThrowIfFailed();
+		}
+
+	private:
+		void Run(const std::function<void()> & step)
+		{
+			try
+			{
+				step();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+				{
+					error = std::current_exception();
+				}
+			}
+		}
+
+		void ThrowIfFailed()
+		{
+			std::exception_ptr failure;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				failure = error;
+			}
+			if (failure)
+			{
+				std::rethrow_exception(failure);
+			}
+		}
+
+		std::unique_ptr<ThreadPool> pool;
+		std::mutex mutex;
+		std::map<std::uint64_t, std::function<void()>> ready;
+		std::uint64_t submitted = 0;
+		std::uint64_t next = 0;
+		bool draining = false;
+		std::exception_ptr error;
+	};
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+#include "plane_pool.h"
+
+#ifdef _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+	#include <sys/stat.h>
+#else
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// Offsets, lengths and buffer addresses of O_DIRECT writes are multiples of this.
+const std::size_t kDirectIoAlignment = 4096;
+
+// Output file opened for positional writes. Several writer threads may
+// write disjoint ranges of the same file concurrently.
+//
+// With direct set the file bypasses the page cache (O_DIRECT). Filesystems
+// that refuse O_DIRECT at open or on a probe write are reopened buffered;
+// check IsDirect() for the mode actually in use.
+//
+// With keep set an existing file is written into rather than truncated.
+// Such files are always buffered, as the O_DIRECT probe clobbers the first
+// block.
+class OutputFile
+{
+public:
+	explicit OutputFile(const std::string & path, bool direct = false, bool keep = false)
+		: path(path)
+	{
+		if (keep)
+		{
+			direct = false;
+		}
+#if !defined(O_DIRECT)
+		if (direct)
+		{
+			fmt::print("direct output is not supported on this platform, using buffered writes\n");
+		}
+#endif
+#ifdef _WIN32
+		fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | (keep ? 0 : _O_TRUNC) | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+#ifdef O_DIRECT
+		if (direct)
+		{
+			fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+			if (fd >= 0 && ProbeDirect())
+			{
+				this->direct = true;
+				return;
+			}
+			fmt::print("{} refused O_DIRECT, using buffered writes\n", path);
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+#endif
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+#endif
+		if (fd < 0)
+		{
+			throw std::runtime_error(fmt::format("unable to open {} for writing: {}", path, strerror(errno)));
+		}
+	}
+
+	~OutputFile()
+	{
+		if (fd >= 0)
+		{
+#ifdef _WIN32
+			_close(fd);
+#else
+			close(fd);
+#endif
+		}
+	}
+
+	OutputFile(const OutputFile &) = delete;
+	OutputFile & operator=(const OutputFile &) = delete;
+
+	// Writes all of [data, data + bytes) at offset. Returns 0 or an errno value.
+	int WriteAt(const void * data, std::size_t bytes, UInt64 offset)
+	{
+		const char * p = (const char *)data;
+		while (bytes > 0)
+		{
+#ifdef _WIN32
+			std::lock_guard<std::mutex> lock(seek_mutex);
+			if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+			{
+				return errno;
+			}
+			auto written = _write(fd, p, (unsigned int)std::min<std::size_t>(bytes, 1 << 30));
+#else
+			auto written = pwrite(fd, p, bytes, (off_t)offset);
+#endif
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return errno;
+			}
+			p += written;
+			bytes -= written;
+			offset += written;
+		}
+		return 0;
+	}
+
+	// Sets the file length, dropping the padding of a final direct block.
+	void Truncate(UInt64 length)
+	{
+#ifdef _WIN32
+		_chsize_s(fd, (__int64)length);
+#else
+		if (ftruncate(fd, (off_t)length) != 0)
+		{
+			throw std::runtime_error(fmt::format("unable to truncate {}: {}", path, strerror(errno)));
+		}
+#endif
+	}
+
+	void Sync()
+	{
+#ifdef _WIN32
+		_commit(fd);
+#else
+		fsync(fd);
+#endif
+	}
+
+	int Handle() const
+	{
+		return fd;
+	}
+
+	const std::string & Path() const
+	{
+		return path;
+	}
+
+	bool IsDirect() const
+	{
+		return direct;
+	}
+
+private:
+#ifdef O_DIRECT
+	// Some filesystems accept O_DIRECT at open and fail the first write.
+	bool ProbeDirect()
+	{
+		void * block = util::AlignedAlloc(kDirectIoAlignment, kDirectIoAlignment);
+		memset(block, 0, kDirectIoAlignment);
+		bool ok = pwrite(fd, block, kDirectIoAlignment, 0) == (ssize_t)kDirectIoAlignment
+			&& ftruncate(fd, 0) == 0;
+		util::AlignedFree(block);
+		return ok;
+	}
+#endif
+
+	std::string path;
+	int fd = -1;
+	bool direct = false;
+#ifdef _WIN32
+	std::mutex seek_mutex;
+#endif
+};
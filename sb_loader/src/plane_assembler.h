@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include "dimension_order.h"
+#include "stack_output.h"
+
+// Turns planes in a DimensionPlan's read sequence into output writes: planes
+// laid out contiguously are written as they are, others are interleaved or
+// placed into blocks taken from block_pool, and each block is written once
+// all of its planes are in. Planes must arrive in the plan's read sequence.
+class PlaneAssembler
+{
+public:
+	PlaneAssembler(const DimensionPlan & plan, StackOutput & output, PlanePool & block_pool)
+		: plan(plan)
+		, output(output)
+		, block_pool(block_pool)
+	{
+	}
+
+	// Where to read the raw plane p when the plan ReadsIntoBlock(), with
+	// RowStrideBytes() between rows; call Added(p) once it is read.
+	UInt8 * ReadTarget(const PlaneCoord & p)
+	{
+		return Block() + plan.PlaneOffsetInBlock(p);
+	}
+
+	void Add(PlaneBuffer && plane, const PlaneCoord & p)
+	{
+		if (plan.PlanesWrittenDirectly())
+		{
+			output.Write(std::move(plane), plan.BlockOffset(p), plan.PlaneBytes());
+			return;
+		}
+		if (plan.InterleavesChannels())
+		{
+			// channels are read innermost; pack them once all are in
+			channel_planes.push_back(std::move(plane));
+			if (channel_planes.size() == plan.BlockPlanes())
+			{
+				std::vector<const void *> planes;
+				for (auto & channel : channel_planes)
+				{
+					planes.push_back(channel.data);
+				}
+				block = block_pool.Acquire();
+				plan.Interleave(planes.data(), block.data);
+				channel_planes.clear();
+			}
+		}
+		else
+		{
+			plan.Place(plane.data, Block(), p);
+		}
+		Added(p);
+	}
+
+	void Added(const PlaneCoord & p)
+	{
+		if (++placed == plan.BlockPlanes())
+		{
+			output.Write(std::move(block), plan.BlockOffset(p), plan.BlockBytes());
+			placed = 0;
+		}
+	}
+
+private:
+	UInt8 * Block()
+	{
+		if (!block)
+		{
+			block = block_pool.Acquire();
+		}
+		return block.data;
+	}
+
+	const DimensionPlan & plan;
+	StackOutput & output;
+	PlanePool & block_pool;
+	PlaneBuffer block;
+	std::vector<PlaneBuffer> channel_planes;
+	std::size_t placed = 0;
+};
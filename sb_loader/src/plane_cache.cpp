@@ -0,0 +1,48 @@
+#include <chrono>
+#include "fmt/format.h"
+#include "plane_cache.h"
+
+void BenchmarkPlaneCache(PlaneSource & source, std::size_t capacity_bytes, int prefetch_threads, int prefetch_depth, int sweeps)
+{
+	// z forward and back, sweeps times, at every time point
+	std::vector<PlaneKey> pattern;
+	std::size_t largest = 0;
+	for (int capture = 0; capture < source.Captures(); capture++)
+	{
+		const CaptureExtent & extent = source.Extent(capture);
+		largest = std::max(largest, extent.PlaneBytes());
+		for (int t = 0; t < extent.timepoints; t++)
+		{
+			for (int sweep = 0; sweep < sweeps; sweep++)
+			{
+				for (int i = 0; i < 2 * extent.z; i++)
+				{
+					int z = i < extent.z ? i : 2 * extent.z - 1 - i;
+					pattern.push_back(PlaneKey{ capture, 0, t, z, 0 });
+				}
+			}
+		}
+	}
+	fmt::print("scrubbing {} plane reads over {} captures, {} sweeps per time point\n", pattern.size(), source.Captures(), sweeps);
+	std::vector<UInt16> buffer(largest / sizeof(UInt16));
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto & key : pattern)
+	{
+		source.Read(key, buffer.data());
+	}
+	double direct_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fmt::print("{:>24}: {:10.1f} planes/s\n", "uncached", pattern.size() / direct_seconds);
+
+	PlaneCache cache(source, capacity_bytes, 8, prefetch_threads, prefetch_depth);
+	start = std::chrono::steady_clock::now();
+	for (auto & key : pattern)
+	{
+		cache.Read(key, buffer.data());
+	}
+	double cached_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	auto stats = cache.GetStats();
+	fmt::print("{:>24}: {:10.1f} planes/s, {} hits, {} waited on a read, {} misses, {} prefetched, {} evictions, {:.1f} MiB held\n",
+		fmt::format("cached{}", prefetch_threads > 0 ? " with prefetch" : ""), pattern.size() / cached_seconds,
+		stats.hits, stats.waited, stats.misses, stats.prefetched, stats.evictions, stats.bytes / (double)(1 << 20));
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "plane_source.h"
+#include "thread_pool.h"
+
+// Byte bounded LRU cache of raw planes in front of a PlaneSource.
+//
+// Keys are spread over shards, each with its own lock, LRU list and share
+// of the capacity, so concurrent readers rarely contend. A plane being read
+// is tracked too: other threads asking for it wait for that read instead of
+// decoding it again.
+//
+// With prefetch threads, each Read also queues the prefetch_depth planes
+// either side in Z and in T (same position and channel) that are not
+// already cached, which is what scrubbing through a stack asks for next.
+class PlaneCache
+{
+public:
+	using Plane = std::shared_ptr<const std::vector<UInt16>>;
+
+	// A demand read that waits for a read already in flight counts as
+	// waited, neither a hit nor a miss.
+	struct Stats
+	{
+		UInt64 hits;
+		UInt64 waited;
+		UInt64 misses;
+		UInt64 prefetched;
+		UInt64 evictions;
+		std::size_t bytes;
+	};
+
+	PlaneCache(PlaneSource & source, std::size_t capacity_bytes, int shard_count = 8,
+		int prefetch_threads = 0, int prefetch_depth = 1)
+		: source(source)
+		, shards(std::max(1, shard_count))
+		, shard_capacity(capacity_bytes / shards.size())
+		, prefetch_depth(prefetch_depth)
+	{
+		if (prefetch_threads > 0 && prefetch_depth > 0)
+		{
+			prefetcher.reset(new util::ThreadPool(prefetch_threads));
+			prefetch_limit = prefetch_threads * 4;
+		}
+	}
+
+	~PlaneCache()
+	{
+		// queued prefetches still reference the shards
+		prefetcher.reset();
+	}
+
+	PlaneCache(const PlaneCache &) = delete;
+	PlaneCache & operator=(const PlaneCache &) = delete;
+
+	// Copies the plane into buffer.
+	void Read(const PlaneKey & key, UInt16 * buffer)
+	{
+		Plane plane = Get(key);
+		std::memcpy(buffer, plane->data(), plane->size() * sizeof(UInt16));
+	}
+
+	// The cached plane, read from the source on a miss. The plane stays
+	// valid for as long as it is held, even once evicted.
+	Plane Get(const PlaneKey & key)
+	{
+		Plane plane = Fetch(key, true);
+		if (prefetcher)
+		{
+			Prefetch(key);
+		}
+		return plane;
+	}
+
+	Stats GetStats()
+	{
+		Stats stats = { hits, waited, misses, prefetched, evictions, 0 };
+		for (auto & shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			stats.bytes += shard.bytes;
+		}
+		return stats;
+	}
+
+	void Clear()
+	{
+		for (auto & shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.entries.clear();
+			shard.lru.clear();
+			shard.bytes = 0;
+		}
+	}
+
+private:
+	struct Shard
+	{
+		std::mutex mutex;
+		// most recently used first
+		std::list<std::pair<PlaneKey, Plane>> lru;
+		std::unordered_map<PlaneKey, std::list<std::pair<PlaneKey, Plane>>::iterator, PlaneKeyHash> entries;
+		std::unordered_map<PlaneKey, std::shared_future<Plane>, PlaneKeyHash> loading;
+		std::size_t bytes = 0;
+	};
+
+	Shard & ShardOf(const PlaneKey & key)
+	{
+		return shards[PlaneKeyHash()(key) % shards.size()];
+	}
+
+	Plane Fetch(const PlaneKey & key, bool demand)
+	{
+		Shard & shard = ShardOf(key);
+		std::unique_lock<std::mutex> lock(shard.mutex);
+		auto entry = shard.entries.find(key);
+		if (entry != shard.entries.end())
+		{
+			shard.lru.splice(shard.lru.begin(), shard.lru, entry->second);
+			hits += demand ? 1 : 0;
+			return entry->second->second;
+		}
+		auto loading = shard.loading.find(key);
+		if (loading != shard.loading.end())
+		{
+			// another thread, perhaps a prefetch, is reading it already
+			std::shared_future<Plane> pending = loading->second;
+			lock.unlock();
+			waited += demand ? 1 : 0;
+			return pending.get();
+		}
+
+		(demand ? misses : prefetched)++;
+		std::promise<Plane> promise;
+		shard.loading[key] = promise.get_future().share();
+		lock.unlock();
+
+		std::shared_ptr<std::vector<UInt16>> plane;
+		try
+		{
+			plane = std::make_shared<std::vector<UInt16>>(source.Extent(key.capture).PlaneBytes() / sizeof(UInt16));
+			source.Read(key, plane->data());
+		}
+		catch (...)
+		{
+			lock.lock();
+			shard.loading.erase(key);
+			lock.unlock();
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+
+		lock.lock();
+		shard.loading.erase(key);
+		Insert(shard, key, plane);
+		lock.unlock();
+		promise.set_value(plane);
+		return plane;
+	}
+
+	// Called with the shard locked.
+	void Insert(Shard & shard, const PlaneKey & key, const Plane & plane)
+	{
+		std::size_t bytes = plane->size() * sizeof(UInt16);
+		if (bytes > shard_capacity)
+		{
+			return;
+		}
+		shard.lru.emplace_front(key, plane);
+		shard.entries[key] = shard.lru.begin();
+		shard.bytes += bytes;
+		while (shard.bytes > shard_capacity)
+		{
+			auto & oldest = shard.lru.back();
+			shard.bytes -= oldest.second->size() * sizeof(UInt16);
+			shard.entries.erase(oldest.first);
+			shard.lru.pop_back();
+			evictions++;
+		}
+	}
+
+	bool Contains(const PlaneKey & key)
+	{
+		Shard & shard = ShardOf(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		return shard.entries.count(key) || shard.loading.count(key);
+	}
+
+	void Prefetch(const PlaneKey & key)
+	{
+		const CaptureExtent & extent = source.Extent(key.capture);
+		for (int d = 1; d <= prefetch_depth; d++)
+		{
+			for (int sign : { 1, -1 })
+			{
+				PlaneKey z = key;
+				z.z += sign * d;
+				PlaneKey t = key;
+				t.t += sign * d;
+				for (const PlaneKey & next : { z, t })
+				{
+					if (next.z < 0 || next.z >= extent.z || next.t < 0 || next.t >= extent.timepoints
+						|| Contains(next))
+					{
+						continue;
+					}
+					// drop prefetches rather than queue behind a fast scrub
+					if (prefetch_queued.fetch_add(1) >= prefetch_limit)
+					{
+						prefetch_queued--;
+						return;
+					}
+					prefetcher->Post([this, next]
+					{
+						try
+						{
+							Fetch(next, false);
+						}
+						catch (...)
+						{
+							// reads waiting on it get the error; later reads
+							// of the plane try the source again
+						}
+						prefetch_queued--;
+					});
+				}
+			}
+		}
+	}
+
+	PlaneSource & source;
+	std::vector<Shard> shards;
+	std::size_t shard_capacity;
+	int prefetch_depth;
+	int prefetch_limit = 0;
+	std::atomic<int> prefetch_queued{ 0 };
+	std::atomic<UInt64> hits{ 0 };
+	std::atomic<UInt64> waited{ 0 };
+	std::atomic<UInt64> misses{ 0 };
+	std::atomic<UInt64> prefetched{ 0 };
+	std::atomic<UInt64> evictions{ 0 };
+	std::unique_ptr<util::ThreadPool> prefetcher;
+};
+
+// Scrubs back and forth through Z at every time point of the first
+// position and channel of each capture, as an interactive viewer would,
+// once straight from the source and once through a PlaneCache, and prints
+// the plane rates and cache statistics.
+void BenchmarkPlaneCache(PlaneSource & source, std::size_t capacity_bytes, int prefetch_threads, int prefetch_depth, int sweeps);
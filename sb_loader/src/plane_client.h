@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "plane_protocol.h"
+
+#ifdef __linux__
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+// Pixels handed over by the plane server, mapped read only. The mapping is
+// private to the holder and stays valid until it is destroyed, whatever the
+// server does meanwhile.
+class SharedPlane
+{
+public:
+	SharedPlane() {}
+	SharedPlane(int fd, int width, int height, std::size_t bytes)
+		: width(width)
+		, height(height)
+		, bytes(bytes)
+	{
+		if (bytes > 0)
+		{
+			void * mapped = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapped == MAP_FAILED)
+			{
+				throw std::runtime_error(fmt::format("unable to map plane: {}", strerror(errno)));
+			}
+			data = (const UInt16 *)mapped;
+		}
+	}
+
+	SharedPlane(SharedPlane && other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	SharedPlane & operator=(SharedPlane && other) noexcept
+	{
+		if (this != &other)
+		{
+			Reset();
+			data = other.data;
+			width = other.width;
+			height = other.height;
+			bytes = other.bytes;
+			other.data = nullptr;
+			other.bytes = 0;
+		}
+		return *this;
+	}
+
+	~SharedPlane()
+	{
+		Reset();
+	}
+
+	SharedPlane(const SharedPlane &) = delete;
+	SharedPlane & operator=(const SharedPlane &) = delete;
+
+	const UInt16 * Data() const
+	{
+		return data;
+	}
+
+	int Width() const
+	{
+		return width;
+	}
+
+	int Height() const
+	{
+		return height;
+	}
+
+	std::size_t Bytes() const
+	{
+		return bytes;
+	}
+
+private:
+	void Reset()
+	{
+		if (data != nullptr)
+		{
+			munmap((void *)data, bytes);
+		}
+		data = nullptr;
+	}
+
+	const UInt16 * data = nullptr;
+	int width = 0;
+	int height = 0;
+	std::size_t bytes = 0;
+};
+
+// Client of an mloader serve socket. Requests on one client are answered
+// in turn; use a client per thread for parallel requests.
+class PlaneClient
+{
+public:
+	explicit PlaneClient(const std::string & socket_path)
+	{
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (socket_path.size() >= sizeof(address.sun_path))
+		{
+			throw std::runtime_error(fmt::format("socket path too long: {}", socket_path));
+		}
+		std::strcpy(address.sun_path, socket_path.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || connect(fd, (const sockaddr *)&address, sizeof(address)) != 0)
+		{
+			std::string error = strerror(errno);
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			throw std::runtime_error(fmt::format("unable to connect to {}: {}", socket_path, error));
+		}
+	}
+
+	~PlaneClient()
+	{
+		close(fd);
+	}
+
+	PlaneClient(const PlaneClient &) = delete;
+	PlaneClient & operator=(const PlaneClient &) = delete;
+
+	std::vector<PlaneCaptureInfo> Info()
+	{
+		PlaneRequest request = MakeRequest(kPlaneOpInfo, 0, 0, 0, 0, 0);
+		std::string payload = Inline(request);
+		UInt32 count = 0;
+		if (payload.size() >= sizeof(count))
+		{
+			std::memcpy(&count, payload.data(), sizeof(count));
+		}
+		if (payload.size() != sizeof(count) + count * sizeof(PlaneCaptureInfo))
+		{
+			throw std::runtime_error("malformed capture info from plane server");
+		}
+		std::vector<PlaneCaptureInfo> captures(count);
+		std::memcpy(captures.data(), payload.data() + sizeof(count), count * sizeof(PlaneCaptureInfo));
+		return captures;
+	}
+
+	// The capture's metadata as a JSON object, as in the conversion sidecar.
+	std::string Metadata(int capture)
+	{
+		return Inline(MakeRequest(kPlaneOpMetadata, capture, 0, 0, 0, 0));
+	}
+
+	SharedPlane Read(int capture, int position, int t, int z, int c)
+	{
+		return Shared(MakeRequest(kPlaneOpPlane, capture, position, t, z, c));
+	}
+
+	// The width x height pixels of a plane starting at column x, row y.
+	SharedPlane ReadRoi(int capture, int position, int t, int z, int c, int x, int y, int width, int height)
+	{
+		PlaneRequest request = MakeRequest(kPlaneOpRoi, capture, position, t, z, c);
+		request.x = x;
+		request.y = y;
+		request.width = width;
+		request.height = height;
+		return Shared(request);
+	}
+
+private:
+	static PlaneRequest MakeRequest(PlaneOp op, int capture, int position, int t, int z, int c)
+	{
+		PlaneRequest request = {};
+		request.magic = kPlaneProtocolMagic;
+		request.op = op;
+		request.capture = capture;
+		request.position = position;
+		request.t = t;
+		request.z = z;
+		request.c = c;
+		return request;
+	}
+
+	// Sends the request and receives the response header, any descriptor
+	// and the inline payload.
+	PlaneResponse Exchange(const PlaneRequest & request, int & shared, std::string & payload)
+	{
+		detail::SendAll(fd, &request, sizeof(request));
+		PlaneResponse response;
+		detail::ReceiveWithFd(fd, &response, sizeof(response), shared);
+		if (shared < 0)
+		{
+			payload.resize(response.bytes);
+			if (!payload.empty())
+			{
+				detail::ReceiveAll(fd, &payload[0], payload.size());
+			}
+		}
+		if (response.status != 0)
+		{
+			if (shared >= 0)
+			{
+				close(shared);
+			}
+			throw std::runtime_error(fmt::format("plane server: {}", payload));
+		}
+		return response;
+	}
+
+	std::string Inline(const PlaneRequest & request)
+	{
+		int shared;
+		std::string payload;
+		Exchange(request, shared, payload);
+		if (shared >= 0)
+		{
+			close(shared);
+		}
+		return payload;
+	}
+
+	SharedPlane Shared(const PlaneRequest & request)
+	{
+		int shared;
+		std::string payload;
+		PlaneResponse response = Exchange(request, shared, payload);
+		if (shared < 0)
+		{
+			throw std::runtime_error("plane server sent no shared memory");
+		}
+		try
+		{
+			SharedPlane plane(shared, response.width, response.height, response.bytes);
+			close(shared);
+			return plane;
+		}
+		catch (...)
+		{
+			close(shared);
+			throw;
+		}
+	}
+
+	int fd = -1;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include "fmt/format.h"
+#include "dimension_order.h"
+
+// Tab separated list of XXH64 digests, one line per plane read:
+//
+//   capture position t c z raw output duplicate_of
+//
+// raw is the digest of the plane as ReadImagePlaneBuf returned it and output
+// the digest of the bytes written for it, or "-" when no stage changed them.
+// duplicate_of names the first earlier plane with the same raw digest as
+// capture/position/t/c/z, or is "-".
+class PlaneManifest
+{
+public:
+	explicit PlaneManifest(const std::string & path)
+		: path(path)
+		, file(std::fopen(path.c_str(), "w"))
+	{
+		if (!file)
+		{
+			throw std::runtime_error(fmt::format("unable to create {}", path));
+		}
+		fmt::print(file, "# xxh64\ncapture\tposition\tt\tc\tz\traw\toutput\tduplicate_of\n");
+	}
+
+	~PlaneManifest()
+	{
+		if (file)
+		{
+			std::fclose(file);
+		}
+	}
+
+	PlaneManifest(const PlaneManifest &) = delete;
+	PlaneManifest & operator=(const PlaneManifest &) = delete;
+
+	// Planes of a capture are added in read order; captures converting at
+	// once may add theirs concurrently.
+	void Add(int capture, int position, const PlaneCoord & p, UInt64 raw, const UInt64 * output)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::string coord = fmt::format("{}/{}/{}/{}/{}", capture, position, p.t, p.c, p.z);
+		auto first = first_seen.emplace(raw, coord);
+		if (!first.second)
+		{
+			duplicates++;
+		}
+		fmt::print(file, "{}\t{}\t{}\t{}\t{}\t{:016x}\t{}\t{}\n", capture, position, p.t, p.c, p.z, raw,
+			output ? fmt::format("{:016x}", *output) : "-", first.second ? "-" : first.first->second);
+	}
+
+	std::size_t Duplicates() const
+	{
+		return duplicates;
+	}
+
+	const std::string & Path() const
+	{
+		return path;
+	}
+
+	void Close()
+	{
+		int failed = std::ferror(file) | std::fclose(file);
+		file = nullptr;
+		if (failed)
+		{
+			throw std::runtime_error(fmt::format("unable to write {}", path));
+		}
+	}
+
+private:
+	std::string path;
+	std::FILE * file;
+	std::map<UInt64, std::string> first_seen;
+	std::size_t duplicates = 0;
+	std::mutex mutex;
+};
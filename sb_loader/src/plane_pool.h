@@ -0,0 +1,212 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "SBReadFile.h"
+#include "numa.h"
+
+#ifdef _WIN32
+	#include <malloc.h>
+#endif
+
+namespace util
+{
+	inline void * AlignedAlloc(std::size_t bytes, std::size_t alignment)
+	{
+#ifdef _WIN32
+		void * p = _aligned_malloc(bytes, alignment);
+#else
+		void * p = nullptr;
+		if (posix_memalign(&p, alignment, bytes) != 0)
+		{
+			p = nullptr;
+		}
+#endif
+		if (p == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	inline void AlignedFree(void * p)
+	{
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	inline std::size_t AlignUp(std::size_t v, std::size_t alignment)
+	{
+		return (v + alignment - 1) / alignment * alignment;
+	}
+}
+
+class PlanePool;
+
+// A buffer checked out of a PlanePool. Returned to the pool when destroyed.
+class PlaneBuffer
+{
+public:
+	PlaneBuffer() {}
+	PlaneBuffer(PlanePool * pool, std::size_t index, UInt8 * data, std::size_t capacity)
+		: pool(pool), index(index), data(data), capacity(capacity) {}
+	PlaneBuffer(PlaneBuffer && other) noexcept
+	{
+		*this = std::move(other);
+	}
+	PlaneBuffer & operator=(PlaneBuffer && other) noexcept;
+	~PlaneBuffer()
+	{
+		Reset();
+	}
+
+	PlaneBuffer(const PlaneBuffer &) = delete;
+	PlaneBuffer & operator=(const PlaneBuffer &) = delete;
+
+	void Reset();
+
+	template <typename T>
+	T * As() const
+	{
+		return reinterpret_cast<T *>(data);
+	}
+
+	explicit operator bool() const
+	{
+		return data != nullptr;
+	}
+
+	PlanePool * pool = nullptr;
+	std::size_t index = 0;
+	UInt8 * data = nullptr;
+	std::size_t capacity = 0;
+};
+
+// Fixed set of equally sized, aligned plane buffers. Acquire blocks while
+// every buffer is checked out, which bounds the memory held by planes in
+// flight between the reader and the writer.
+class PlanePool
+{
+public:
+	PlanePool(std::size_t buffer_bytes, std::size_t buffer_count, std::size_t alignment = 64)
+		: buffer_bytes(util::AlignUp(buffer_bytes, alignment))
+		, alignment(alignment)
+	{
+		for (std::size_t i = 0; i < buffer_count; i++)
+		{
+			buffers.push_back((UInt8 *)util::AlignedAlloc(this->buffer_bytes, alignment));
+			free_list.push_back(i);
+		}
+	}
+
+	~PlanePool()
+	{
+		for (auto buffer : buffers)
+		{
+			util::AlignedFree(buffer);
+		}
+	}
+
+	PlanePool(const PlanePool &) = delete;
+	PlanePool & operator=(const PlanePool &) = delete;
+
+	PlaneBuffer Acquire()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		available.wait(lock, [this] { return !free_list.empty(); });
+		std::size_t index = free_list.back();
+		free_list.pop_back();
+		return PlaneBuffer(this, index, buffers[index], buffer_bytes);
+	}
+
+	// Prefers node for the buffers' memory, moving pages already elsewhere.
+	void PlaceOnNode(int node)
+	{
+		for (auto buffer : buffers)
+		{
+			util::PlaceOnNode(buffer, buffer_bytes, node);
+		}
+	}
+
+	// As Acquire, but gives up after timeout and returns an empty buffer.
+	PlaneBuffer TryAcquire(std::chrono::milliseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!available.wait_for(lock, timeout, [this] { return !free_list.empty(); }))
+		{
+			return PlaneBuffer();
+		}
+		std::size_t index = free_list.back();
+		free_list.pop_back();
+		return PlaneBuffer(this, index, buffers[index], buffer_bytes);
+	}
+
+	void Release(std::size_t index)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			free_list.push_back(index);
+		}
+		available.notify_one();
+	}
+
+	std::size_t BufferBytes() const
+	{
+		return buffer_bytes;
+	}
+
+	std::size_t Alignment() const
+	{
+		return alignment;
+	}
+
+	std::size_t Count() const
+	{
+		return buffers.size();
+	}
+
+	UInt8 * Data(std::size_t index) const
+	{
+		return buffers[index];
+	}
+
+private:
+	std::size_t buffer_bytes;
+	std::size_t alignment;
+	std::vector<UInt8 *> buffers;
+	std::vector<std::size_t> free_list;
+	std::mutex mutex;
+	std::condition_variable available;
+};
+
+inline PlaneBuffer & PlaneBuffer::operator=(PlaneBuffer && other) noexcept
+{
+	if (this != &other)
+	{
+		Reset();
+		pool = other.pool;
+		index = other.index;
+		data = other.data;
+		capacity = other.capacity;
+		other.pool = nullptr;
+		other.data = nullptr;
+	}
+	return *this;
+}
+
+inline void PlaneBuffer::Reset()
+{
+	if (pool != nullptr)
+	{
+		pool->Release(index);
+	}
+	pool = nullptr;
+	data = nullptr;
+}
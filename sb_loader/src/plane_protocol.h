@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+
+#ifdef __linux__
+	#include <sys/socket.h>
+	#include <sys/types.h>
+	#include <unistd.h>
+#endif
+
+// Wire format of the plane server (mloader serve), shared with PlaneClient.
+//
+// Every request is one fixed size PlaneRequest; every answer is one
+// PlaneResponse followed by bytes of inline payload: the capture extents
+// for kInfo, JSON text for kMetadata and the message for errors. Plane and
+// ROI pixels are not sent through the socket: the response carries a
+// sealed memfd holding them (SCM_RIGHTS), which the client maps read only.
+// Both ends are on the same host, so fields are in native byte order.
+enum PlaneOp : UInt32
+{
+	kPlaneOpInfo = 1,	// extents of every capture
+	kPlaneOpMetadata = 2,	// capture metadata as JSON
+	kPlaneOpPlane = 3,	// one whole plane
+	kPlaneOpRoi = 4,	// x, y, width, height of a plane
+};
+
+const UInt32 kPlaneProtocolMagic = 0x314e4c50;	// "PLN1"
+
+struct PlaneRequest
+{
+	UInt32 magic;
+	UInt32 op;
+	SInt32 capture;
+	SInt32 position;
+	SInt32 t;
+	SInt32 z;
+	SInt32 c;
+	SInt32 x;
+	SInt32 y;
+	SInt32 width;
+	SInt32 height;
+};
+
+struct PlaneResponse
+{
+	UInt32 status;		// 0 for success, otherwise the payload is a message
+	SInt32 width;		// pixels in the attached memfd
+	SInt32 height;
+	UInt32 reserved;
+	UInt64 bytes;		// inline payload, or size of the attached memfd
+};
+
+// kInfo payload: a UInt32 capture count, then one of these per capture.
+struct PlaneCaptureInfo
+{
+	SInt32 width;
+	SInt32 height;
+	SInt32 positions;
+	SInt32 timepoints;
+	SInt32 channels;
+	SInt32 z;
+};
+
+#ifdef __linux__
+namespace detail
+{
+	inline void SendAll(int fd, const void * data, std::size_t bytes)
+	{
+		const char * at = (const char *)data;
+		while (bytes > 0)
+		{
+			ssize_t sent = send(fd, at, bytes, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (sent <= 0)
+			{
+				throw std::runtime_error(fmt::format("plane socket send failed: {}", strerror(errno)));
+			}
+			at += sent;
+			bytes -= (std::size_t)sent;
+		}
+	}
+
+	// Returns false on a clean end of stream before the first byte.
+	inline bool ReceiveAll(int fd, void * data, std::size_t bytes)
+	{
+		char * at = (char *)data;
+		std::size_t wanted = bytes;
+		while (bytes > 0)
+		{
+			ssize_t received = recv(fd, at, bytes, 0);
+			if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (received == 0 && bytes == wanted)
+			{
+				return false;
+			}
+			if (received <= 0)
+			{
+				throw std::runtime_error(fmt::format("plane socket receive failed: {}",
+					received == 0 ? "connection closed" : strerror(errno)));
+			}
+			at += received;
+			bytes -= (std::size_t)received;
+		}
+		return true;
+	}
+
+	// Sends data with shared, when not negative, passed along as SCM_RIGHTS.
+	inline void SendWithFd(int fd, const void * data, std::size_t bytes, int shared)
+	{
+		iovec io = { const_cast<void *>(data), bytes };
+		msghdr message = {};
+		message.msg_iov = &io;
+		message.msg_iovlen = 1;
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+		if (shared >= 0)
+		{
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+			cmsghdr * header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(sizeof(int));
+			std::memcpy(CMSG_DATA(header), &shared, sizeof(int));
+		}
+		ssize_t sent;
+		do
+		{
+			sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+		} while (sent < 0 && errno == EINTR);
+		if (sent < 0)
+		{
+			throw std::runtime_error(fmt::format("plane socket send failed: {}", strerror(errno)));
+		}
+		if ((std::size_t)sent < bytes)
+		{
+			SendAll(fd, (const char *)data + sent, bytes - (std::size_t)sent);
+		}
+	}
+
+	// Receives bytes, storing a passed descriptor in shared (-1 if none).
+	inline void ReceiveWithFd(int fd, void * data, std::size_t bytes, int & shared)
+	{
+		shared = -1;
+		iovec io = { data, bytes };
+		msghdr message = {};
+		message.msg_iov = &io;
+		message.msg_iovlen = 1;
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		ssize_t received;
+		do
+		{
+			received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+		} while (received < 0 && errno == EINTR);
+		if (received <= 0)
+		{
+			throw std::runtime_error(fmt::format("plane socket receive failed: {}",
+				received == 0 ? "connection closed" : strerror(errno)));
+		}
+		for (cmsghdr * header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+		{
+			if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+			{
+				std::memcpy(&shared, CMSG_DATA(header), sizeof(int));
+			}
+		}
+		if ((std::size_t)received < bytes)
+		{
+			ReceiveAll(fd, (char *)data + received, bytes - (std::size_t)received);
+		}
+	}
+}
+#endif
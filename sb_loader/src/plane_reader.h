@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include "SBReadFile.h"
+#include "dimension_order.h"
+#include "generator.h"
+#include "plane_pool.h"
+#include "read_ahead.h"
+
+// A plane produced by PlaneReader::Planes().
+struct PlaneRead
+{
+	PlaneCoord coord;
+	PlaneBuffer buffer;
+};
+
+// Iterates the planes of a capture and position in a given read order:
+//
+//	for (PlaneRead & plane : reader.Planes(capture, position, plan.ReadSequence(), pool))
+//
+// Planes come in pooled buffers the loop body may move out. With a
+// ReadAhead the following planes are already being read on other readers
+// while the body runs; otherwise each is read as the loop advances. Leaving
+// the loop early, by break or exception, stops the reads under way.
+class PlaneReader
+{
+public:
+	explicit PlaneReader(III::SBReadFile * reader, ReadAhead * read_ahead = nullptr)
+		: reader(reader)
+		, read_ahead(read_ahead)
+	{
+	}
+
+	util::Generator<PlaneRead> Planes(int capture, int position, std::vector<PlaneCoord> sequence, PlanePool & pool)
+	{
+		if (read_ahead != nullptr)
+		{
+			ReadAhead::Scan scan(*read_ahead, capture, position, sequence, pool);
+			for (const PlaneCoord & p : sequence)
+			{
+				PlaneRead plane = { p, scan.Next() };
+				co_yield plane;
+			}
+			co_return;
+		}
+		for (const PlaneCoord & p : sequence)
+		{
+			PlaneRead plane = { p, pool.Acquire() };
+			reader->ReadImagePlaneBuf(plane.buffer.As<UInt16>(), capture, position, p.t, p.z, p.c);
+			co_yield plane;
+		}
+	}
+
+	// Reads each plane straight to target(p), rows row_stride_bytes apart,
+	// and yields its coordinate once it is there. Always reads in turn.
+	util::Generator<const PlaneCoord> PlanesInto(int capture, int position, std::vector<PlaneCoord> sequence,
+		std::function<UInt16 * (const PlaneCoord &)> target, std::size_t row_stride_bytes)
+	{
+		for (const PlaneCoord & p : sequence)
+		{
+			reader->ReadImagePlaneBuf(target(p), row_stride_bytes, capture, position, p.t, p.z, p.c);
+			co_yield p;
+		}
+	}
+
+private:
+	III::SBReadFile * reader;
+	ReadAhead * read_ahead;
+};
@@ -0,0 +1,525 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include "fmt/format.h"
+#include "plane_cache.h"
+#include "plane_client.h"
+#include "plane_server.h"
+
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+namespace
+{
+	volatile std::sig_atomic_t serve_stop = 0;
+
+	void RequestServeStop(int)
+	{
+		serve_stop = 1;
+	}
+
+	// A sealed memfd of bytes filled by fill. Sealing lets clients map it
+	// knowing the pixels can no longer change under them.
+	int SharedMemory(std::size_t bytes, const std::function<void(UInt16 *)> & fill)
+	{
+		int fd = memfd_create("mloader-plane", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (fd < 0)
+		{
+			throw std::runtime_error(fmt::format("memfd_create failed: {}", strerror(errno)));
+		}
+		void * mapped = MAP_FAILED;
+		if (ftruncate(fd, (off_t)bytes) == 0)
+		{
+			mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		if (mapped == MAP_FAILED)
+		{
+			std::string error = strerror(errno);
+			close(fd);
+			throw std::runtime_error(fmt::format("unable to map shared plane memory: {}", error));
+		}
+		fill((UInt16 *)mapped);
+		munmap(mapped, bytes);
+		// clients map the pixels trusting them not to change
+		if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+		{
+			std::string error = strerror(errno);
+			close(fd);
+			throw std::runtime_error(fmt::format("unable to seal shared plane memory: {}", error));
+		}
+		return fd;
+	}
+
+	// A sealed memfd handed to clients, closed once no answer holds it.
+	struct SealedPlane
+	{
+		SealedPlane(std::size_t bytes, const std::function<void(UInt16 *)> & fill)
+			: fd(SharedMemory(bytes, fill))
+			, bytes(bytes)
+		{
+		}
+
+		~SealedPlane()
+		{
+			close(fd);
+		}
+
+		SealedPlane(const SealedPlane &) = delete;
+		SealedPlane & operator=(const SealedPlane &) = delete;
+
+		int fd;
+		std::size_t bytes;
+	};
+
+	// Whole planes kept in the sealed memfds they were first sent in, least
+	// recently sent dropped past capacity_bytes. Sending one again passes the
+	// same memfd, so the pixels are not copied again.
+	class SealedPlanes
+	{
+	public:
+		explicit SealedPlanes(std::size_t capacity_bytes)
+			: capacity(capacity_bytes)
+		{
+		}
+
+		std::shared_ptr<SealedPlane> Find(const PlaneKey & key)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto entry = entries.find(key);
+			if (entry == entries.end())
+			{
+				return nullptr;
+			}
+			lru.splice(lru.begin(), lru, entry->second);
+			resent++;
+			return entry->second->second;
+		}
+
+		// Keeps plane unless another thread kept one for key first; returns
+		// the one kept.
+		std::shared_ptr<SealedPlane> Insert(const PlaneKey & key, std::shared_ptr<SealedPlane> plane)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto entry = entries.find(key);
+			if (entry != entries.end())
+			{
+				return entry->second->second;
+			}
+			if (plane->bytes > capacity)
+			{
+				return plane;
+			}
+			lru.emplace_front(key, plane);
+			entries[key] = lru.begin();
+			bytes += plane->bytes;
+			while (bytes > capacity)
+			{
+				bytes -= lru.back().second->bytes;
+				entries.erase(lru.back().first);
+				lru.pop_back();
+			}
+			return plane;
+		}
+
+		UInt64 Resent() const
+		{
+			return resent;
+		}
+
+	private:
+		std::mutex mutex;
+		// most recently sent first
+		std::list<std::pair<PlaneKey, std::shared_ptr<SealedPlane>>> lru;
+		std::unordered_map<PlaneKey, std::list<std::pair<PlaneKey, std::shared_ptr<SealedPlane>>>::iterator, PlaneKeyHash> entries;
+		std::size_t bytes = 0;
+		std::size_t capacity;
+		std::atomic<UInt64> resent{ 0 };
+	};
+
+	class PlaneServer
+	{
+	public:
+		PlaneServer(PlaneSource & source, const std::vector<std::string> & metadata, PlaneCache & cache, SealedPlanes & sealed)
+			: source(source)
+			, metadata(metadata)
+			, cache(cache)
+			, sealed(sealed)
+		{
+		}
+
+		// Answers requests on a connection until the client hangs up.
+		void Serve(int fd)
+		{
+			PlaneRequest request;
+			while (detail::ReceiveAll(fd, &request, sizeof(request)))
+			{
+				PlaneResponse response = {};
+				std::string payload;
+				std::shared_ptr<SealedPlane> shared;
+				try
+				{
+					Answer(request, response, payload, shared);
+				}
+				catch (const III::Exception * e)
+				{
+					payload = e->GetDescription();
+					delete e;
+					response.status = 1;
+				}
+				catch (const std::exception & e)
+				{
+					payload = e.what();
+					response.status = 1;
+				}
+				if (!shared)
+				{
+					response.bytes = payload.size();
+				}
+				bool sent = true;
+				try
+				{
+					detail::SendWithFd(fd, &response, sizeof(response), shared ? shared->fd : -1);
+					if (!shared && !payload.empty())
+					{
+						detail::SendAll(fd, payload.data(), payload.size());
+					}
+				}
+				catch (const std::exception &)
+				{
+					sent = false;
+				}
+				shared.reset();
+				requests++;
+				// past a garbled request the stream is out of step
+				if (!sent || request.magic != kPlaneProtocolMagic)
+				{
+					return;
+				}
+			}
+		}
+
+		UInt64 Requests() const
+		{
+			return requests;
+		}
+
+	private:
+		void Answer(const PlaneRequest & request, PlaneResponse & response, std::string & payload, std::shared_ptr<SealedPlane> & shared)
+		{
+			if (request.magic != kPlaneProtocolMagic)
+			{
+				throw std::runtime_error("not a plane protocol request");
+			}
+			if (request.op == kPlaneOpInfo)
+			{
+				UInt32 count = (UInt32)source.Captures();
+				payload.assign((const char *)&count, sizeof(count));
+				for (int capture = 0; capture < source.Captures(); capture++)
+				{
+					const CaptureExtent & extent = source.Extent(capture);
+					PlaneCaptureInfo info = { extent.width, extent.height, extent.positions, extent.timepoints, extent.channels, extent.z };
+					payload.append((const char *)&info, sizeof(info));
+				}
+				return;
+			}
+			if (request.capture < 0 || request.capture >= source.Captures())
+			{
+				throw std::runtime_error(fmt::format("no capture {}", request.capture));
+			}
+			if (request.op == kPlaneOpMetadata)
+			{
+				payload = request.capture < (int)metadata.size() ? metadata[request.capture] : "{}";
+				return;
+			}
+			if (request.op != kPlaneOpPlane && request.op != kPlaneOpRoi)
+			{
+				throw std::runtime_error(fmt::format("unknown request {}", request.op));
+			}
+
+			const CaptureExtent & extent = source.Extent(request.capture);
+			if (request.position < 0 || request.position >= extent.positions || request.t < 0 || request.t >= extent.timepoints
+				|| request.z < 0 || request.z >= extent.z || request.c < 0 || request.c >= extent.channels)
+			{
+				throw std::runtime_error(fmt::format("no plane at position {} t {} z {} c {} in capture {}",
+					request.position, request.t, request.z, request.c, request.capture));
+			}
+			int x = 0;
+			int y = 0;
+			int width = extent.width;
+			int height = extent.height;
+			if (request.op == kPlaneOpRoi)
+			{
+				if (request.width <= 0 || request.height <= 0 || request.x < 0 || request.y < 0
+					|| request.x > extent.width - request.width || request.y > extent.height - request.height)
+				{
+					throw std::runtime_error(fmt::format("ROI {}x{} at {},{} is outside the {}x{} plane",
+						request.width, request.height, request.x, request.y, extent.width, extent.height));
+				}
+				x = request.x;
+				y = request.y;
+				width = request.width;
+				height = request.height;
+			}
+
+			// whole planes, asked for as ROIs too, go out in the memfd they
+			// were first sent in; only real sub-rectangles are copied per request
+			std::size_t bytes = (std::size_t)width * height * sizeof(UInt16);
+			PlaneKey key = { request.capture, request.position, request.t, request.z, request.c };
+			bool whole = width == extent.width && height == extent.height;
+			if (whole)
+			{
+				shared = sealed.Find(key);
+			}
+			if (!shared)
+			{
+				PlaneCache::Plane plane = cache.Get(key);
+				shared = std::make_shared<SealedPlane>(bytes, [&](UInt16 * out)
+				{
+					const UInt16 * in = plane->data() + (std::size_t)y * extent.width + x;
+					for (int row = 0; row < height; row++)
+					{
+						std::memcpy(out + (std::size_t)row * width, in + (std::size_t)row * extent.width, width * sizeof(UInt16));
+					}
+				});
+				if (whole)
+				{
+					shared = sealed.Insert(key, shared);
+				}
+			}
+			response.width = width;
+			response.height = height;
+			response.bytes = bytes;
+		}
+
+		PlaneSource & source;
+		const std::vector<std::string> & metadata;
+		PlaneCache & cache;
+		SealedPlanes & sealed;
+		std::atomic<UInt64> requests{ 0 };
+	};
+}
+
+void ServePlanes(PlaneSource & source, const std::vector<std::string> & metadata, const std::string & socket_path,
+	std::size_t cache_bytes, int prefetch_threads, int prefetch_depth)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path))
+	{
+		throw std::runtime_error(fmt::format("socket path too long: {}", socket_path));
+	}
+	std::strcpy(address.sun_path, socket_path.c_str());
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+	{
+		throw std::runtime_error(fmt::format("unable to create socket: {}", strerror(errno)));
+	}
+	// a stale socket from a previous server would fail the bind; it is
+	// removed only when nothing answers on it
+	struct stat existing;
+	if (lstat(socket_path.c_str(), &existing) == 0)
+	{
+		if (!S_ISSOCK(existing.st_mode))
+		{
+			close(listener);
+			throw std::runtime_error(fmt::format("{} exists and is not a socket", socket_path));
+		}
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int connected = probe < 0 ? -1 : connect(probe, (const sockaddr *)&address, sizeof(address));
+		int error = errno;
+		if (probe >= 0)
+		{
+			close(probe);
+		}
+		if (connected == 0 || error != ECONNREFUSED)
+		{
+			close(listener);
+			throw std::runtime_error(connected == 0 ? fmt::format("a server is already listening on {}", socket_path)
+				: fmt::format("unable to check {} is stale: {}", socket_path, strerror(error)));
+		}
+		unlink(socket_path.c_str());
+	}
+	if (bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+	{
+		std::string error = strerror(errno);
+		close(listener);
+		throw std::runtime_error(fmt::format("unable to listen on {}: {}", socket_path, error));
+	}
+
+	// half for decoded planes, half for the memfds whole planes went out in
+	PlaneCache cache(source, cache_bytes / 2, 8, prefetch_threads, prefetch_depth);
+	SealedPlanes sealed(cache_bytes / 2);
+	PlaneServer server(source, metadata, cache, sealed);
+	struct Connection
+	{
+		std::thread thread;
+		std::atomic<bool> done{ false };
+	};
+	std::list<std::unique_ptr<Connection>> connections;
+	std::set<int> open;
+	std::mutex mutex;
+
+	std::signal(SIGINT, RequestServeStop);
+	std::signal(SIGTERM, RequestServeStop);
+	fmt::print("serving {} captures on {} with a {} MB cache\n", source.Captures(), socket_path, cache_bytes >> 20);
+
+	while (!serve_stop)
+	{
+		for (auto connection = connections.begin(); connection != connections.end();)
+		{
+			if ((*connection)->done)
+			{
+				(*connection)->thread.join();
+				connection = connections.erase(connection);
+			}
+			else
+			{
+				++connection;
+			}
+		}
+		pollfd ready = { listener, POLLIN, 0 };
+		if (poll(&ready, 1, 500) <= 0)
+		{
+			continue;
+		}
+		int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			open.insert(fd);
+		}
+		connections.emplace_back(new Connection);
+		Connection * connection = connections.back().get();
+		connection->thread = std::thread([&, fd, connection]
+		{
+			try
+			{
+				server.Serve(fd);
+			}
+			catch (const std::exception &)
+			{
+				// the client went away mid request
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				open.erase(fd);
+			}
+			close(fd);
+			connection->done = true;
+		});
+	}
+
+	close(listener);
+	unlink(socket_path.c_str());
+	{
+		// wake the connection threads out of their reads
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int fd : open)
+		{
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+	for (auto & connection : connections)
+	{
+		connection->thread.join();
+	}
+	auto stats = cache.GetStats();
+	fmt::print("served {} requests, {} planes resent from their memfd, {} cache hits, {} waited on a read, {} misses\n",
+		server.Requests(), sealed.Resent(), stats.hits, stats.waited, stats.misses);
+}
+
+void BenchmarkPlaneServer(const std::string & socket_path, int clients, int requests)
+{
+	std::vector<PlaneCaptureInfo> captures = PlaneClient(socket_path).Info();
+	if (captures.empty())
+	{
+		throw std::runtime_error("the plane server has no captures");
+	}
+	const PlaneCaptureInfo capture = captures[0];
+	fmt::print("{} clients making {} requests each, {}x{} planes\n", clients, requests, capture.width, capture.height);
+
+	auto run = [&](const char * name, int roi)
+	{
+		std::atomic<UInt64> bytes{ 0 };
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		std::vector<std::thread> threads;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < clients; i++)
+		{
+			threads.emplace_back([&, i]
+			{
+				try
+				{
+					PlaneClient client(socket_path);
+					for (int r = 0; r < requests; r++)
+					{
+						// clients start at different planes of the same sweep
+						int n = r + i * capture.z;
+						int z = n % capture.z;
+						int t = (n / capture.z) % capture.timepoints;
+						SharedPlane plane = roi > 0
+							? client.ReadRoi(0, 0, t, z, 0, (capture.width - roi) / 2, (capture.height - roi) / 2, roi, roi)
+							: client.Read(0, 0, t, z, 0);
+						volatile UInt16 first = plane.Data()[0];
+						(void)first;
+						bytes += plane.Bytes();
+					}
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(error_mutex);
+					error = std::current_exception();
+				}
+			});
+		}
+		for (auto & thread : threads)
+		{
+			thread.join();
+		}
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		fmt::print("{:>12}: {:10.1f} requests/s, {:8.1f} MiB/s\n", name, (double)clients * requests / seconds,
+			bytes / seconds / (1 << 20));
+	};
+	run("plane", 0);
+	run("roi 64x64", std::min(64, std::min(capture.width, capture.height)));
+}
+
+#else
+
+void ServePlanes(PlaneSource &, const std::vector<std::string> &, const std::string &, std::size_t, int, int)
+{
+	throw std::runtime_error("serve needs Linux (Unix sockets and memfd)");
+}
+
+void BenchmarkPlaneServer(const std::string &, int, int)
+{
+	throw std::runtime_error("bench-serve needs Linux (Unix sockets and memfd)");
+}
+
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "plane_source.h"
+
+// Answers PlaneClient requests for the planes of source on a Unix domain
+// socket until SIGINT or SIGTERM, so that several processes on a node share
+// one open file and one PlaneCache (cache_bytes, prefetching as in
+// bench-cache). metadata holds the JSON answered for each capture. Each
+// connection is served by its own thread; plane and ROI pixels go back in
+// sealed memfds rather than through the socket. Whole planes keep their
+// memfd, within half of cache_bytes, and later requests for them are sent
+// that memfd again without a copy; ROIs are copied into a memfd of their
+// own. Linux only.
+void ServePlanes(PlaneSource & source, const std::vector<std::string> & metadata, const std::string & socket_path,
+	std::size_t cache_bytes, int prefetch_threads, int prefetch_depth);
+
+// Runs clients connections against a plane server, each making requests
+// plane reads through Z and T of the first capture, then as many 64 x 64
+// ROI reads, and prints the request rates.
+void BenchmarkPlaneServer(const std::string & socket_path, int clients, int requests);
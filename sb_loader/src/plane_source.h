@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "SBReadFile.h"
+#include "hash.h"
+#include "reader_pool.h"
+
+// Address of one raw plane in a SlideBook file.
+struct PlaneKey
+{
+	int capture;
+	int position;
+	int t;
+	int z;
+	int c;
+
+	bool operator==(const PlaneKey & other) const
+	{
+		return capture == other.capture && position == other.position && t == other.t && z == other.z && c == other.c;
+	}
+};
+
+struct PlaneKeyHash
+{
+	std::size_t operator()(const PlaneKey & key) const
+	{
+		return (std::size_t)util::Hash64(&key, sizeof(key));
+	}
+};
+
+struct CaptureExtent
+{
+	int width;
+	int height;
+	int positions;
+	int timepoints;
+	int channels;
+	int z;
+
+	std::size_t PlaneBytes() const
+	{
+		return (std::size_t)width * height * sizeof(UInt16);
+	}
+};
+
+// Somewhere raw UInt16 planes come from. Read may be called from several
+// threads at once.
+class PlaneSource
+{
+public:
+	virtual ~PlaneSource() {}
+
+	virtual int Captures() const = 0;
+
+	virtual const CaptureExtent & Extent(int capture) const = 0;
+
+	// Reads the plane into buffer, Extent(key.capture).PlaneBytes() long.
+	virtual void Read(const PlaneKey & key, UInt16 * buffer) = 0;
+
+	// Reads the plane with row_stride_bytes (at least a row) between the
+	// starts of its rows. Sources that cannot read strided go through a copy.
+	virtual void ReadStrided(const PlaneKey & key, UInt16 * buffer, std::size_t row_stride_bytes)
+	{
+		const CaptureExtent & extent = Extent(key.capture);
+		std::size_t row_bytes = (std::size_t)extent.width * sizeof(UInt16);
+		if (row_stride_bytes == row_bytes)
+		{
+			Read(key, buffer);
+			return;
+		}
+		std::vector<UInt16> plane(extent.PlaneBytes() / sizeof(UInt16));
+		Read(key, plane.data());
+		for (int y = 0; y < extent.height; y++)
+		{
+			std::memcpy((UInt8 *)buffer + y * row_stride_bytes, plane.data() + (std::size_t)y * extent.width, row_bytes);
+		}
+	}
+};
+
+// PlaneSource over a .sld. A reader is not thread safe, so each read takes
+// one from the pool; concurrent reads get readers of their own, up to the
+// pool's limit per file.
+class SBPlaneSource : public PlaneSource
+{
+public:
+	SBPlaneSource(ReaderPool & readers, const std::string & filename)
+		: readers(readers)
+		, filename(filename)
+	{
+		ReaderPool::Lease reader = readers.Acquire(filename);
+		for (CaptureIndex capture = 0; capture < reader->GetNumCaptures(); capture++)
+		{
+			extents.push_back(CaptureExtent{ reader->GetNumXColumns(capture), reader->GetNumYRows(capture),
+				reader->GetNumPositions(capture), reader->GetNumTimepoints(capture),
+				reader->GetNumChannels(capture), reader->GetNumZPlanes(capture) });
+		}
+	}
+
+	int Captures() const override
+	{
+		return (int)extents.size();
+	}
+
+	const CaptureExtent & Extent(int capture) const override
+	{
+		return extents[capture];
+	}
+
+	void Read(const PlaneKey & key, UInt16 * buffer) override
+	{
+		ReaderPool::Lease reader = readers.Acquire(filename);
+		reader->ReadImagePlaneBuf(buffer, key.capture, key.position, key.t, key.z, key.c);
+	}
+
+	void ReadStrided(const PlaneKey & key, UInt16 * buffer, std::size_t row_stride_bytes) override
+	{
+		if (row_stride_bytes == extents[key.capture].width * sizeof(UInt16))
+		{
+			Read(key, buffer);
+			return;
+		}
+		ReaderPool::Lease reader = readers.Acquire(filename);
+		reader->ReadImagePlaneBuf(buffer, row_stride_bytes, key.capture, key.position, key.t, key.z, key.c);
+	}
+
+private:
+	ReaderPool & readers;
+	std::string filename;
+	std::vector<CaptureExtent> extents;
+};
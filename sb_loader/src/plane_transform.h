@@ -0,0 +1,137 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "dimension_order.h"
+#include "plane_pool.h"
+
+struct PlaneShape
+{
+	int width;
+	int height;
+	std::size_t pixel_bytes;
+
+	std::size_t Bytes() const
+	{
+		return (std::size_t)width * height * pixel_bytes;
+	}
+};
+
+// Reads the raw UInt16 plane at (position, t, c, z) into a buffer.
+using PlaneSampler = std::function<void(int position, const PlaneCoord & p, UInt16 * buffer)>;
+
+// Per plane processing stage run between ReadImagePlaneBuf and the output.
+//
+// Stages work in place on the read buffer and may only shrink a plane, so
+// the buffer sized for the raw plane always suffices. Apply is called from
+// several threads at once once Prepare has returned.
+class PlaneTransform
+{
+public:
+	virtual ~PlaneTransform() {}
+
+	virtual std::string Name() const = 0;
+
+	virtual PlaneShape OutputShape(const PlaneShape & in) const
+	{
+		return in;
+	}
+
+	// Called once per capture before any plane is applied. sample reads a
+	// plane with every earlier stage already applied, leaving in.Bytes() of
+	// the buffer valid; positions, extents are the capture's position count
+	// and raw (T, C, Z, Y, X).
+	virtual void Prepare(const PlaneSampler &, const PlaneShape &, int, const std::array<int, AxisCount> &)
+	{
+	}
+
+	virtual void Apply(UInt8 * plane, const PlaneShape & in, const PlaneCoord & p) const = 0;
+
+	// Extra members for the JSON metadata sidecar, as name and JSON value.
+	virtual std::vector<std::pair<std::string, std::string>> Metadata() const
+	{
+		return {};
+	}
+};
+
+class TransformChain
+{
+public:
+	void Add(std::unique_ptr<PlaneTransform> transform)
+	{
+		transforms.push_back(std::move(transform));
+	}
+
+	bool Empty() const
+	{
+		return transforms.empty();
+	}
+
+	PlaneShape OutputShape(PlaneShape shape) const
+	{
+		for (auto & transform : transforms)
+		{
+			shape = transform->OutputShape(shape);
+		}
+		return shape;
+	}
+
+	// Prepares each stage in turn; a stage samples planes through every
+	// stage before it.
+	void Prepare(const PlaneSampler & read, int positions, const std::array<int, AxisCount> & extents)
+	{
+		PlaneShape raw = { extents[AxisX], extents[AxisY], sizeof(UInt16) };
+		PlaneShape in = raw;
+		for (std::size_t i = 0; i < transforms.size(); i++)
+		{
+			PlaneSampler sample = [this, &read, raw, i](int position, const PlaneCoord & p, UInt16 * buffer)
+			{
+				read(position, p, buffer);
+				ApplyRange((UInt8 *)buffer, raw, p, 0, i);
+			};
+			transforms[i]->Prepare(sample, in, positions, extents);
+			in = transforms[i]->OutputShape(in);
+		}
+	}
+
+	void Apply(UInt8 * plane, const PlaneShape & raw, const PlaneCoord & p) const
+	{
+		ApplyRange(plane, raw, p, 0, transforms.size());
+	}
+
+	std::string Describe() const
+	{
+		std::string names;
+		for (auto & transform : transforms)
+		{
+			names += (names.empty() ? "" : ", ") + transform->Name();
+		}
+		return names;
+	}
+
+	std::vector<std::pair<std::string, std::string>> Metadata() const
+	{
+		std::vector<std::pair<std::string, std::string>> members;
+		for (auto & transform : transforms)
+		{
+			auto m = transform->Metadata();
+			members.insert(members.end(), m.begin(), m.end());
+		}
+		return members;
+	}
+
+private:
+	void ApplyRange(UInt8 * plane, PlaneShape shape, const PlaneCoord & p, std::size_t begin, std::size_t end) const
+	{
+		for (std::size_t i = begin; i < end; i++)
+		{
+			transforms[i]->Apply(plane, shape, p);
+			shape = transforms[i]->OutputShape(shape);
+		}
+	}
+
+	std::vector<std::unique_ptr<PlaneTransform>> transforms;
+};
@@ -0,0 +1,394 @@
+#include "plane_writer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "thread_pool.h"
+
+#ifdef SB_LOADER_HAVE_LIBURING
+	#include <liburing.h>
+	#include <sys/uio.h>
+#endif
+
+namespace
+{
+	// Plain synchronous writer: each plane is written by the submitting thread.
+	class SyncWriter : public PlaneWriter
+	{
+	public:
+		const char * Name() const override
+		{
+			return "sync";
+		}
+
+		void Submit(WriteRequest && request) override
+		{
+			int error = request.file->WriteAt(request.buffer.data, request.bytes, request.offset);
+			Complete(request, error);
+		}
+
+		void Flush() override
+		{
+			ThrowIfFailed();
+		}
+	};
+
+	// pwrite issued from a pool of writer threads.
+	class ThreadPoolWriter : public PlaneWriter
+	{
+	public:
+		explicit ThreadPoolWriter(int threads)
+			: pool(threads)
+		{
+		}
+
+		const char * Name() const override
+		{
+			return "threads";
+		}
+
+		void Submit(WriteRequest && request) override
+		{
+			auto shared = std::make_shared<WriteRequest>(std::move(request));
+			pool.Post([this, shared]
+			{
+				int error = shared->file->WriteAt(shared->buffer.data, shared->bytes, shared->offset);
+				Complete(*shared, error);
+			});
+		}
+
+		void Flush() override
+		{
+			pool.Wait();
+			ThrowIfFailed();
+		}
+
+	private:
+		util::ThreadPool pool;
+	};
+
+#ifdef SB_LOADER_HAVE_LIBURING
+	// io_uring writer. Requests are queued by the caller and a single ring
+	// thread batches them into SQEs, submits, and reaps completions. Buffers
+	// that belong to the registered plane pool are written with
+	// IORING_OP_WRITE_FIXED. SQEs the kernel did not take are submitted again
+	// once completions have been reaped; should submitting fail outright,
+	// they and every later request fail with its error.
+	class UringWriter : public PlaneWriter
+	{
+	public:
+		UringWriter(int queue_depth, PlanePool & pool)
+			: pool(pool)
+			, depth(queue_depth)
+		{
+			int result = io_uring_queue_init((unsigned)depth, &ring, 0);
+			if (result < 0)
+			{
+				throw std::runtime_error(fmt::format("io_uring_queue_init failed: {}", strerror(-result)));
+			}
+			std::vector<iovec> iovecs(pool.Count());
+			for (std::size_t i = 0; i < pool.Count(); i++)
+			{
+				iovecs[i].iov_base = pool.Data(i);
+				iovecs[i].iov_len = pool.BufferBytes();
+			}
+			// Registration pins the pool; RLIMIT_MEMLOCK may refuse it, in which
+			// case plain IORING_OP_WRITE is used.
+			registered = io_uring_register_buffers(&ring, iovecs.data(), (unsigned)iovecs.size()) == 0;
+			ring_thread = std::thread([this] { Run(); });
+		}
+
+		~UringWriter() override
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			queued.notify_all();
+			ring_thread.join();
+			if (registered)
+			{
+				io_uring_unregister_buffers(&ring);
+			}
+			io_uring_queue_exit(&ring);
+		}
+
+		const char * Name() const override
+		{
+			return registered ? "uring (registered buffers)" : "uring";
+		}
+
+		void Submit(WriteRequest && request) override
+		{
+			auto pending = new Pending{ std::move(request), 0 };
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queue.push_back(pending);
+				outstanding++;
+			}
+			queued.notify_one();
+		}
+
+		void Flush() override
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			drained.wait(lock, [this] { return outstanding == 0; });
+			lock.unlock();
+			ThrowIfFailed();
+		}
+
+	private:
+		struct Pending
+		{
+			WriteRequest request;
+			std::size_t done;
+		};
+
+		void Prepare(Pending * pending)
+		{
+			io_uring_sqe * sqe = io_uring_get_sqe(&ring);
+			auto & request = pending->request;
+			UInt8 * data = request.buffer.data + pending->done;
+			unsigned bytes = (unsigned)(request.bytes - pending->done);
+			UInt64 offset = request.offset + pending->done;
+			if (registered && request.buffer.pool == &pool)
+			{
+				io_uring_prep_write_fixed(sqe, request.file->Handle(), data, bytes, offset, (int)request.buffer.index);
+			}
+			else
+			{
+				io_uring_prep_write(sqe, request.file->Handle(), data, bytes, offset);
+			}
+			io_uring_sqe_set_data(sqe, pending);
+		}
+
+		void Reap(io_uring_cqe * cqe)
+		{
+			auto pending = (Pending *)io_uring_cqe_get_data(cqe);
+			int result = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			inflight--;
+
+			if (result > 0 && pending->done + result < pending->request.bytes)
+			{
+				// short write, resubmit the remainder
+				pending->done += result;
+				std::lock_guard<std::mutex> lock(mutex);
+				queue.push_front(pending);
+				return;
+			}
+			Finish(pending, result < 0 ? -result : (result == 0 ? EIO : 0));
+		}
+
+		void Finish(Pending * pending, int error)
+		{
+			Complete(pending->request, error);
+			delete pending;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				outstanding--;
+			}
+			drained.notify_all();
+		}
+
+		// Submits the prepared SQEs, keeping those the kernel did not take.
+		void SubmitPrepared()
+		{
+			int submitted = io_uring_submit(&ring);
+			if (submitted >= 0)
+			{
+				for (int i = 0; i < submitted && !unsubmitted.empty(); i++)
+				{
+					unsubmitted.pop_front();
+				}
+				inflight += submitted;
+				return;
+			}
+			if (submitted == -EAGAIN || submitted == -EBUSY || submitted == -EINTR)
+			{
+				// out of resources until completions are reaped
+				return;
+			}
+			// the SQEs stay in the ring unsubmitted, so nothing is submitted again
+			failed_error = -submitted;
+			for (auto pending : unsubmitted)
+			{
+				Finish(pending, failed_error);
+			}
+			unsubmitted.clear();
+		}
+
+		void Run()
+		{
+			std::vector<Pending *> batch;
+			for (;;)
+			{
+				batch.clear();
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					if (inflight == 0 && unsubmitted.empty())
+					{
+						queued.wait(lock, [this] { return stopping || !queue.empty(); });
+						if (queue.empty())
+						{
+							return;
+						}
+					}
+					while (!queue.empty() && (failed_error || inflight + (int)(unsubmitted.size() + batch.size()) < depth))
+					{
+						batch.push_back(queue.front());
+						queue.pop_front();
+					}
+				}
+
+				for (auto pending : batch)
+				{
+					if (failed_error)
+					{
+						Finish(pending, failed_error);
+						continue;
+					}
+					Prepare(pending);
+					unsubmitted.push_back(pending);
+				}
+				if (!unsubmitted.empty())
+				{
+					SubmitPrepared();
+				}
+				if (inflight == 0)
+				{
+					if (!unsubmitted.empty())
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					}
+					continue;
+				}
+
+				// Wait briefly for one completion so newly queued requests are
+				// picked up promptly, then drain whatever else is ready.
+				io_uring_cqe * cqe = nullptr;
+				__kernel_timespec timeout = { 0, 1000000 };
+				if (io_uring_wait_cqe_timeout(&ring, &cqe, &timeout) == 0)
+				{
+					Reap(cqe);
+					while (io_uring_peek_cqe(&ring, &cqe) == 0)
+					{
+						Reap(cqe);
+					}
+				}
+			}
+		}
+
+		PlanePool & pool;
+		int depth;
+		io_uring ring;
+		bool registered = false;
+		int inflight = 0;
+		std::deque<Pending *> unsubmitted;	// prepared, not yet taken by the kernel
+		int failed_error = 0;	// once submitting has failed, every request fails with this
+
+		std::thread ring_thread;
+		std::mutex mutex;
+		std::condition_variable queued;
+		std::condition_variable drained;
+		std::deque<Pending *> queue;
+		std::size_t outstanding = 0;
+		bool stopping = false;
+	};
+#endif
+}
+
+std::unique_ptr<PlaneWriter> CreatePlaneWriter(const WriterOptions & options, [[maybe_unused]] PlanePool & pool)
+{
+	if (options.backend == "sync")
+	{
+		return std::unique_ptr<PlaneWriter>(new SyncWriter());
+	}
+	if (options.backend == "uring" || options.backend == "auto")
+	{
+#ifdef SB_LOADER_HAVE_LIBURING
+		try
+		{
+			return std::unique_ptr<PlaneWriter>(new UringWriter(options.queue_depth, pool));
+		}
+		catch (const std::exception & e)
+		{
+			if (options.backend == "uring")
+			{
+				fmt::print("{}, falling back to threaded pwrite\n", e.what());
+			}
+		}
+#else
+		if (options.backend == "uring")
+		{
+			fmt::print("built without liburing, falling back to threaded pwrite\n");
+		}
+#endif
+		return std::unique_ptr<PlaneWriter>(new ThreadPoolWriter(options.threads));
+	}
+	if (options.backend == "threads")
+	{
+		return std::unique_ptr<PlaneWriter>(new ThreadPoolWriter(options.threads));
+	}
+	throw std::runtime_error(fmt::format("unknown writer backend: {}", options.backend));
+}
+
+void BenchmarkPlaneWriters(const std::string & directory, const WriterOptions & options, bool direct,
+	int plane_count, int width, int height)
+{
+	std::size_t plane_bytes = (std::size_t)width * height * sizeof(UInt16);
+	fmt::print("writing {} planes of {}x{} ({:.1f} MiB) per backend\n",
+		plane_count, width, height, plane_count * (double)plane_bytes / (1 << 20));
+
+	for (std::string backend : { "sync", "threads", "uring" })
+	{
+		PlanePool pool(plane_bytes, 64, direct ? kDirectIoAlignment : 64);
+		{
+			// touch every buffer once so page faults are not timed
+			std::vector<PlaneBuffer> buffers;
+			for (std::size_t i = 0; i < pool.Count(); i++)
+			{
+				buffers.push_back(pool.Acquire());
+				auto pixels = buffers.back().As<UInt16>();
+				for (std::size_t p = 0; p < plane_bytes / sizeof(UInt16); p++)
+				{
+					pixels[p] = (UInt16)(p + i);
+				}
+			}
+		}
+
+		WriterOptions backend_options = options;
+		backend_options.backend = backend;
+		auto writer = CreatePlaneWriter(backend_options, pool);
+		std::string path = fmt::format("{}/sb_writer_bench_{}.raw", directory, backend);
+		auto file = std::make_shared<OutputFile>(path, direct);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < plane_count; i++)
+		{
+			WriteRequest request;
+			request.file = file;
+			request.offset = (UInt64)i * plane_bytes;
+			request.bytes = plane_bytes;
+			request.buffer = pool.Acquire();
+			writer->Submit(std::move(request));
+		}
+		writer->Flush();
+		auto submitted = std::chrono::steady_clock::now();
+		file->Sync();
+		auto synced = std::chrono::steady_clock::now();
+
+		double write_seconds = std::chrono::duration<double>(submitted - start).count();
+		double total_seconds = std::chrono::duration<double>(synced - start).count();
+		double mib = plane_count * (double)plane_bytes / (1 << 20);
+		fmt::print("{:>28}: {:8.1f} MiB/s written, {:8.1f} MiB/s including fsync\n",
+			fmt::format("{}{}", writer->Name(), file->IsDirect() ? " direct" : ""), mib / write_seconds, mib / total_seconds);
+
+		file.reset();
+		std::remove(path.c_str());
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "output_file.h"
+#include "plane_pool.h"
+
+// One positional write of a pooled buffer. The buffer goes back to its pool
+// once the write has completed, after on_complete has run.
+struct WriteRequest
+{
+	std::shared_ptr<OutputFile> file;
+	UInt64 offset = 0;
+	std::size_t bytes = 0;
+	PlaneBuffer buffer;
+	std::function<void(bool)> on_complete;
+};
+
+// Backend that moves plane buffers to storage. Submit never waits on the
+// storage device; it may only wait for queue space.
+class PlaneWriter
+{
+public:
+	virtual ~PlaneWriter() {}
+
+	virtual const char * Name() const = 0;
+
+	virtual void Submit(WriteRequest && request) = 0;
+
+	// Waits for every submitted write. Throws if any write failed.
+	virtual void Flush() = 0;
+
+protected:
+	void Complete(WriteRequest & request, int error)
+	{
+		if (error != 0)
+		{
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if (first_error.empty())
+			{
+				first_error = fmt::format("write of {} bytes at {} to {} failed: {}",
+					request.bytes, request.offset, request.file->Path(), strerror(error));
+			}
+		}
+		if (request.on_complete)
+		{
+			request.on_complete(error == 0);
+		}
+		request.buffer.Reset();
+	}
+
+	void ThrowIfFailed()
+	{
+		std::lock_guard<std::mutex> lock(error_mutex);
+		if (!first_error.empty())
+		{
+			throw std::runtime_error(first_error);
+		}
+	}
+
+private:
+	std::mutex error_mutex;
+	std::string first_error;
+};
+
+struct WriterOptions
+{
+	std::string backend = "auto";   // sync, threads, uring or auto
+	int threads = 4;
+	int queue_depth = 64;
+};
+
+// Creates the requested backend. "uring" falls back to "threads" when
+// liburing is not compiled in or the kernel refuses the ring. The pool's
+// buffers are registered with io_uring for fixed-buffer writes.
+std::unique_ptr<PlaneWriter> CreatePlaneWriter(const WriterOptions & options, PlanePool & pool);
+
+// Writes synthetic planes through each backend and prints the throughput.
+void BenchmarkPlaneWriters(const std::string & directory, const WriterOptions & options, bool direct,
+	int plane_count, int width, int height);
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SBReadFile.h"
+#include "dimension_order.h"
+#include "plane_pool.h"
+#include "read_tuner.h"
+#include "reader_pool.h"
+
+// Reads the planes of a conversion ahead of the consumer. Every read takes
+// a reader of its own from the pool, so up to depth planes further along
+// the read sequence are decoded in parallel while the current one is
+// processed; Next() hands them back in sequence order.
+//
+// Workers take buffers from the scan's pool and claim planes one at a time,
+// so buffers go out in sequence order and reading ahead never holds the
+// buffer the next plane needs.
+//
+// With tune set, a ReadTuner decides how many of the threads read at once
+// (the rest idle); depth should then be at least threads.
+class ReadAhead
+{
+public:
+	ReadAhead(ReaderPool & readers, const std::string & filename, int threads, int depth, bool tune = false)
+		: readers(readers)
+		, filename(filename)
+		, depth((std::size_t)std::max(1, depth))
+	{
+		threads = std::max(1, threads);
+		active = threads;
+		if (tune)
+		{
+			tuner.reset(new ReadTuner(threads));
+			active = tuner->Threads();
+		}
+		for (int i = 0; i < threads; i++)
+		{
+			workers.emplace_back([this, i] { Run(i); });
+		}
+	}
+
+	~ReadAhead()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (auto & worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	ReadAhead(const ReadAhead &) = delete;
+	ReadAhead & operator=(const ReadAhead &) = delete;
+
+	int Threads() const
+	{
+		return (int)workers.size();
+	}
+
+	std::size_t Depth() const
+	{
+		return depth;
+	}
+
+	bool Tuned() const
+	{
+		return tuner != nullptr;
+	}
+
+	// Threads reading at once; all of them unless tuned.
+	int ActiveThreads()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return active;
+	}
+
+	// The tuner's changes of thread count so far.
+	std::vector<ReadTuner::Decision> TuningDecisions()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return tuner ? tuner->Decisions() : std::vector<ReadTuner::Decision>();
+	}
+
+	// One pass over a read sequence of a capture and position, filling
+	// buffers from pool. Only one scan runs at a time; destroying it waits
+	// for the reads under way and returns every buffer not yet handed out,
+	// so it has to go before the pool does.
+	class Scan
+	{
+	public:
+		Scan(ReadAhead & owner, int capture, int position, std::vector<PlaneCoord> sequence, PlanePool & pool)
+			: owner(owner)
+		{
+			owner.Begin(capture, position, std::move(sequence), pool);
+		}
+
+		~Scan()
+		{
+			owner.End();
+		}
+
+		Scan(const Scan &) = delete;
+		Scan & operator=(const Scan &) = delete;
+
+		// The next plane of the sequence, waiting for it if need be. Rethrows
+		// a failed read.
+		PlaneBuffer Next()
+		{
+			return owner.Next();
+		}
+
+	private:
+		ReadAhead & owner;
+	};
+
+private:
+	struct Slot
+	{
+		PlaneBuffer buffer;
+		std::exception_ptr error;
+	};
+
+	void Begin(int capture, int position, std::vector<PlaneCoord> planes, PlanePool & from)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (scanning)
+			{
+				throw std::logic_error("read ahead scan already running");
+			}
+			this->capture = capture;
+			this->position = position;
+			sequence = std::move(planes);
+			pool = &from;
+			issued = 0;
+			consumed = 0;
+			scanning = true;
+			if (tuner)
+			{
+				tuner->Resume(ReadTuner::Clock::now());
+			}
+		}
+		changed.notify_all();
+	}
+
+	void End()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		scanning = false;
+		if (tuner)
+		{
+			tuner->Pause();
+		}
+		changed.notify_all();
+		changed.wait(lock, [this] { return busy == 0; });
+		ready.clear();
+		sequence.clear();
+		pool = nullptr;
+	}
+
+	PlaneBuffer Next()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (consumed >= sequence.size())
+		{
+			throw std::logic_error("read ahead past the end of the sequence");
+		}
+		changed.wait(lock, [this] { return ready.count(consumed) != 0; });
+		Slot slot = std::move(ready[consumed]);
+		ready.erase(consumed);
+		consumed++;
+		lock.unlock();
+		changed.notify_all();
+		if (slot.error)
+		{
+			std::rethrow_exception(slot.error);
+		}
+		return std::move(slot.buffer);
+	}
+
+	// Called with the mutex held.
+	bool CanIssue() const
+	{
+		return scanning && issued < sequence.size() && issued < consumed + depth;
+	}
+
+	void Run(int index)
+	{
+		for (;;)
+		{
+			// one worker at a time takes a buffer and claims the next plane
+			std::unique_lock<std::mutex> issue(issue_mutex);
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this, index] { return stopping || index >= active || CanIssue(); });
+			if (stopping)
+			{
+				return;
+			}
+			if (index >= active)
+			{
+				// idle while the tuner has no use for this thread, without
+				// holding up the others
+				issue.unlock();
+				changed.wait(lock, [this, index] { return stopping || index < active; });
+				continue;
+			}
+			busy++;
+			PlanePool & from = *pool;
+			lock.unlock();
+
+			// the consumer may hold every buffer for a while; keep an eye on
+			// the scan ending meanwhile
+			PlaneBuffer buffer;
+			bool current = true;
+			while (!buffer && current)
+			{
+				buffer = from.TryAcquire(std::chrono::milliseconds(20));
+				lock.lock();
+				current = scanning && !stopping;
+				lock.unlock();
+			}
+
+			lock.lock();
+			if (!current)
+			{
+				buffer.Reset();
+				busy--;
+				changed.notify_all();
+				continue;
+			}
+			std::size_t slot = issued++;
+			PlaneCoord p = sequence[slot];
+			int capture_index = capture;
+			int position_index = position;
+			lock.unlock();
+			issue.unlock();
+
+			std::exception_ptr error;
+			std::size_t bytes = 0;
+			try
+			{
+				ReaderPool::Lease reader = readers.Acquire(filename);
+				reader->ReadImagePlaneBuf(buffer.As<UInt16>(), capture_index, position_index, p.t, p.z, p.c);
+				bytes = (std::size_t)reader->GetNumXColumns(capture_index) * reader->GetNumYRows(capture_index) * sizeof(UInt16);
+			}
+			catch (const III::Exception * e)
+			{
+				error = std::make_exception_ptr(std::runtime_error(e->GetDescription()));
+				delete e;
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			lock.lock();
+			ready[slot] = Slot{ std::move(buffer), error };
+			busy--;
+			if (tuner && !error)
+			{
+				active = tuner->Completed(bytes, ReadTuner::Clock::now());
+			}
+			lock.unlock();
+			changed.notify_all();
+		}
+	}
+
+	ReaderPool & readers;
+	std::string filename;
+	std::size_t depth;
+	std::vector<std::thread> workers;
+	std::mutex issue_mutex;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool stopping = false;
+	bool scanning = false;
+	int active;			// workers below this index read
+	std::unique_ptr<ReadTuner> tuner;
+	int capture = 0;
+	int position = 0;
+	std::vector<PlaneCoord> sequence;
+	PlanePool * pool = nullptr;
+	std::size_t issued = 0;
+	std::size_t consumed = 0;
+	int busy = 0;
+	std::map<std::size_t, Slot> ready;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Picks how many threads read at once from the read throughput seen. It
+// first tries 1, 2, 4 ... up to the maximum threads for a window each,
+// stopping once more threads clearly do worse, and settles on the fewest
+// threads within a few percent of the best. While settled it compares
+// half and twice the count every so often, and sooner should throughput
+// fall well below what it was when settled, as when others start reading
+// from the same disk.
+//
+// Not thread safe; ReadAhead calls it under its lock.
+class ReadTuner
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Decision
+	{
+		double seconds;		// since the tuner started
+		int threads;
+		double mb_per_second;	// at that count
+		std::string reason;
+	};
+
+	ReadTuner(int max_threads, Clock::time_point now = Clock::now())
+		: max_threads(std::max(1, max_threads))
+		, start(now)
+	{
+		for (int level = 1; level < this->max_threads; level *= 2)
+		{
+			probes.push_back(level);
+		}
+		probes.push_back(this->max_threads);
+		StartWindow(probes.front(), now);
+	}
+
+	// Threads to read with now.
+	int Threads() const
+	{
+		return current;
+	}
+
+	// Records a finished read of bytes; returns the threads to read with.
+	int Completed(std::size_t bytes, Clock::time_point now)
+	{
+		if (paused)
+		{
+			return current;
+		}
+		window_bytes += bytes;
+		window_planes++;
+		if (window_planes < kWindowPlanes || now - window_start < kWindow)
+		{
+			return current;
+		}
+		double rate = window_bytes / std::chrono::duration<double>(now - window_start).count() / (1 << 20);
+		if (probing)
+		{
+			Probed(rate, now);
+		}
+		else
+		{
+			Watched(rate, now);
+		}
+		return current;
+	}
+
+	// Stops and restarts the clock between scans, so that time the consumer
+	// spends elsewhere does not count as slow reading.
+	void Pause()
+	{
+		paused = true;
+	}
+
+	void Resume(Clock::time_point now)
+	{
+		paused = false;
+		window_start = now;
+		window_bytes = 0;
+		window_planes = 0;
+	}
+
+	const std::vector<Decision> & Decisions() const
+	{
+		return decisions;
+	}
+
+private:
+	static constexpr int kWindowPlanes = 8;
+	static constexpr std::chrono::milliseconds kWindow{ 500 };
+	static constexpr std::chrono::seconds kSettled{ 15 };
+	static constexpr double kTie = 0.05;		// fewer threads win within this
+	static constexpr double kWorse = 0.15;	// stop probing past this drop
+	static constexpr double kContention = 0.3;	// re-probe past this drop
+
+	void StartWindow(int threads, Clock::time_point now)
+	{
+		current = threads;
+		window_start = now;
+		window_bytes = 0;
+		window_planes = 0;
+	}
+
+	void Probed(double rate, Clock::time_point now)
+	{
+		rates.push_back(std::make_pair(current, rate));
+		double best = 0;
+		for (auto & sample : rates)
+		{
+			best = std::max(best, sample.second);
+		}
+		// climbing from one thread, more threads doing clearly worse ends it
+		if (probe + 1 < probes.size() && (!climbing || rate >= best * (1 - kWorse)))
+		{
+			StartWindow(probes[++probe], now);
+			return;
+		}
+		// the fewest threads close to the best
+		auto chosen = rates.front();
+		for (auto & sample : rates)
+		{
+			if (sample.second >= best * (1 - kTie) && (chosen.second < best * (1 - kTie) || sample.first < chosen.first))
+			{
+				chosen = sample;
+			}
+		}
+		Decide(chosen.first, chosen.second, now, reason);
+		probing = false;
+		climbing = false;
+		settled = now;
+	}
+
+	void Watched(double rate, Clock::time_point now)
+	{
+		if (rate < settled_rate * (1 - kContention))
+		{
+			Reprobe(rate, now, "throughput fell");
+		}
+		else if (now - settled >= kSettled)
+		{
+			Reprobe(rate, now, "periodic check");
+		}
+		else
+		{
+			StartWindow(current, now);
+		}
+	}
+
+	// Tries half and twice the current count against the window just seen.
+	void Reprobe(double rate, Clock::time_point now, const char * why)
+	{
+		rates.assign(1, std::make_pair(current, rate));
+		probes.clear();
+		probe = 0;
+		if (current > 1)
+		{
+			probes.push_back(current / 2);
+		}
+		if (current < max_threads)
+		{
+			probes.push_back(std::min(max_threads, current * 2));
+		}
+		if (probes.empty())
+		{
+			StartWindow(current, now);
+			settled = now;
+			return;
+		}
+		reason = why;
+		probing = true;
+		StartWindow(probes.front(), now);
+	}
+
+	void Decide(int threads, double rate, Clock::time_point now, const std::string & why)
+	{
+		if (decisions.empty() || decisions.back().threads != threads)
+		{
+			decisions.push_back(Decision{ std::chrono::duration<double>(now - start).count(), threads, rate, why });
+		}
+		settled_rate = rate;
+		StartWindow(threads, now);
+	}
+
+	int max_threads;
+	Clock::time_point start;
+	std::vector<int> probes;
+	std::size_t probe = 0;
+	std::vector<std::pair<int, double>> rates;
+	std::string reason = "initial probe";
+	bool probing = true;
+	bool climbing = true;
+	bool paused = false;
+	int current = 1;
+	Clock::time_point settled;
+	double settled_rate = 0;
+	Clock::time_point window_start;
+	double window_bytes = 0;
+	int window_planes = 0;
+	std::vector<Decision> decisions;
+};
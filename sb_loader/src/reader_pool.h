@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "SBReadFile.h"
+
+// Open SlideBook readers kept for reuse, since opening a large .sld is
+// slow. Up to max_per_file readers of one file exist at once; Acquire()
+// hands out an idle one, opens another while under the limit, and otherwise
+// waits for one to come back. A returned reader is Clear()ed of any error
+// state (or closed if that fails), and readers idle for longer than the
+// time to live are closed on the next Acquire(), return or Evict().
+class ReaderPool
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats
+	{
+		UInt64 opened;
+		UInt64 reused;
+		UInt64 evicted;
+	};
+
+	explicit ReaderPool(int max_per_file = 8, std::chrono::seconds ttl = std::chrono::seconds(60))
+		: max_per_file(std::max(1, max_per_file))
+		, ttl(ttl)
+	{
+	}
+
+	ReaderPool(const ReaderPool &) = delete;
+	ReaderPool & operator=(const ReaderPool &) = delete;
+
+	// The pool the conversion, the read-ahead threads, the plane server and
+	// AsyncPlaneReader share. Never destroyed; Close() it before exit so
+	// that readers are not deleted after the reader library has gone.
+	static ReaderPool & Shared()
+	{
+		static ReaderPool * pool = new ReaderPool();
+		return *pool;
+	}
+
+	// A reader checked out of the pool, returned when destroyed.
+	class Lease
+	{
+	public:
+		Lease() {}
+		Lease(ReaderPool * pool, std::string filename, III::SBReadFile * reader, int generation)
+			: pool(pool)
+			, filename(std::move(filename))
+			, reader(reader)
+			, generation(generation)
+		{
+		}
+
+		Lease(Lease && other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		Lease & operator=(Lease && other) noexcept
+		{
+			if (this != &other)
+			{
+				Reset();
+				pool = std::exchange(other.pool, nullptr);
+				filename = std::move(other.filename);
+				reader = std::exchange(other.reader, nullptr);
+				generation = other.generation;
+			}
+			return *this;
+		}
+
+		~Lease()
+		{
+			Reset();
+		}
+
+		Lease(const Lease &) = delete;
+		Lease & operator=(const Lease &) = delete;
+
+		III::SBReadFile * Get() const
+		{
+			return reader;
+		}
+
+		III::SBReadFile * operator->() const
+		{
+			return reader;
+		}
+
+		void Reset()
+		{
+			if (pool != nullptr && reader != nullptr)
+			{
+				pool->Return(filename, reader, generation);
+			}
+			pool = nullptr;
+			reader = nullptr;
+		}
+
+	private:
+		ReaderPool * pool = nullptr;
+		std::string filename;
+		III::SBReadFile * reader = nullptr;
+		int generation = 0;
+	};
+
+	Lease Acquire(const std::string & filename)
+	{
+		Evict();
+		std::unique_lock<std::mutex> lock(mutex);
+		File & file = files[filename];
+		file.waiting++;
+		returned.wait(lock, [&] { return !file.idle.empty() || file.out < max_per_file; });
+		file.waiting--;
+		file.out++;
+		if (!file.idle.empty())
+		{
+			// the most recently used reader is the most likely to have its
+			// file still cached
+			III::SBReadFile * reader = file.idle.back().first;
+			file.idle.pop_back();
+			reused++;
+			return Lease(this, filename, reader, file.generation);
+		}
+		int generation = file.generation;
+		lock.unlock();
+		III::SBReadFile * reader;
+		try
+		{
+			reader = III_NewSBReadFile(filename.c_str(), III::kNoExceptionsMasked);
+		}
+		catch (...)
+		{
+			lock.lock();
+			file.out--;
+			lock.unlock();
+			returned.notify_all();
+			throw;
+		}
+		lock.lock();
+		opened++;
+		return Lease(this, filename, reader, generation);
+	}
+
+	// Closes readers idle for longer than the time to live.
+	void Evict()
+	{
+		DeleteReaders(TakeIdle(Clock::now()));
+	}
+
+	// Closes the readers of a file that has changed since they opened it:
+	// idle ones now, those out once returned.
+	void Discard(const std::string & filename)
+	{
+		std::vector<III::SBReadFile *> closing;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto file = files.find(filename);
+			if (file != files.end())
+			{
+				file->second.generation++;
+				for (auto & entry : file->second.idle)
+				{
+					closing.push_back(entry.first);
+				}
+				evicted += closing.size();
+				file->second.idle.clear();
+				Forget(file);
+			}
+		}
+		DeleteReaders(closing);
+	}
+
+	// Closes every idle reader.
+	void Close()
+	{
+		DeleteReaders(TakeIdle(Clock::time_point::max()));
+	}
+
+	void SetMaxPerFile(int count)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			max_per_file = std::max(1, count);
+		}
+		returned.notify_all();
+	}
+
+	int MaxPerFile()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return max_per_file;
+	}
+
+	void SetTimeToLive(std::chrono::seconds seconds)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ttl = seconds;
+	}
+
+	Stats GetStats()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return Stats{ opened, reused, evicted };
+	}
+
+private:
+	struct File
+	{
+		// least recently returned first
+		std::vector<std::pair<III::SBReadFile *, Clock::time_point>> idle;
+		int out = 0;
+		int waiting = 0;	// Acquire() calls holding on to the entry
+		int generation = 0;	// bumped by Discard()
+	};
+
+	void Return(const std::string & filename, III::SBReadFile * reader, int generation)
+	{
+		bool usable;
+		try
+		{
+			usable = reader->Clear();
+		}
+		catch (...)
+		{
+			usable = false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto file = files.find(filename);
+			file->second.out--;
+			usable = usable && generation == file->second.generation;
+			if (usable)
+			{
+				file->second.idle.emplace_back(reader, Clock::now());
+			}
+			Forget(file);
+		}
+		if (!usable)
+		{
+			III_DeleteSBReadFile(reader);
+		}
+		returned.notify_all();
+		Evict();
+	}
+
+	// Takes the readers idle past the time to live (all of them, with now
+	// time_point::max()) out of the pool, to be closed without the mutex:
+	// closing a large file can take a while.
+	std::vector<III::SBReadFile *> TakeIdle(Clock::time_point now)
+	{
+		std::vector<III::SBReadFile *> closing;
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto file = files.begin(); file != files.end();)
+		{
+			auto & idle = file->second.idle;
+			auto fresh = std::find_if(idle.begin(), idle.end(), [&](const std::pair<III::SBReadFile *, Clock::time_point> & entry)
+			{
+				return now != Clock::time_point::max() && now - entry.second < ttl;
+			});
+			for (auto stale = idle.begin(); stale != fresh; ++stale)
+			{
+				closing.push_back(stale->first);
+				evicted++;
+			}
+			idle.erase(idle.begin(), fresh);
+			file = Forget(file);
+		}
+		return closing;
+	}
+
+	// Called with the mutex held: drops the entry of a file with no readers
+	// left and no Acquire() waiting on it. Returns the entry after it.
+	std::map<std::string, File>::iterator Forget(std::map<std::string, File>::iterator file)
+	{
+		if (file->second.out == 0 && file->second.idle.empty() && file->second.waiting == 0)
+		{
+			return files.erase(file);
+		}
+		return std::next(file);
+	}
+
+	static void DeleteReaders(const std::vector<III::SBReadFile *> & readers)
+	{
+		for (auto reader : readers)
+		{
+			III_DeleteSBReadFile(reader);
+		}
+	}
+
+	int max_per_file;
+	std::chrono::seconds ttl;
+	std::mutex mutex;
+	std::condition_variable returned;
+	std::map<std::string, File> files;
+	UInt64 opened = 0;
+	UInt64 reused = 0;
+	UInt64 evicted = 0;
+};
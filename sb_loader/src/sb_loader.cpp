@@ -1,43 +1,390 @@
+#include <map>
+#include <set>
 #include "sb_loader.h"
+#include "async_reader.h"
+#include "aux_export.h"
+#include "background_transform.h"
+#include "binning_transform.h"
+#include "capture_output.h"
+#include "capture_view.h"
+#include "checkpoint_journal.h"
+#include "contrast_transform.h"
+#include "conversion_scheduler.h"
+#include "dimension_order.h"
+#include "flatfield_transform.h"
+#include "hash.h"
+#include "mosaic.h"
+#include "numa.h"
+#include "ordered_pipeline.h"
+#include "plane_assembler.h"
+#include "plane_cache.h"
+#include "plane_manifest.h"
+#include "plane_reader.h"
+#include "plane_server.h"
+#include "read_ahead.h"
+#include "reader_pool.h"
+#include "shm_ring.h"
+#include "watch_folder.h"
 
-void ConvertSBImages(const std::string & filename);
+bool ConvertSBImages(const ConvertOptions & options);
+
+// Plane stages selected on the command line, in the order they run.
+static TransformChain CreateTransforms(const ConvertOptions & options, const CaptureDataFrame & cp)
+{
+	TransformChain transforms;
+	if (!options.dark_frames.empty() || !options.flat_fields.empty())
+	{
+		transforms.Add(std::unique_ptr<PlaneTransform>(new FlatFieldTransform(
+			cp.channel_names, options.dark_frames, options.flat_fields)));
+	}
+	if (options.bin > 1)
+	{
+		transforms.Add(std::unique_ptr<PlaneTransform>(new BinningTransform(options.bin, options.bin_mean)));
+	}
+	if (options.background_radius > 0)
+	{
+		transforms.Add(std::unique_ptr<PlaneTransform>(new BackgroundTransform(options.background_radius)));
+	}
+	if (options.to_8bit)
+	{
+		transforms.Add(std::unique_ptr<PlaneTransform>(new ContrastTransform(
+			options.contrast_low, options.contrast_high, options.contrast_samples)));
+	}
+	return transforms;
+}
+
+// Every option that changes the bytes written, and the size and latest
+// modification time of the source and its .dir, so a checkpoint journal is
+// only resumed under the same key and never over a source that changed.
+static std::string JournalKey(const ConvertOptions & options)
+{
+	FileSignature source = FileSignature::Of(options.filename);
+	std::string key = fmt::format("{} source={}@{} format={} order={} bin={}{} background={}", util::FileStem(options.filename),
+		source.bytes, (long long)source.modified.time_since_epoch().count(),
+		options.format, options.order.String(), options.bin, options.bin_mean ? "" : "sum", options.background_radius);
+	for (auto & dark : options.dark_frames)
+	{
+		key += fmt::format(" dark:{}={}", dark.first, dark.second);
+	}
+	for (auto & flat : options.flat_fields)
+	{
+		key += fmt::format(" flat:{}={}", flat.first, flat.second);
+	}
+	if (options.to_8bit)
+	{
+		key += fmt::format(" 8bit={},{},{}", options.contrast_low, options.contrast_high, options.contrast_samples);
+	}
+	return key;
+}
+
+static DimensionPlan PlanCapture(const ConvertOptions & options, const CaptureDataFrame & cp, const PlaneShape & outShape)
+{
+	DimensionPlan plan(options.order, { cp.number_timepoints, cp.number_channels, cp.zDim, outShape.height, outShape.width },
+		outShape.pixel_bytes, options.direct);
+	if (options.read_direction != "auto")
+	{
+		plan.PreferFastest(options.read_direction == "z" ? AxisZ : AxisT);
+	}
+	return plan;
+}
+
+// Buffers a capture's conversion allocates from budget: whole blocks, when
+// planes are not written directly, and planes, at least as many as the
+// pipeline needs plus extraPlanes held by transform threads and read-ahead.
+// Direct output adds its own staging buffers, sized like the pool it writes.
+struct PoolSizes
+{
+	std::size_t blocks = 0;
+	std::size_t planes = 0;
+	std::size_t bytes = 0;	// both pools, as allocated
+};
+
+static PoolSizes SizePools(const DimensionPlan & plan, std::size_t planeBytes, std::size_t budget, std::size_t extraPlanes, std::size_t alignment)
+{
+	PoolSizes sizes;
+	std::size_t poolBytes = budget;
+	if (!plan.PlanesWrittenDirectly())
+	{
+		poolBytes /= 2;
+		sizes.blocks = std::max<std::size_t>(3, poolBytes / plan.BlockBytes());
+	}
+	// interleaving holds every channel of a plane at once
+	std::size_t minimumPlanes = (plan.InterleavesChannels() ? plan.BlockPlanes() + 2 : 4) + extraPlanes;
+	sizes.planes = std::max(minimumPlanes, poolBytes / planeBytes);
+	sizes.bytes = sizes.blocks * util::AlignUp(plan.BlockBytes(), alignment) + sizes.planes * util::AlignUp(planeBytes, alignment);
+	if (alignment == kDirectIoAlignment)
+	{
+		sizes.bytes += StackOutput::kStagingBuffers * util::AlignUp(sizes.blocks ? plan.BlockBytes() : planeBytes, alignment);
+	}
+	return sizes;
+}
+
+// A capture converting alongside others gets as its budget one time point,
+// xDim * yDim * zDim * channels, and a few planes, within the conversion's;
+// memory is what the pools sized from that budget take.
+struct CaptureMemory
+{
+	std::size_t budget;
+	std::size_t memory;
+
+	static CaptureMemory Of(const ConvertOptions & options, III::SBReadFile * reader, int capture, std::size_t budget,
+		bool planeWork, int transformThreads)
+	{
+		CaptureDataFrame cp(reader, capture, 0);
+		TransformChain transforms = CreateTransforms(options, cp);
+		PlaneShape rawShape = { cp.xDim, cp.yDim, sizeof(UInt16) };
+		PlaneShape outShape = transforms.OutputShape(rawShape);
+		planeWork = planeWork || (!transforms.Empty() && !options.output_dir.empty());
+		std::size_t planeBytes = rawShape.Bytes();
+		std::size_t wanted = std::min(budget, planeBytes * ((std::size_t)cp.zDim * cp.number_channels + 4));
+		std::size_t alignment = options.direct ? kDirectIoAlignment : 64;
+		PoolSizes sizes = SizePools(PlanCapture(options, cp, outShape), planeBytes, wanted, planeWork ? transformThreads : 0, alignment);
+		return CaptureMemory{ wanted, sizes.bytes };
+	}
+};
+
+// Output digests of the planes of a (t, c) unit seen so far.
+struct UnitProgress
+{
+	std::vector<UInt64> digests;
+	int planes = 0;
+};
 
 int main(int argc, char ** argv)
 {	
-	if (argc != 2)
+	ConvertOptions options;
+	try
 	{
-		fmt::print("filename requried\n {}", argc);
+		options = ParseOptions(argc, argv);
+	}
+	catch (const std::exception & e)
+	{
+		fmt::print("{}\n{}", e.what(), Usage());
 		EXIT(0);
 	}
-	std::string filename = argv[1];
+	ReaderPool::Shared().SetMaxPerFile(options.readers);
+	ReaderPool::Shared().SetTimeToLive(std::chrono::seconds(options.reader_ttl));
+	std::atexit([] { ReaderPool::Shared().Close(); });
 	fmt::print("Slidebook test converter v0.1\n");	
-	fmt::print("{}\n", filename);
-	ConvertSBImages(filename);
+	fmt::print("{}\n", options.filename);
+	if (options.command == "bench-writer")
+	{
+		BenchmarkPlaneWriters(options.filename, options.writer, options.direct, options.bench_planes, options.bench_width, options.bench_height);
+	}
+	else if (options.command == "bench-numa")
+	{
+		BenchmarkNumaPlacement(options.bench_planes, options.bench_width, options.bench_height);
+	}
+	else if (options.command == "bench-cache")
+	{
+		try
+		{
+			SBPlaneSource source(ReaderPool::Shared(), options.filename);
+			BenchmarkPlaneCache(source, (std::size_t)options.cache_mb << 20, options.prefetch_threads, options.prefetch_depth, options.sweeps);
+		}
+		catch (const III::Exception * e)
+		{
+			fmt::print("Failed with exception: {}\n", e->GetDescription());
+			delete e;
+			EXIT(1);
+		}
+	}
+	else if (options.command == "serve")
+	{
+		try
+		{
+			SBPlaneSource source(ReaderPool::Shared(), options.filename);
+			ReaderPool::Lease reader = ReaderPool::Shared().Acquire(options.filename);
+			std::vector<std::string> metadata;
+			for (int capture = 0; capture < source.Captures(); capture++)
+			{
+				metadata.push_back(CaptureDataFrame(reader.Get(), capture, 0).GetDetailJson());
+			}
+			reader.Reset();
+			std::string socket = options.socket.empty()
+				? fmt::format("/tmp/mloader-{}.sock", util::FileStem(options.filename)) : options.socket;
+			ServePlanes(source, metadata, socket, (std::size_t)options.cache_mb << 20, options.prefetch_threads, options.prefetch_depth);
+		}
+		catch (const III::Exception * e)
+		{
+			fmt::print("Failed with exception: {}\n", e->GetDescription());
+			delete e;
+			EXIT(1);
+		}
+		catch (const std::exception & e)
+		{
+			fmt::print("Failed with exception: {}\n", e.what());
+			EXIT(1);
+		}
+	}
+	else if (options.command == "bench-serve")
+	{
+		try
+		{
+			BenchmarkPlaneServer(options.filename, options.clients, options.requests);
+		}
+		catch (const std::exception & e)
+		{
+			fmt::print("Failed with exception: {}\n", e.what());
+			EXIT(1);
+		}
+	}
+	else if (options.command == "consume")
+	{
+		try
+		{
+			ConsumePlaneRing(options.filename);
+		}
+		catch (const std::exception & e)
+		{
+			fmt::print("Failed with exception: {}\n", e.what());
+			EXIT(1);
+		}
+	}
+	else if (options.command == "verify")
+	{
+		try
+		{
+			int failures = VerifySyntheticCaptureViews();
+			SBPlaneSource source(ReaderPool::Shared(), options.filename);
+			for (int capture = 0; capture < source.Captures(); capture++)
+			{
+				failures += VerifyCaptureViews(source, capture);
+			}
+			failures += VerifyAsyncReads(ReaderPool::Shared(), options.filename, std::max(1, ReaderPool::Shared().MaxPerFile() - 1));
+			// direct output needs a filesystem that takes O_DIRECT, tmpfs does not
+			failures += VerifyStagedOutput(options.output_dir.empty() ? std::filesystem::temp_directory_path().string() : options.output_dir,
+				options.writer);
+			fmt::print("{} failed checks\n", failures);
+			if (failures > 0)
+			{
+				EXIT(1);
+			}
+		}
+		catch (const III::Exception * e)
+		{
+			fmt::print("Failed with exception: {}\n", e->GetDescription());
+			delete e;
+			EXIT(1);
+		}
+		catch (const std::exception & e)
+		{
+			fmt::print("Failed with exception: {}\n", e.what());
+			EXIT(1);
+		}
+	}
+	else if (options.command == "watch")
+	{
+		int failures = WatchFolders(options, ConvertSBImages);
+		fmt::print("done, {} failed conversions\n", failures);
+		EXIT(failures == 0 ? 0 : 1);
+	}
+	else if (!ConvertSBImages(options))
+	{
+		EXIT(1);
+	}
 	fmt::print("done\n");
 	EXIT(0);
 }
 
-void ConvertSBImages(const std::string & filename) try
+// Converts options.filename; failures are reported and return false.
+bool ConvertSBImages(const ConvertOptions & options) try
 {
 	
-	auto sb_read_file = III_NewSBReadFile(filename.c_str(), III::kNoExceptionsMasked);		
+	// bound first, so that every thread and buffer of the conversion follows;
+	// with auto and captures converting at once each capture is bound instead
+	const bool numaAuto = options.numa == "auto" && util::NumaNodes().size() > 1;
+	const bool numaPerCapture = numaAuto && options.capture_jobs > 1;
+	std::unique_ptr<NumaBinding> numa;
+	if (options.numa == "auto" ? numaAuto && !numaPerCapture : options.numa != "off")
+	{
+		numa.reset(new NumaBinding(options.numa == "auto" ? NumaBinding::NextNode() : std::stoi(options.numa)));
+		fmt::print("running on NUMA node {}\n", numa->Node());
+	}
+
+	ReaderPool::Lease lease = ReaderPool::Shared().Acquire(options.filename);
+	III::SBReadFile * fileReader = lease.Get();
 	fmt::print("sb file loaded\n");
 	
-	auto captures = sb_read_file->GetNumCaptures();
+	auto captures = fileReader->GetNumCaptures();
 	fmt::print("captures: {}\n", captures);
 	
 	const int Dimension = 3;
 
-	CaptureIndex number_captures = sb_read_file->GetNumCaptures();
-	for (int capture_index = 0; capture_index < number_captures; capture_index++)
+	std::unique_ptr<PlaneManifest> manifest;
+	if (!options.manifest.empty())
 	{
+		manifest.reset(new PlaneManifest(options.manifest));
+	}
+	std::unique_ptr<CheckpointJournal> journal;
+	if (options.resume)
+	{
+		journal.reset(new CheckpointJournal(fmt::format("{}/{}.journal", options.output_dir, util::FileStem(options.filename)),
+			JournalKey(options)));
+	}
+	std::unique_ptr<PlaneRing> ring;
+	if (!options.stream.empty())
+	{
+		// no stage makes a plane larger than it was read
+		std::size_t largest = 0;
+		for (CaptureIndex capture = 0; capture < captures; capture++)
+		{
+			largest = std::max(largest, (std::size_t)fileReader->GetNumXColumns(capture) * fileReader->GetNumYRows(capture) * sizeof(UInt16));
+		}
+		ring.reset(new PlaneRing(PlaneRing::Create(options.stream, options.stream_slots, largest)));
+		fmt::print("streaming planes to {} in {} slots, waiting for {} consumer{}\n", options.stream, options.stream_slots,
+			options.stream_consumers, options.stream_consumers == 1 ? "" : "s");
+		ring->WaitForConsumers(options.stream_consumers);
+	}
+	// captures convert at once each on a reader of its own, the conversion
+	// keeping one; one at a time when streaming, as the ring is in order
+	int captureJobs = std::min(options.capture_jobs, ReaderPool::Shared().MaxPerFile() - 1);
+	captureJobs = std::max(1, std::min<int>(captureJobs, captures));
+	if (ring)
+	{
+		captureJobs = 1;
+	}
+
+	std::unique_ptr<ReadAhead> planesAhead;
+	if (captureJobs == 1 && (options.read_ahead > 0 || options.read_tune))
+	{
+		int threads = options.read_threads;
+		int depth = options.read_ahead;
+		if (options.read_tune)
+		{
+			// the conversion holds one reader of the file itself
+			threads = std::min((int)std::max(1u, std::thread::hardware_concurrency()), ReaderPool::Shared().MaxPerFile() - 1);
+			depth = std::max(depth, threads);
+		}
+		planesAhead.reset(new ReadAhead(ReaderPool::Shared(), options.filename, threads, depth, options.read_tune));
+		fmt::print("reading {} planes ahead on {} threads{}\n", planesAhead->Depth(), planesAhead->Threads(),
+			planesAhead->Tuned() ? ", tuning how many read at once" : "");
+	}
+
+	CaptureIndex number_captures = fileReader->GetNumCaptures();
+	// Converts one capture on the given reader and read-ahead (or none), with
+	// poolBudget for its planes in flight.
+	auto convertCapture = [&](int capture_index, III::SBReadFile * sb_read_file, ReadAhead * readAhead, std::size_t poolBudget, int transformThreads)
+	{
+		std::unique_ptr<NumaBinding> captureNuma;
+		if (numaPerCapture)
+		{
+			captureNuma.reset(new NumaBinding(NumaBinding::NextNode()));
+			fmt::print("running capture {} on NUMA node {}\n", capture_index, captureNuma->Node());
+		}
+		NumaBinding * node = numa ? numa.get() : captureNuma.get();
 		CaptureDataFrame cp(sb_read_file, capture_index, 0);
 		fmt::print("{}\n", cp.GetHeader(capture_index, cp.position_index));
+		if (options.aux)
+		{
+			std::string directory = fmt::format("{}/{}_{}_aux", options.output_dir, util::FileStem(options.filename), cp.GetCaptureIndexString());
+			int channels = ExportAuxData(sb_read_file, capture_index, directory);
+			fmt::print("auxiliary data: {} channel{} to {}\n", channels, channels == 1 ? "" : "s", directory);
+		}
 		
 		using PixelType = UInt16;
 		std::size_t planeSize = cp.xDim * cp.yDim;
-		int bufferSize = cp.xDim * cp.yDim * cp.zDim;
-		PixelType * buffer = new UInt16[bufferSize];
+		std::size_t planeBytes = planeSize * sizeof(PixelType);
 		
 		int cappedTime = cp.number_timepoints;
 		/*		
@@ -47,27 +394,350 @@ void ConvertSBImages(const std::string & filename) try
 		}
 		*/
 
-		for (int timepoint_index = 0; timepoint_index < cappedTime; timepoint_index++)
+		TransformChain transforms = CreateTransforms(options, cp);
+		if (options.bin > 1)
+		{
+			// binned pixels cover bin x bin raw pixels
+			cp.voxel_size[0] *= options.bin;
+			cp.voxel_size[1] *= options.bin;
+		}
+		PlaneShape rawShape = { cp.xDim, cp.yDim, sizeof(PixelType) };
+		PlaneShape outShape = transforms.OutputShape(rawShape);
+		// stages, hashing and streaming run per plane on the transform threads
+		const bool stages = !transforms.Empty() && (!options.output_dir.empty() || ring);
+		const bool planeWork = manifest || journal || ring || stages;
+		if (stages)
+		{
+			transforms.Prepare([&](int position_index, const PlaneCoord & p, UInt16 * buffer)
+			{
+				sb_read_file->ReadImagePlaneBuf(buffer, capture_index, position_index, p.t, p.z, p.c);
+			}, cp.number_positions, { cappedTime, cp.number_channels, cp.zDim, cp.yDim, cp.xDim });
+			fmt::print("plane stages: {} on {} threads\n", transforms.Describe(), transformThreads);
+		}
+
+		if (options.mosaic && cp.number_positions > 1)
 		{
-			cp.timepoint_index = timepoint_index;
-			for (int c = 0; c < cp.number_channels; c++)
+			MosaicLayout layout = MosaicLayout::Of(sb_read_file, capture_index, outShape.width, outShape.height,
+				cp.voxel_size, cp.has_voxel_size, options.mosaic_placement, options.mosaic_overlap);
+			fmt::print("{}\n", layout.Describe());
+			auto extra = transforms.Metadata();
+			extra.insert(extra.begin(), { "axes", util::JsonString("TCZYX") });
+			MosaicWriter mosaic(fmt::format("{}/{}_{}_mosaic.zarr", options.output_dir, util::FileStem(options.filename), cp.GetCaptureIndexString()),
+				layout, { cappedTime, cp.number_channels, cp.zDim }, outShape.pixel_bytes, options.mosaic_chunk, options.mosaic_blend,
+				cp.GetDetailJson(extra, outShape.width, outShape.height));
+			PlanePool tilePool(planeBytes, 1);
+			PlaneBuffer tile = tilePool.Acquire();
+			for (int t = 0; t < cappedTime; t++)
 			{
-				cp.channels_index = c;
-				for (int z = 0; z < cp.zDim; z++)
+				for (int c = 0; c < cp.number_channels; c++)
 				{
-					sb_read_file->ReadImagePlaneBuf(buffer + (z * planeSize), capture_index, 0, timepoint_index, z, c);
+					for (int z = 0; z < cp.zDim; z++)
+					{
+						PlaneCoord p = { t, c, z };
+						for (std::size_t i = 0; i < layout.tiles.size(); i++)
+						{
+							sb_read_file->ReadImagePlaneBuf(tile.As<PixelType>(), capture_index, layout.tiles[i].position, t, z, c);
+							if (stages)
+							{
+								transforms.Apply(tile.data, rawShape, p);
+							}
+							mosaic.Add(p, i, tile.data);
+						}
+					}
+					fmt::print("stitched capture: {} time: {} channel: {}\n", capture_index, t, c);
 				}
-				fmt::print("read buffer capture: {} time: {} channel: {}\n", capture_index, timepoint_index, c);				
+			}
+			fmt::print("wrote {} chunks to {}, holding at most {:.1f} MiB of them\n", mosaic.ChunksWritten(), mosaic.Path(),
+				mosaic.PeakBytes() / double(1 << 20));
+			return;
+		}
+
+		DimensionPlan plan = PlanCapture(options, cp, outShape);
+		fmt::print("{}\n", plan.Describe());
+
+		// direct output needs block aligned buffers; the pools round sizes up
+		std::size_t alignment = options.direct ? kDirectIoAlignment : 64;
+		std::size_t extraPlanes = (planeWork ? transformThreads : 0) + (readAhead ? readAhead->Depth() : 0);
+		PoolSizes sizes = SizePools(plan, planeBytes, poolBudget, extraPlanes, alignment);
+		std::unique_ptr<PlanePool> blockPool;
+		if (sizes.blocks > 0)
+		{
+			blockPool.reset(new PlanePool(plan.BlockBytes(), sizes.blocks, alignment));
+		}
+		PlanePool pool(planeBytes, sizes.planes, alignment);
+		if (node)
+		{
+			// pages freed by a conversion on another node may be reused
+			pool.PlaceOnNode(node->Node());
+			if (blockPool)
+			{
+				blockPool->PlaceOnNode(node->Node());
 			}
 		}
-		delete[] buffer;
+		PlanePool & writePool = blockPool ? *blockPool : pool;
+		auto writer = CreatePlaneWriter(options.writer, writePool);
+
+		for (int position_index = 0; position_index < cp.number_positions; position_index++)
+		{
+			cp.position_index = position_index;
+
+			// units a previous run completed, checked against the output on disk
+			std::set<std::pair<int, int>> completed;
+			if (journal)
+			{
+				std::string path = CaptureOutputPath(options, cp);
+				UInt64 dataOffset = options.format == "npy" ? NpyDataOffset(path) : 0;
+				UInt64 digest;
+				const UInt64 * recorded = journal->Find(capture_index, position_index, -1, -1);
+				bool stackDone = recorded && CheckpointJournal::StackDigest(path, dataOffset, plan, digest) && digest == *recorded;
+				for (int t = 0; t < cappedTime; t++)
+				{
+					for (int c = 0; c < cp.number_channels; c++)
+					{
+						recorded = journal->Find(capture_index, position_index, t, c);
+						if (stackDone || (recorded && plan.PlanesWrittenDirectly()
+							&& CheckpointJournal::VerifyUnit(path, dataOffset, plan, t, c, *recorded)))
+						{
+							completed.insert(std::make_pair(t, c));
+						}
+					}
+				}
+				if (completed.size() == (std::size_t)cappedTime * cp.number_channels)
+				{
+					fmt::print("{} is complete, skipping\n", path);
+					continue;
+				}
+				if (!completed.empty())
+				{
+					fmt::print("{}: {} of {} time point and channel stacks verified, resuming\n", path,
+						completed.size(), cappedTime * cp.number_channels);
+				}
+			}
+
+			std::unique_ptr<StackOutput> output;
+			if (!options.output_dir.empty())
+			{
+				output = OpenCaptureOutput(options, cp, plan, transforms, *writer, writePool, !completed.empty());
+				fmt::print("writing {} with {} writer{}\n", output->Path(), writer->Name(), output->IsDirect() ? " (direct)" : "");
+			}
+
+			std::unique_ptr<PlaneAssembler> assembler;
+			if (output)
+			{
+				assembler.reset(new PlaneAssembler(plan, *output, writePool));
+			}
+			// declared last so that on failure it drains before the assembler goes
+			std::map<std::pair<int, int>, UnitProgress> units;
+			util::OrderedPipeline pipeline(planeWork ? transformThreads : 0);
+			std::vector<PlaneCoord> sequence;
+			for (const PlaneCoord & p : plan.ReadSequence())
+			{
+				if (!completed.count(std::make_pair(p.t, p.c)))
+				{
+					sequence.push_back(p);
+				}
+			}
+			PlaneReader reader(sb_read_file, readAhead);
+			auto progress = [&](const PlaneCoord & p)
+			{
+				if (p.z == cp.zDim - 1)
+				{
+					fmt::print("read buffer capture: {} position: {} time: {} channel: {}\n", capture_index, position_index, p.t, p.c);
+				}
+			};
+			if (assembler && plan.ReadsIntoBlock() && !planeWork && !readAhead)
+			{
+				// the block layout keeps rows contiguous, read straight into it
+				for (const PlaneCoord & p : reader.PlanesInto(capture_index, position_index, sequence,
+					[&](const PlaneCoord & p) { return (PixelType *)assembler->ReadTarget(p); }, plan.RowStrideBytes()))
+				{
+					cp.timepoint_index = p.t;
+					cp.channels_index = p.c;
+					assembler->Added(p);
+					progress(p);
+				}
+			}
+			else
+			{
+				// leaving the loop stops any reading ahead before the pipeline drains
+				for (PlaneRead & plane : reader.Planes(capture_index, position_index, sequence, pool))
+				{
+					const PlaneCoord p = plane.coord;
+					cp.timepoint_index = p.t;
+					cp.channels_index = p.c;
+					auto buffer = std::make_shared<PlaneBuffer>(std::move(plane.buffer));
+					if (planeWork)
+					{
+						// stages run on the transform threads while the next planes are read
+						auto hashes = std::make_shared<std::pair<UInt64, UInt64>>();
+						pipeline.Submit([&, buffer, hashes, p]
+						{
+							// first: raw digest, second: digest of the bytes written
+							if (manifest || (journal && !stages))
+							{
+								hashes->first = util::Hash64(buffer->data, rawShape.Bytes());
+							}
+							if (stages)
+							{
+								transforms.Apply(buffer->data, rawShape, p);
+								if (manifest || journal)
+								{
+									hashes->second = util::Hash64(buffer->data, outShape.Bytes());
+								}
+							}
+							else
+							{
+								hashes->second = hashes->first;
+							}
+						}, [&, buffer, hashes, p]
+						{
+							if (manifest)
+							{
+								manifest->Add(capture_index, position_index, p, hashes->first, stages ? &hashes->second : nullptr);
+							}
+							if (ring)
+							{
+								RingPlaneHeader header = {};
+								header.capture = capture_index;
+								header.position = position_index;
+								header.t = p.t;
+								header.c = p.c;
+								header.z = p.z;
+								header.width = outShape.width;
+								header.height = outShape.height;
+								header.pixel_bytes = (SInt32)outShape.pixel_bytes;
+								header.bytes = outShape.Bytes();
+								std::copy(cp.voxel_size, cp.voxel_size + 3, header.voxel_size);
+								ring->Publish(header, buffer->data);
+							}
+							if (assembler)
+							{
+								assembler->Add(std::move(*buffer), p);
+							}
+							if (journal && plan.PlanesWrittenDirectly())
+							{
+								auto & unit = units[std::make_pair(p.t, p.c)];
+								unit.digests.resize(cp.zDim);
+								unit.digests[p.z] = hashes->second;
+								if (++unit.planes == cp.zDim)
+								{
+									output->Sync();
+									journal->Record(capture_index, position_index, p.t, p.c, CheckpointJournal::Digest(unit.digests));
+									units.erase(std::make_pair(p.t, p.c));
+								}
+							}
+						});
+					}
+					else if (assembler)
+					{
+						assembler->Add(std::move(*buffer), p);
+					}
+					progress(p);
+				}
+			}
+			pipeline.Wait();
+			if (output)
+			{
+				output->Finish();
+			}
+			if (journal && !plan.PlanesWrittenDirectly())
+			{
+				UInt64 digest;
+				output->Sync();
+				if (!CheckpointJournal::StackDigest(output->Path(), output->data_offset, plan, digest))
+				{
+					throw std::runtime_error(fmt::format("unable to read back {}", output->Path()));
+				}
+				journal->Record(capture_index, position_index, -1, -1, digest);
+			}
+		}
+		writer->Flush();
 	
+	};
+
+	if (captureJobs == 1)
+	{
+		for (int capture_index = 0; capture_index < number_captures; capture_index++)
+		{
+			convertCapture(capture_index, fileReader, planesAhead.get(), (std::size_t)options.pool_mb << 20, options.transform_threads);
+		}
 	}
+	else
+	{
+		// largest first into the pool budget, smaller captures filling the gaps;
+		// a capture larger than the budget runs alone
+		const std::size_t budget = (std::size_t)options.pool_mb << 20;
+		const int transformThreads = std::max(1, options.transform_threads / captureJobs);
+		std::vector<std::pair<CaptureMemory, int>> estimates;
+		for (int capture_index = 0; capture_index < number_captures; capture_index++)
+		{
+			estimates.push_back(std::make_pair(CaptureMemory::Of(options, fileReader, capture_index, budget,
+				manifest || journal, transformThreads), capture_index));
+		}
+		std::stable_sort(estimates.begin(), estimates.end(), [](const std::pair<CaptureMemory, int> & a, const std::pair<CaptureMemory, int> & b)
+		{
+			return a.first.memory > b.first.memory;
+		});
+		fmt::print("converting {} captures up to {} at once in {} MB{}\n", number_captures, captureJobs, options.pool_mb,
+			options.read_ahead > 0 || options.read_tune ? ", without reading ahead" : "");
+
+		ConversionScheduler scheduler(captureJobs, budget, true);
+		for (auto & estimate : estimates)
+		{
+			const int capture_index = estimate.second;
+			const std::size_t captureBudget = estimate.first.budget;
+			scheduler.Submit(fmt::format("capture {}", capture_index), estimate.first.memory, [&, capture_index, captureBudget]
+			{
+				try
+				{
+					ReaderPool::Lease reader = ReaderPool::Shared().Acquire(options.filename);
+					convertCapture(capture_index, reader.Get(), nullptr, captureBudget, transformThreads);
+				}
+				catch (const III::Exception * e)
+				{
+					std::string description = e->GetDescription();
+					delete e;
+					throw std::runtime_error(description);
+				}
+			});
+		}
+		scheduler.Wait();
+		if (scheduler.Failures() > 0)
+		{
+			throw std::runtime_error(fmt::format("{} of {} captures failed", scheduler.Failures(), number_captures));
+		}
+	}
+	if (manifest)
+	{
+		manifest->Close();
+		fmt::print("manifest {}: {} duplicate planes\n", manifest->Path(), manifest->Duplicates());
+	}
+	if (planesAhead && planesAhead->Tuned())
+	{
+		auto decisions = planesAhead->TuningDecisions();
+		if (decisions.empty())
+		{
+			fmt::print("read threads: too few planes to tune, ended on {}\n", planesAhead->ActiveThreads());
+		}
+		else
+		{
+			fmt::print("read threads: settled on {}\n", decisions.back().threads);
+			for (auto & decision : decisions)
+			{
+				fmt::print("  {:6.1f}s  {} at {:.1f} MB/s ({})\n", decision.seconds, decision.threads, decision.mb_per_second, decision.reason);
+			}
+		}
+	}
+	return true;
 }
 catch (const III::Exception * e)
 {
 	fmt::print("Failed with exception: {}\n", e->GetDescription());	
-	std::string inString;
-	EXIT(1);
 	delete e;
-}
\ No newline at end of file
+	return false;
+}
+catch (const std::exception & e)
+{
+	fmt::print("Failed with exception: {}\n", e.what());
+	return false;
+}
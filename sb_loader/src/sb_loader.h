@@ -164,6 +164,37 @@ public:
 		return metaData;
 	}
 
+	// GetDetail as a JSON object, for sidecar files next to converted data.
+	// extra holds additional members as name and JSON value pairs; width and
+	// height, when given, are the image size written, e.g. once binned.
+	std::string GetDetailJson(const std::vector<std::pair<std::string, std::string>> & extra = {}, int width = 0, int height = 0)
+	{
+		std::string json = "{\n";
+		json += fmt::format("  \"image_name\": {},\n", util::JsonString(image_name));
+		json += fmt::format("  \"capture_index\": {},\n", capture_index);
+		json += fmt::format("  \"position_index\": {},\n", position_index);
+		json += fmt::format("  \"image_size\": [{}, {}, {}],\n", width ? width : xDim, height ? height : yDim, zDim);
+		json += fmt::format("  \"timepoints\": {},\n", number_timepoints);
+		json += fmt::format("  \"voxel_size\": [{}, {}, {}],\n", voxel_size[0], voxel_size[1], voxel_size[2]);
+		json += fmt::format("  \"voxel_size_defined\": {},\n", has_voxel_size ? "true" : "false");
+		json += fmt::format("  \"image_comments\": {},\n", util::JsonString(image_comments));
+		json += fmt::format("  \"capture_date\": {},\n", util::JsonString(capture_date));
+		json += fmt::format("  \"lens_name\": {},\n", util::JsonString(lens_name));
+		json += "  \"channels\": [\n";
+		for (int c = 0; c < number_channels; c++)
+		{
+			json += fmt::format("    {{\"name\": {}, \"exposure_time_ms\": {}}}{}\n",
+				util::JsonString(channel_names[c]), exposure_time[c], c + 1 < number_channels ? "," : "");
+		}
+		json += "  ]";
+		for (auto & member : extra)
+		{
+			json += fmt::format(",\n  {}: {}", util::JsonString(member.first), member.second);
+		}
+		json += "\n}\n";
+		return json;
+	}
+
 	std::string GetCaptureIndexString()
 	{
 		return capture_index_fmt.string(capture_index);
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "fmt/format.h"
+#include "shm_ring.h"
+
+#ifdef __linux__
+
+void ConsumePlaneRing(const std::string & name)
+{
+	// the consumer usually starts first and waits for the converter
+	fmt::print("waiting for plane ring {}\n", name);
+	PlaneRing ring = [&]
+	{
+		for (;;)
+		{
+			try
+			{
+				return PlaneRing::Open(name);
+			}
+			catch (const std::runtime_error &)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+		}
+	}();
+	ring.Attach();
+	fmt::print("attached, {} byte slots\n", ring.SlotBytes());
+
+	std::vector<UInt8> buffer(ring.SlotBytes());
+	RingPlaneHeader header;
+	UInt64 planes = 0;
+	UInt64 bytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (ring.Next(header, buffer.data()))
+	{
+		UInt64 pixels = (UInt64)header.width * header.height;
+		UInt32 low = ~0u;
+		UInt32 high = 0;
+		double sum = 0;
+		for (UInt64 i = 0; i < pixels; i++)
+		{
+			UInt32 v = header.pixel_bytes == 1 ? buffer[i] : ((const UInt16 *)buffer.data())[i];
+			low = std::min(low, v);
+			high = std::max(high, v);
+			sum += v;
+		}
+		fmt::print("#{} capture {} position {} t {} c {} z {}: {}x{}, min {} max {} mean {:.1f}\n", header.sequence,
+			header.capture, header.position, header.t, header.c, header.z, header.width, header.height,
+			pixels ? low : 0, high, pixels ? sum / pixels : 0.0);
+		planes++;
+		bytes += header.bytes;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fmt::print("{} planes, {:.1f} planes/s, {:.1f} MiB/s\n", planes, planes / seconds, bytes / seconds / (1 << 20));
+}
+
+#else
+
+void ConsumePlaneRing(const std::string &)
+{
+	throw std::runtime_error("consume needs Linux (POSIX shared memory)");
+}
+
+#endif
@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "fmt/format.h"
+#include "SBReadFile.h"
+
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <signal.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// Description of a plane published on a PlaneRing.
+struct RingPlaneHeader
+{
+	UInt64 sequence;	// planes published before this one
+	SInt32 capture;
+	SInt32 position;
+	SInt32 t;
+	SInt32 c;
+	SInt32 z;
+	SInt32 width;
+	SInt32 height;
+	SInt32 pixel_bytes;
+	UInt64 bytes;		// pixels following the header
+	float voxel_size[3];	// X, Y, Z in microns
+	UInt32 reserved;
+};
+
+#ifdef __linux__
+
+// Broadcast ring of planes in POSIX shared memory, from one producer (the
+// converter) to any number of consumer processes, up to kMaxConsumers.
+//
+// Every consumer sees every plane published after it attached. The producer
+// publishes by bumping head once a slot is written; each consumer owns a
+// cursor it bumps once done with a slot. There are no locks: the producer
+// only waits (back-pressure) while the slowest consumer is a whole ring
+// behind, and consumers only wait for head. A consumer whose process has
+// gone is detached by the producer, so it cannot stall the conversion.
+class PlaneRing
+{
+public:
+	static constexpr int kMaxConsumers = 16;
+
+	// Creates the ring as the producer, replacing any stale one of the
+	// same name. Removed again when the producer goes.
+	static PlaneRing Create(const std::string & name, std::size_t slot_count, std::size_t slot_bytes)
+	{
+		std::string path = Path(name);
+		shm_unlink(path.c_str());
+		int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0)
+		{
+			throw std::runtime_error(fmt::format("unable to create shared memory {}: {}", path, strerror(errno)));
+		}
+		slot_count = std::max<std::size_t>(1, slot_count);
+		std::size_t stride = SlotStride(slot_bytes);
+		std::size_t bytes = sizeof(Layout) + slot_count * stride;
+		if (ftruncate(fd, (off_t)bytes) != 0)
+		{
+			std::string error = strerror(errno);
+			close(fd);
+			shm_unlink(path.c_str());
+			throw std::runtime_error(fmt::format("unable to size shared memory {}: {}", path, error));
+		}
+		PlaneRing ring(path, fd, bytes, true);
+		Layout * layout = ring.layout;
+		layout->version = kVersion;
+		layout->slot_count = slot_count;
+		layout->slot_bytes = slot_bytes;
+		layout->slot_stride = stride;
+		for (auto & consumer : layout->consumers)
+		{
+			consumer.cursor.store(kFree);
+			consumer.pid.store(0);
+		}
+		// consumers check the magic last
+		layout->magic.store(kMagic, std::memory_order_release);
+		return ring;
+	}
+
+	// Opens an existing ring as a consumer; see Attach().
+	static PlaneRing Open(const std::string & name)
+	{
+		std::string path = Path(name);
+		int fd = shm_open(path.c_str(), O_RDWR, 0);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) != 0 || (std::size_t)status.st_size < sizeof(Layout))
+		{
+			std::string error = fd < 0 ? strerror(errno) : "not a plane ring";
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			throw std::runtime_error(fmt::format("unable to open shared memory {}: {}", path, error));
+		}
+		PlaneRing ring(path, fd, (std::size_t)status.st_size, false);
+		if (ring.layout->magic.load(std::memory_order_acquire) != kMagic || ring.layout->version != kVersion)
+		{
+			throw std::runtime_error(fmt::format("{} is not a plane ring", path));
+		}
+		return ring;
+	}
+
+	PlaneRing(PlaneRing && other) noexcept
+		: path(std::move(other.path))
+		, layout(other.layout)
+		, bytes(other.bytes)
+		, producer(other.producer)
+		, consumer(other.consumer)
+	{
+		other.layout = nullptr;
+	}
+
+	~PlaneRing()
+	{
+		if (layout == nullptr)
+		{
+			return;
+		}
+		if (producer)
+		{
+			Close();
+			shm_unlink(path.c_str());
+		}
+		Detach();
+		munmap(layout, bytes);
+	}
+
+	PlaneRing(const PlaneRing &) = delete;
+	PlaneRing & operator=(const PlaneRing &) = delete;
+	PlaneRing & operator=(PlaneRing &&) = delete;
+
+	std::size_t SlotBytes() const
+	{
+		return layout->slot_bytes;
+	}
+
+	// Producer: consumers currently attached.
+	int Consumers()
+	{
+		int count = 0;
+		for (auto & entry : layout->consumers)
+		{
+			count += entry.cursor.load(std::memory_order_acquire) != kFree ? 1 : 0;
+		}
+		return count;
+	}
+
+	// Producer: waits until count consumers are attached, so that none of
+	// them misses the first planes.
+	void WaitForConsumers(int count)
+	{
+		Backoff backoff;
+		while (Consumers() < count)
+		{
+			backoff.Wait();
+		}
+	}
+
+	// Producer: copies the plane into the next slot, waiting while that
+	// slot is still being read.
+	void Publish(RingPlaneHeader header, const void * pixels)
+	{
+		if (header.bytes > layout->slot_bytes)
+		{
+			throw std::runtime_error(fmt::format("plane of {} bytes exceeds the {} byte ring slots", header.bytes, layout->slot_bytes));
+		}
+		UInt64 head = layout->head.load(std::memory_order_relaxed);
+		Backoff backoff;
+		while (!Writable(head))
+		{
+			if (backoff.Wait())
+			{
+				DetachDeadConsumers();
+			}
+		}
+		Slot slot = SlotAt(head);
+		header.sequence = head;
+		slot.header->sequence.store(~0ull, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memcpy(&slot.header->plane, &header, sizeof(header));
+		std::memcpy(slot.pixels, pixels, header.bytes);
+		slot.header->sequence.store(head, std::memory_order_release);
+		layout->head.store(head + 1);
+	}
+
+	// Producer: no more planes; consumers stop once they have read the rest.
+	void Close()
+	{
+		layout->closed.store(1, std::memory_order_release);
+	}
+
+	// Consumer: takes a cursor, starting at the next plane published.
+	void Attach()
+	{
+		for (int i = 0; i < kMaxConsumers; i++)
+		{
+			auto & entry = layout->consumers[i];
+			UInt64 expected = kFree;
+			if (entry.cursor.compare_exchange_strong(expected, layout->head.load()))
+			{
+				// the producer may have moved on before it saw the entry; any
+				// plane after the head read now is held back for us
+				entry.cursor.store(layout->head.load());
+				entry.pid.store((SInt32)getpid());
+				consumer = i;
+				return;
+			}
+		}
+		throw std::runtime_error(fmt::format("{} already has {} consumers", path, kMaxConsumers));
+	}
+
+	void Detach()
+	{
+		if (consumer >= 0)
+		{
+			// pid first, so the entry is never taken for its next owner's
+			layout->consumers[consumer].pid.store(0);
+			layout->consumers[consumer].cursor.store(kFree);
+			consumer = -1;
+		}
+	}
+
+	// Consumer: waits for the next plane and copies its pixels to buffer,
+	// SlotBytes() long. Returns false once the producer has closed the ring
+	// and every plane has been read.
+	bool Next(RingPlaneHeader & header, void * buffer)
+	{
+		auto & entry = layout->consumers[consumer];
+		UInt64 cursor = entry.cursor.load(std::memory_order_relaxed);
+		if (cursor == kFree)
+		{
+			throw std::runtime_error("detached from the plane ring by the producer");
+		}
+		Backoff backoff;
+		while (layout->head.load(std::memory_order_acquire) <= cursor)
+		{
+			if (layout->closed.load(std::memory_order_acquire) && layout->head.load(std::memory_order_acquire) <= cursor)
+			{
+				return false;
+			}
+			backoff.Wait();
+		}
+		Slot slot = SlotAt(cursor);
+		std::memcpy(&header, &slot.header->plane, sizeof(header));
+		std::memcpy(buffer, slot.pixels, std::min<UInt64>(header.bytes, layout->slot_bytes));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.header->sequence.load(std::memory_order_relaxed) != cursor)
+		{
+			// only a producer that took us for dead overwrites unread slots
+			throw std::runtime_error("plane ring overrun");
+		}
+		entry.cursor.store(cursor + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	static constexpr UInt64 kMagic = 0x474e495220534c4dull;	// "MLS RING"
+	static constexpr UInt32 kVersion = 1;
+	static constexpr UInt64 kFree = ~0ull;
+
+	static_assert(std::atomic<UInt64>::is_always_lock_free, "the ring needs lock free 64 bit atomics");
+
+	struct alignas(64) Consumer
+	{
+		std::atomic<UInt64> cursor;	// next plane to read, kFree when unused
+		std::atomic<SInt32> pid;
+	};
+
+	struct Layout
+	{
+		std::atomic<UInt64> magic;
+		UInt32 version;
+		UInt32 reserved;
+		UInt64 slot_count;
+		UInt64 slot_bytes;
+		UInt64 slot_stride;
+		alignas(64) std::atomic<UInt64> head;	// planes published
+		std::atomic<UInt32> closed;
+		Consumer consumers[kMaxConsumers];
+	};
+
+	struct alignas(64) SlotHeader
+	{
+		std::atomic<UInt64> sequence;	// ~0 while being written
+		RingPlaneHeader plane;
+	};
+
+	struct Slot
+	{
+		SlotHeader * header;
+		UInt8 * pixels;
+	};
+
+	// Sleeps progressively longer; returns true about once a second.
+	class Backoff
+	{
+	public:
+		bool Wait()
+		{
+			if (spins < 64)
+			{
+				spins++;
+				std::this_thread::yield();
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			return ++sleeps % 10000 == 0;
+		}
+
+	private:
+		int spins = 0;
+		int sleeps = 0;
+	};
+
+	PlaneRing(const std::string & path, int fd, std::size_t bytes, bool producer)
+		: path(path)
+		, bytes(bytes)
+		, producer(producer)
+	{
+		void * mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		std::string error = strerror(errno);
+		close(fd);
+		if (mapped == MAP_FAILED)
+		{
+			if (producer)
+			{
+				shm_unlink(path.c_str());
+			}
+			throw std::runtime_error(fmt::format("unable to map shared memory {}: {}", path, error));
+		}
+		layout = (Layout *)mapped;
+	}
+
+	static std::string Path(const std::string & name)
+	{
+		return name.empty() || name[0] != '/' ? "/" + name : name;
+	}
+
+	static std::size_t SlotStride(std::size_t slot_bytes)
+	{
+		return (sizeof(SlotHeader) + slot_bytes + 63) / 64 * 64;
+	}
+
+	Slot SlotAt(UInt64 sequence) const
+	{
+		UInt8 * base = (UInt8 *)(layout + 1) + (sequence % layout->slot_count) * layout->slot_stride;
+		return Slot{ (SlotHeader *)base, base + sizeof(SlotHeader) };
+	}
+
+	// True when no attached consumer still has to read the slot head reuses.
+	bool Writable(UInt64 head)
+	{
+		for (auto & entry : layout->consumers)
+		{
+			UInt64 cursor = entry.cursor.load();
+			if (cursor != kFree && head - cursor >= layout->slot_count)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void DetachDeadConsumers()
+	{
+		for (auto & entry : layout->consumers)
+		{
+			SInt32 pid = entry.pid.load(std::memory_order_acquire);
+			UInt64 cursor = entry.cursor.load(std::memory_order_acquire);
+			if (cursor != kFree && pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+			{
+				entry.cursor.compare_exchange_strong(cursor, kFree);
+			}
+		}
+	}
+
+	std::string path;
+	Layout * layout = nullptr;
+	std::size_t bytes;
+	bool producer;
+	int consumer = -1;
+};
+
+#else
+
+// POSIX shared memory is not available here; creating a ring fails.
+class PlaneRing
+{
+public:
+	static PlaneRing Create(const std::string &, std::size_t, std::size_t)
+	{
+		throw std::runtime_error("plane rings need Linux (POSIX shared memory)");
+	}
+
+	void WaitForConsumers(int) {}
+
+	void Publish(RingPlaneHeader, const void *) {}
+};
+
+#endif
+
+// Attaches to the plane ring name, waiting for the converter to create it,
+// and prints each plane with its minimum, maximum and mean until the
+// converter finishes; then prints the plane rate. A reference for streaming
+// consumers.
+void ConsumePlaneRing(const std::string & name);
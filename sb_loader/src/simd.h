@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "SBReadFile.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SB_LOADER_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+// Pixel kernels with SSE2 paths and scalar fallbacks. SSE2 is part of the
+// x86-64 baseline, so no runtime dispatch is needed.
+namespace util
+{
+	namespace detail
+	{
+		template <typename T>
+		void InterleaveScalar(const T * const * planes, int channels, std::size_t begin, std::size_t pixels, T * out)
+		{
+			for (std::size_t i = begin; i < pixels; i++)
+			{
+				for (int c = 0; c < channels; c++)
+				{
+					out[i * channels + c] = planes[c][i];
+				}
+			}
+		}
+	}
+
+	// Packs channel planes into one pixel-interleaved plane:
+	// out[i * channels + c] = planes[c][i].
+	inline void InterleaveChannels(const UInt16 * const * planes, int channels, std::size_t pixels, UInt16 * out)
+	{
+		std::size_t i = 0;
+#ifdef SB_LOADER_SSE2
+		if (channels == 2)
+		{
+			for (; i + 8 <= pixels; i += 8)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+				__m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+				_mm_storeu_si128((__m128i *)(out + i * 2), _mm_unpacklo_epi16(a, b));
+				_mm_storeu_si128((__m128i *)(out + i * 2 + 8), _mm_unpackhi_epi16(a, b));
+			}
+		}
+		else if (channels == 4)
+		{
+			for (; i + 8 <= pixels; i += 8)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+				__m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+				__m128i c = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+				__m128i d = _mm_loadu_si128((const __m128i *)(planes[3] + i));
+				__m128i ab_lo = _mm_unpacklo_epi16(a, b);
+				__m128i ab_hi = _mm_unpackhi_epi16(a, b);
+				__m128i cd_lo = _mm_unpacklo_epi16(c, d);
+				__m128i cd_hi = _mm_unpackhi_epi16(c, d);
+				_mm_storeu_si128((__m128i *)(out + i * 4), _mm_unpacklo_epi32(ab_lo, cd_lo));
+				_mm_storeu_si128((__m128i *)(out + i * 4 + 8), _mm_unpackhi_epi32(ab_lo, cd_lo));
+				_mm_storeu_si128((__m128i *)(out + i * 4 + 16), _mm_unpacklo_epi32(ab_hi, cd_hi));
+				_mm_storeu_si128((__m128i *)(out + i * 4 + 24), _mm_unpackhi_epi32(ab_hi, cd_hi));
+			}
+		}
+#endif
+		detail::InterleaveScalar(planes, channels, i, pixels, out);
+	}
+
+	inline void InterleaveChannels(const UInt8 * const * planes, int channels, std::size_t pixels, UInt8 * out)
+	{
+		std::size_t i = 0;
+#ifdef SB_LOADER_SSE2
+		if (channels == 2)
+		{
+			for (; i + 16 <= pixels; i += 16)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+				__m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+				_mm_storeu_si128((__m128i *)(out + i * 2), _mm_unpacklo_epi8(a, b));
+				_mm_storeu_si128((__m128i *)(out + i * 2 + 16), _mm_unpackhi_epi8(a, b));
+			}
+		}
+		else if (channels == 4)
+		{
+			for (; i + 16 <= pixels; i += 16)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+				__m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+				__m128i c = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+				__m128i d = _mm_loadu_si128((const __m128i *)(planes[3] + i));
+				__m128i ab_lo = _mm_unpacklo_epi8(a, b);
+				__m128i ab_hi = _mm_unpackhi_epi8(a, b);
+				__m128i cd_lo = _mm_unpacklo_epi8(c, d);
+				__m128i cd_hi = _mm_unpackhi_epi8(c, d);
+				_mm_storeu_si128((__m128i *)(out + i * 4), _mm_unpacklo_epi16(ab_lo, cd_lo));
+				_mm_storeu_si128((__m128i *)(out + i * 4 + 16), _mm_unpackhi_epi16(ab_lo, cd_lo));
+				_mm_storeu_si128((__m128i *)(out + i * 4 + 32), _mm_unpacklo_epi16(ab_hi, cd_hi));
+				_mm_storeu_si128((__m128i *)(out + i * 4 + 48), _mm_unpackhi_epi16(ab_hi, cd_hi));
+			}
+		}
+#endif
+		detail::InterleaveScalar(planes, channels, i, pixels, out);
+	}
+
+	// Fixed point gain with this many fractional bits, as used by
+	// CorrectFlatField.
+	const int kGainFractionBits = 12;
+
+	// plane = saturate((plane - dark) * gain / 2^kGainFractionBits), with the
+	// subtraction saturating at zero and the result rounded to nearest.
+	inline void CorrectFlatField(UInt16 * plane, const UInt16 * dark, const UInt16 * gain, std::size_t pixels)
+	{
+		std::size_t i = 0;
+#ifdef SB_LOADER_SSE2
+		const __m128i round = _mm_set1_epi32(1 << (kGainFractionBits - 1));
+		const __m128i bias32 = _mm_set1_epi32(0x8000);
+		const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+		for (; i + 8 <= pixels; i += 8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(plane + i));
+			__m128i d = _mm_loadu_si128((const __m128i *)(dark + i));
+			__m128i g = _mm_loadu_si128((const __m128i *)(gain + i));
+			__m128i diff = _mm_subs_epu16(v, d);
+			__m128i lo = _mm_mullo_epi16(diff, g);
+			__m128i hi = _mm_mulhi_epu16(diff, g);
+			__m128i p0 = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), kGainFractionBits);
+			__m128i p1 = _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), kGainFractionBits);
+			// SSE2 has no unsigned 32 to 16 bit pack: shift into signed range,
+			// pack with signed saturation and shift back
+			__m128i packed = _mm_packs_epi32(_mm_sub_epi32(p0, bias32), _mm_sub_epi32(p1, bias32));
+			_mm_storeu_si128((__m128i *)(plane + i), _mm_xor_si128(packed, bias16));
+		}
+#endif
+		for (; i < pixels; i++)
+		{
+			UInt32 diff = plane[i] > dark[i] ? plane[i] - dark[i] : 0;
+			UInt32 corrected = (diff * gain[i] + (1u << (kGainFractionBits - 1))) >> kGainFractionBits;
+			plane[i] = (UInt16)std::min<UInt32>(corrected, 65535);
+		}
+	}
+
+	namespace detail
+	{
+		// row[x] (+)= line[x], widening to 32 bits.
+		inline void AccumulateRow(const UInt16 * line, UInt32 * row, int width, bool first)
+		{
+			int x = 0;
+#ifdef SB_LOADER_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; x + 8 <= width; x += 8)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i *)(line + x));
+				__m128i lo = _mm_unpacklo_epi16(v, zero);
+				__m128i hi = _mm_unpackhi_epi16(v, zero);
+				if (!first)
+				{
+					lo = _mm_add_epi32(lo, _mm_loadu_si128((const __m128i *)(row + x)));
+					hi = _mm_add_epi32(hi, _mm_loadu_si128((const __m128i *)(row + x + 4)));
+				}
+				_mm_storeu_si128((__m128i *)(row + x), lo);
+				_mm_storeu_si128((__m128i *)(row + x + 4), hi);
+			}
+#endif
+			for (; x < width; x++)
+			{
+				row[x] = (first ? 0 : row[x]) + line[x];
+			}
+		}
+
+#ifdef SB_LOADER_SSE2
+		// Sums of adjacent pairs of eight 32 bit values.
+		inline __m128i AddPairs(__m128i a, __m128i b)
+		{
+			__m128 even = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1));
+			return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+		}
+#endif
+	}
+
+	// Bins a width x height UInt16 plane into factor x factor blocks, writing
+	// the (width / factor) x (height / factor) result to out; partial bins at
+	// the right and bottom edges are dropped. Bins hold the rounded mean of
+	// their pixels, or the sum saturated at 65535. out may be in, as each
+	// output row is written only after its input rows are consumed.
+	template <int Factor>
+	void BinPlane(const UInt16 * in, int width, int height, UInt16 * out, bool mean, std::vector<UInt32> & row)
+	{
+		const int out_width = width / Factor;
+		const int out_height = height / Factor;
+		const UInt32 count = Factor * Factor;
+		row.resize(width);
+		for (int y = 0; y < out_height; y++)
+		{
+			const UInt16 * lines = in + (std::size_t)y * Factor * width;
+			for (int dy = 0; dy < Factor; dy++)
+			{
+				detail::AccumulateRow(lines + (std::size_t)dy * width, row.data(), width, dy == 0);
+			}
+
+			UInt16 * dst = out + (std::size_t)y * out_width;
+			int x = 0;
+#ifdef SB_LOADER_SSE2
+			if (Factor == 2 || Factor == 4)
+			{
+				const __m128i round = _mm_set1_epi32(count / 2);
+				const __m128i bias32 = _mm_set1_epi32(0x8000);
+				const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+				for (; x + 4 <= out_width; x += 4)
+				{
+					const __m128i * src = (const __m128i *)(row.data() + x * Factor);
+					__m128i sums = detail::AddPairs(_mm_loadu_si128(src), _mm_loadu_si128(src + 1));
+					if (Factor == 4)
+					{
+						sums = detail::AddPairs(sums, detail::AddPairs(_mm_loadu_si128(src + 2), _mm_loadu_si128(src + 3)));
+					}
+					if (mean)
+					{
+						sums = _mm_srli_epi32(_mm_add_epi32(sums, round), Factor == 2 ? 2 : 4);
+					}
+					// sums stay below 2^20, so the signed pack saturates them at 65535
+					__m128i packed = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(sums, bias32), bias32), bias16);
+					_mm_storel_epi64((__m128i *)(dst + x), packed);
+				}
+			}
+#endif
+			for (; x < out_width; x++)
+			{
+				UInt32 sum = 0;
+				for (int dx = 0; dx < Factor; dx++)
+				{
+					sum += row[x * Factor + dx];
+				}
+				dst[x] = (UInt16)(mean ? (sum + count / 2) / count : std::min<UInt32>(sum, 65535));
+			}
+		}
+	}
+}
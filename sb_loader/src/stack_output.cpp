@@ -0,0 +1,134 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "fmt/format.h"
+#include "ordered_pipeline.h"
+#include "stack_output.h"
+
+int VerifyStagedOutput(const std::string & directory, const WriterOptions & options)
+{
+	const int width = 1001;
+	const int height = 3;
+	const int depth = 8;
+	const int units = 4;
+	const int threads = 2;
+	std::size_t plane_bytes = (std::size_t)width * height * sizeof(UInt16);
+	std::size_t pixels = plane_bytes / sizeof(UInt16);
+	auto expected = [](std::size_t plane, std::size_t pixel)
+	{
+		return (UInt16)(plane * 7919 + pixel);
+	};
+
+	int failures = 0;
+	auto report = [&](const std::string & name, const std::string & problem)
+	{
+		fmt::print("  {:<28} {}\n", name, problem.empty() ? std::string("ok") : problem);
+		failures += !problem.empty();
+	};
+
+	// as sized for a conversion: four planes and one per transform thread
+	PlanePool pool(plane_bytes, 4 + threads, kDirectIoAlignment);
+	auto writer = CreatePlaneWriter(options, pool);
+	std::string path = fmt::format("{}/sb_loader_verify_staged.raw", directory);
+	fmt::print("staged output: {} planes of {} bytes to {} with {} writer\n", depth * units, plane_bytes, path, writer->Name());
+
+	// a stalled conversion never returns, so it is reported from here
+	std::mutex mutex;
+	std::condition_variable finished;
+	bool done = false;
+	std::thread watchdog([&]
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!finished.wait_for(lock, std::chrono::seconds(60), [&] { return done; }))
+		{
+			fmt::print("  {:<28} {}\n", "direct, synced per unit", "stalled for 60 s");
+			std::fflush(stdout);
+			std::_Exit(1);
+		}
+	});
+	auto stop = [&]
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+		}
+		finished.notify_all();
+		watchdog.join();
+	};
+
+	try
+	{
+		StackOutput output(path, *writer, pool, true);
+		if (!output.IsDirect())
+		{
+			fmt::print("  {} is not written direct, nothing is staged\n", directory);
+		}
+		{
+			util::OrderedPipeline pipeline(threads);
+			for (int plane = 0; plane < depth * units; plane++)
+			{
+				auto buffer = std::make_shared<PlaneBuffer>(pool.Acquire());
+				pipeline.Submit([&, buffer, plane]
+				{
+					UInt16 * data = buffer->As<UInt16>();
+					for (std::size_t i = 0; i < pixels; i++)
+					{
+						data[i] = expected(plane, i);
+					}
+				}, [&, buffer, plane]
+				{
+					output.Write(std::move(*buffer), (UInt64)plane * plane_bytes, plane_bytes);
+					if ((plane + 1) % depth == 0)
+					{
+						output.Sync();
+					}
+				});
+			}
+			pipeline.Wait();
+		}
+		output.Finish();
+		report("direct, synced per unit", "");
+	}
+	catch (const std::exception & e)
+	{
+		stop();
+		report("direct, synced per unit", e.what());
+		std::remove(path.c_str());
+		return failures;
+	}
+	stop();
+
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	std::size_t length = file ? (std::size_t)file.tellg() : 0;
+	std::string problem;
+	if (length != plane_bytes * depth * units)
+	{
+		problem = fmt::format("{} bytes, expected {}", length, plane_bytes * depth * units);
+	}
+	else
+	{
+		file.seekg(0);
+		std::vector<UInt16> data(pixels);
+		for (int plane = 0; plane < depth * units && problem.empty(); plane++)
+		{
+			file.read((char *)data.data(), plane_bytes);
+			for (std::size_t i = 0; i < pixels; i++)
+			{
+				if (data[i] != expected(plane, i))
+				{
+					problem = fmt::format("plane {} differs at pixel {}", plane, i);
+					break;
+				}
+			}
+		}
+	}
+	report("planes read back", problem);
+	file.close();
+	std::remove(path.c_str());
+	return failures;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "output_file.h"
+#include "plane_writer.h"
+
+// An array of planes stored from data_offset on.
+//
+// Buffered files, and direct files where a write falls on kDirectIoAlignment
+// boundaries, get the buffers submitted as they are. Otherwise, for direct
+// files, data is copied into aligned staging buffers and written in whole
+// blocks; the final block is zero padded and the file
+// truncated back to its real length in Finish(). Staged writes must arrive in
+// file order.
+//
+// The staging buffers come from a small pool of the output's own, sized like
+// the pool's buffers: the pool may be drained by readers waiting on this
+// output's finish steps, so staging never waits on it.
+class StackOutput
+{
+public:
+	// one being filled, one being written and one for Sync()
+	static const std::size_t kStagingBuffers = 3;
+
+	StackOutput(const std::string & path, PlaneWriter & writer, PlanePool & pool, bool direct, bool keep = false)
+		: file(std::make_shared<OutputFile>(path, direct, keep))
+		, writer(writer)
+	{
+		if (file->IsDirect() && pool.Alignment() % kDirectIoAlignment != 0)
+		{
+			throw std::logic_error("direct output requires a pool aligned to kDirectIoAlignment");
+		}
+		if (file->IsDirect())
+		{
+			staging_pool.reset(new PlanePool(pool.BufferBytes(), kStagingBuffers, kDirectIoAlignment));
+		}
+	}
+
+	~StackOutput()
+	{
+		// staged writes still in the writer refer to staging_pool
+		if (staging_pool)
+		{
+			try
+			{
+				writer.Flush();
+			}
+			catch (...)
+			{
+			}
+		}
+	}
+
+	// Writes bytes of buffer at offset from the start of the array data.
+	void Write(PlaneBuffer && buffer, UInt64 offset, std::size_t bytes)
+	{
+		offset += data_offset;
+		if (!file->IsDirect() || (offset % kDirectIoAlignment == 0 && bytes % kDirectIoAlignment == 0))
+		{
+			Submit(std::move(buffer), offset, bytes);
+		}
+		else
+		{
+			Stage(buffer.data, bytes, offset);
+		}
+		end = std::max(end, offset + bytes);
+	}
+
+	// Writes bytes that precede the planes, e.g. a format header.
+	void WriteHeader(const void * data, std::size_t bytes)
+	{
+		if (file->IsDirect())
+		{
+			Stage((const UInt8 *)data, bytes, 0);
+		}
+		else
+		{
+			int error = file->WriteAt(data, bytes, 0);
+			if (error != 0)
+			{
+				throw std::runtime_error(fmt::format("unable to write header of {}: {}", file->Path(), strerror(error)));
+			}
+		}
+		end = std::max<UInt64>(end, bytes);
+	}
+
+	// Writes the padded final block, waits for the writer and trims the file.
+	void Finish()
+	{
+		if (staging)
+		{
+			std::size_t padded = util::AlignUp(staged, kDirectIoAlignment);
+			memset(staging.data + staged, 0, padded - staged);
+			Submit(std::move(staging), staging_offset, padded);
+		}
+		writer.Flush();
+		if (file->IsDirect())
+		{
+			file->Truncate(end);
+		}
+	}
+
+	// Makes everything written so far durable: a partly staged block is
+	// written padded (and rewritten whole later), the writer drained and the
+	// file synced.
+	void Sync()
+	{
+		if (staging && staged > 0)
+		{
+			PlaneBuffer copy = staging_pool->Acquire();
+			std::size_t padded = util::AlignUp(staged, kDirectIoAlignment);
+			memcpy(copy.data, staging.data, staged);
+			memset(copy.data + staged, 0, padded - staged);
+			Submit(std::move(copy), staging_offset, padded);
+		}
+		writer.Flush();
+		file->Sync();
+	}
+
+	const std::string & Path() const
+	{
+		return file->Path();
+	}
+
+	bool IsDirect() const
+	{
+		return file->IsDirect();
+	}
+
+	UInt64 data_offset = 0;
+
+private:
+	void Submit(PlaneBuffer && buffer, UInt64 offset, std::size_t bytes)
+	{
+		WriteRequest request;
+		request.file = file;
+		request.offset = offset;
+		request.bytes = bytes;
+		request.buffer = std::move(buffer);
+		writer.Submit(std::move(request));
+	}
+
+	void Stage(const UInt8 * data, std::size_t bytes, UInt64 offset)
+	{
+		if (offset != staging_offset + staged)
+		{
+			throw std::runtime_error(fmt::format("direct output to {} requires writes in file order", file->Path()));
+		}
+		while (bytes > 0)
+		{
+			if (!staging)
+			{
+				staging = staging_pool->Acquire();
+			}
+			std::size_t n = std::min(bytes, staging.capacity - staged);
+			memcpy(staging.data + staged, data, n);
+			staged += n;
+			data += n;
+			bytes -= n;
+			if (staged == staging.capacity)
+			{
+				Submit(std::move(staging), staging_offset, staged);
+				staging_offset += staged;
+				staged = 0;
+			}
+		}
+	}
+
+	std::shared_ptr<OutputFile> file;
+	PlaneWriter & writer;
+	UInt64 end = 0;
+
+	std::unique_ptr<PlanePool> staging_pool;
+	PlaneBuffer staging;
+	UInt64 staging_offset = 0;
+	std::size_t staged = 0;
+};
+
+// Converts synthetic planes of an odd size into a direct output in directory
+// the way a conversion with plane work and a journal does: planes are taken
+// from a pool no larger than the pipeline needs, written and synced from the
+// pipeline's finish steps, then read back. Returns the number of failed checks.
+int VerifyStagedOutput(const std::string & directory, const WriterOptions & options);
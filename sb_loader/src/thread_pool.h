@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+	// Fixed size pool of worker threads draining a FIFO of tasks.
+	class ThreadPool
+	{
+	public:
+		explicit ThreadPool(int thread_count)
+		{
+			if (thread_count < 1)
+			{
+				thread_count = 1;
+			}
+			for (int i = 0; i < thread_count; i++)
+			{
+				threads.emplace_back([this] { Run(); });
+			}
+		}
+
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			task_ready.notify_all();
+			for (auto & thread : threads)
+			{
+				thread.join();
+			}
+		}
+
+		ThreadPool(const ThreadPool &) = delete;
+		ThreadPool & operator=(const ThreadPool &) = delete;
+
+		void Post(std::function<void()> task)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				tasks.push_back(std::move(task));
+				pending++;
+			}
+			task_ready.notify_one();
+		}
+
+		// Blocks until every task posted so far has finished.
+		void Wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			all_done.wait(lock, [this] { return pending == 0; });
+		}
+
+		int Size() const
+		{
+			return (int)threads.size();
+		}
+
+	private:
+		void Run()
+		{
+			for (;;)
+			{
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					task_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+					if (tasks.empty())
+					{
+						return;
+					}
+					task = std::move(tasks.front());
+					tasks.pop_front();
+				}
+				task();
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					pending--;
+				}
+				all_done.notify_all();
+			}
+		}
+
+		std::vector<std::thread> threads;
+		std::deque<std::function<void()>> tasks;
+		std::mutex mutex;
+		std::condition_variable task_ready;
+		std::condition_variable all_done;
+		std::size_t pending = 0;
+		bool stopping = false;
+	};
+}
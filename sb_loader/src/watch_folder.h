@@ -0,0 +1,404 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fmt/format.h"
+#include "conversion_scheduler.h"
+#include "options.h"
+#include "reader_pool.h"
+
+#ifdef __linux__
+	#include <poll.h>
+	#include <sys/inotify.h>
+	#include <unistd.h>
+#endif
+
+// Reports .sld files appearing in a set of directories. On Linux inotify
+// wakes Wait() as soon as a file is created, written or moved in, either
+// the .sld itself or anything in its <name>.dir tree, which is reported as
+// the .sld; elsewhere Wait() sleeps and reports every .sld present.
+class FolderWatcher
+{
+public:
+	explicit FolderWatcher(const std::vector<std::string> & directories)
+		: directories(directories)
+	{
+#ifdef __linux__
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0)
+		{
+			throw std::runtime_error(fmt::format("inotify_init1 failed: {}", strerror(errno)));
+		}
+		for (auto & directory : directories)
+		{
+			int wd = inotify_add_watch(fd, directory.c_str(), kEvents);
+			if (wd < 0)
+			{
+				throw std::runtime_error(fmt::format("unable to watch {}: {}", directory, strerror(errno)));
+			}
+			watches[wd] = Watch{ directory, "" };
+			std::error_code error;
+			for (auto & entry : std::filesystem::directory_iterator(directory, error))
+			{
+				if (entry.is_directory(error) && IsData(entry.path().filename().string()))
+				{
+					WatchTree(entry.path().string(), Owner(entry.path()));
+				}
+			}
+		}
+#else
+		for (auto & directory : directories)
+		{
+			if (!std::filesystem::is_directory(directory))
+			{
+				throw std::runtime_error(fmt::format("unable to watch {}: not a directory", directory));
+			}
+		}
+#endif
+	}
+
+	~FolderWatcher()
+	{
+#ifdef __linux__
+		close(fd);
+#endif
+	}
+
+	FolderWatcher(const FolderWatcher &) = delete;
+	FolderWatcher & operator=(const FolderWatcher &) = delete;
+
+	// Every .sld file currently in the watched directories.
+	std::vector<std::string> Scan() const
+	{
+		std::vector<std::string> files;
+		for (auto & directory : directories)
+		{
+			std::error_code error;
+			for (auto & entry : std::filesystem::directory_iterator(directory, error))
+			{
+				if (IsSlideBook(entry.path().filename().string()))
+				{
+					files.push_back(entry.path().string());
+				}
+			}
+		}
+		return files;
+	}
+
+	// Waits up to timeout for activity and returns the .sld files it
+	// concerned, possibly with repeats.
+	std::vector<std::string> Wait(std::chrono::milliseconds timeout)
+	{
+#ifdef __linux__
+		std::vector<std::string> files;
+		pollfd ready = { fd, POLLIN, 0 };
+		if (poll(&ready, 1, (int)timeout.count()) <= 0)
+		{
+			return files;
+		}
+		alignas(inotify_event) char buffer[16384];
+		ssize_t length;
+		while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+		{
+			for (char * at = buffer; at < buffer + length;)
+			{
+				const inotify_event * event = (const inotify_event *)at;
+				at += sizeof(inotify_event) + event->len;
+				auto watch = watches.find(event->wd);
+				if (watch == watches.end())
+				{
+					continue;
+				}
+				if (event->mask & IN_IGNORED)
+				{
+					watches.erase(watch);
+					continue;
+				}
+				std::string name = event->len > 0 ? event->name : "";
+				std::string path = watch->second.directory + "/" + name;
+				bool directory = (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO));
+				if (!watch->second.owner.empty())
+				{
+					// inside a .dir tree
+					if (directory)
+					{
+						WatchTree(path, watch->second.owner);
+					}
+					files.push_back(watch->second.owner);
+				}
+				else if (IsSlideBook(name))
+				{
+					files.push_back(path);
+				}
+				else if (directory && IsData(name))
+				{
+					WatchTree(path, Owner(path));
+					files.push_back(Owner(path));
+				}
+			}
+		}
+		return files;
+#else
+		std::this_thread::sleep_for(timeout);
+		return Scan();
+#endif
+	}
+
+private:
+	static bool IsSlideBook(const std::string & name)
+	{
+		return name.size() > 4 && name.compare(name.size() - 4, 4, ".sld") == 0;
+	}
+
+	static bool IsData(const std::string & name)
+	{
+		return name.size() > 4 && name.compare(name.size() - 4, 4, ".dir") == 0;
+	}
+
+	// The .sld a <name>.dir belongs to.
+	static std::string Owner(const std::filesystem::path & data)
+	{
+		return std::filesystem::path(data).replace_extension(".sld").string();
+	}
+
+	std::vector<std::string> directories;
+#ifdef __linux__
+	static const uint32_t kEvents = IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY;
+
+	struct Watch
+	{
+		std::string directory;
+		std::string owner;	// the .sld whose .dir tree this is in, or empty
+	};
+
+	// Watches directory and every directory below it on behalf of owner.
+	void WatchTree(const std::string & directory, const std::string & owner)
+	{
+		std::vector<std::string> trees = { directory };
+		std::error_code error;
+		for (auto & entry : std::filesystem::recursive_directory_iterator(directory, error))
+		{
+			if (entry.is_directory(error))
+			{
+				trees.push_back(entry.path().string());
+			}
+		}
+		for (auto & tree : trees)
+		{
+			int wd = inotify_add_watch(fd, tree.c_str(), kEvents);
+			if (wd < 0)
+			{
+				// still converted, just not again on a change in here alone
+				fmt::print("unable to watch {}: {}\n", tree, strerror(errno));
+				continue;
+			}
+			watches[wd] = Watch{ tree, owner };
+		}
+	}
+
+	int fd = -1;
+	std::map<int, Watch> watches;
+#endif
+};
+
+// Total size and latest modification time of a .sld and of its companion
+// <name>.dir directory, where SlideBook keeps the image data.
+struct FileSignature
+{
+	bool exists = false;
+	UInt64 bytes = 0;
+	std::filesystem::file_time_type modified;
+
+	bool operator==(const FileSignature & other) const
+	{
+		return exists == other.exists && bytes == other.bytes && modified == other.modified;
+	}
+
+	bool operator!=(const FileSignature & other) const
+	{
+		return !(*this == other);
+	}
+
+	static FileSignature Of(const std::string & path)
+	{
+		namespace fs = std::filesystem;
+		FileSignature signature;
+		std::error_code error;
+		auto add = [&](const fs::path & file)
+		{
+			auto size = fs::file_size(file, error);
+			auto time = fs::last_write_time(file, error);
+			if (!error)
+			{
+				signature.bytes += size;
+				signature.modified = std::max(signature.modified, time);
+			}
+		};
+		if (!fs::is_regular_file(path, error))
+		{
+			return signature;
+		}
+		signature.exists = true;
+		signature.modified = fs::file_time_type::min();
+		add(path);
+		fs::path data = fs::path(path).replace_extension(".dir");
+		if (fs::is_directory(data, error))
+		{
+			for (auto & entry : fs::recursive_directory_iterator(data, error))
+			{
+				if (entry.is_regular_file(error))
+				{
+					add(entry.path());
+				}
+			}
+		}
+		return signature;
+	}
+};
+
+namespace detail
+{
+	inline volatile std::sig_atomic_t & WatchStopRequested()
+	{
+		static volatile std::sig_atomic_t requested = 0;
+		return requested;
+	}
+
+	inline void RequestWatchStop(int)
+	{
+		WatchStopRequested() = 1;
+	}
+}
+
+// Converts .sld files as they arrive in options.watch_dirs until SIGINT or
+// SIGTERM, then waits for the conversions under way. A file is queued once
+// neither its size nor its modification time (nor those of its .dir) has
+// changed for options.settle_seconds, and again should it change after
+// that, though not before its earlier conversion has finished. Each
+// conversion is budgeted --pool-mb of memory against --memory-mb. Returns
+// the number of failed conversions.
+inline int WatchFolders(const ConvertOptions & options, const std::function<bool(const ConvertOptions &)> & convert)
+{
+	using Clock = std::chrono::steady_clock;
+	struct Candidate
+	{
+		FileSignature signature;
+		Clock::time_point since;
+	};
+
+	FolderWatcher watcher(options.watch_dirs);
+	// queued or running; a file settling again waits in pending until its
+	// conversion is out of here, so two never write the same outputs
+	std::mutex in_flight_mutex;
+	std::set<std::string> in_flight;	// outlives the jobs below
+	ConversionScheduler scheduler(options.jobs, (std::size_t)options.memory_mb << 20);
+	const std::size_t job_memory = (std::size_t)options.pool_mb << 20;
+	const auto settle = std::chrono::seconds(options.settle_seconds);
+
+	std::map<std::string, Candidate> pending;
+	std::map<std::string, FileSignature> queued;
+	auto notice = [&](const std::string & path)
+	{
+		if (!pending.count(path))
+		{
+			pending[path] = Candidate{ FileSignature::Of(path), Clock::now() };
+		}
+	};
+	if (options.watch_existing)
+	{
+		for (auto & path : watcher.Scan())
+		{
+			notice(path);
+		}
+	}
+
+	std::signal(SIGINT, detail::RequestWatchStop);
+	std::signal(SIGTERM, detail::RequestWatchStop);
+	fmt::print("watching {} director{} with {} jobs and {} MB\n", options.watch_dirs.size(),
+		options.watch_dirs.size() == 1 ? "y" : "ies", options.jobs, options.memory_mb);
+
+	while (!detail::WatchStopRequested())
+	{
+		for (auto & path : watcher.Wait(std::chrono::seconds(1)))
+		{
+			notice(path);
+		}
+		ReaderPool::Shared().Evict();
+		auto now = Clock::now();
+		for (auto candidate = pending.begin(); candidate != pending.end();)
+		{
+			const std::string & path = candidate->first;
+			FileSignature signature = FileSignature::Of(path);
+			if (!signature.exists)
+			{
+				candidate = pending.erase(candidate);
+				continue;
+			}
+			if (signature != candidate->second.signature)
+			{
+				candidate->second = Candidate{ signature, now };
+			}
+			else if (now - candidate->second.since >= settle)
+			{
+				{
+					std::lock_guard<std::mutex> lock(in_flight_mutex);
+					if (in_flight.count(path))
+					{
+						++candidate;
+						continue;
+					}
+				}
+				auto done = queued.find(path);
+				if (done == queued.end() || done->second != signature)
+				{
+					queued[path] = signature;
+					ReaderPool::Shared().Discard(path);
+					ConvertOptions job = options;
+					job.command = "convert";
+					job.filename = path;
+					{
+						std::lock_guard<std::mutex> lock(in_flight_mutex);
+						in_flight.insert(path);
+					}
+					fmt::print("queueing {} ({} queued)\n", path, scheduler.Queued() + 1);
+					scheduler.Submit(path, job_memory, [job, &convert, &in_flight_mutex, &in_flight]
+					{
+						struct Finished
+						{
+							std::mutex & mutex;
+							std::set<std::string> & in_flight;
+							const std::string & path;
+
+							~Finished()
+							{
+								std::lock_guard<std::mutex> lock(mutex);
+								in_flight.erase(path);
+							}
+						} finished{ in_flight_mutex, in_flight, job.filename };
+						if (!convert(job))
+						{
+							throw std::runtime_error("conversion failed");
+						}
+					});
+				}
+				candidate = pending.erase(candidate);
+				continue;
+			}
+			++candidate;
+		}
+	}
+
+	fmt::print("stopping, waiting for {} queued conversions\n", scheduler.Queued());
+	scheduler.Wait();
+	return scheduler.Failures();
+}
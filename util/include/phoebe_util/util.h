@@ -1,8 +1,51 @@
 #pragma once
+#include <cstdio>
 #include <iostream>
+#include <string>
 
 #ifdef _WIN32
 	#define EXIT(C) {std::cout << "enter to continue." << std::endl; std::cin.get(); exit(C);}
 #else
 	#define EXIT(C) exit(C)
-#endif
\ No newline at end of file
+#endif
+
+namespace util
+{
+	// file name without directory or extension
+	inline std::string FileStem(const std::string & path)
+	{
+		auto slash = path.find_last_of("/\\");
+		std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+		auto dot = name.find_last_of('.');
+		return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+	}
+
+	// s as a quoted JSON string
+	inline std::string JsonString(const std::string & s)
+	{
+		std::string out = "\"";
+		for (unsigned char ch : s)
+		{
+			switch (ch)
+			{
+			case '"': out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n"; break;
+			case '\r': out += "\\r"; break;
+			case '\t': out += "\\t"; break;
+			default:
+				if (ch < 0x20)
+				{
+					char escaped[8];
+					snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+					out += escaped;
+				}
+				else
+				{
+					out += ch;
+				}
+			}
+		}
+		return out + "\"";
+	}
+}